@@ -1,5 +1,38 @@
 /*
  * mm.c
+ *
+ * Segregated free lists of blocks with a header, and a footer while
+ * free. The heap is split into arenas, each with its own free lists and
+ * lock: the main arena is the heap of memlib, the others are regions
+ * mapped beside it and aligned to their size, so that the arena of a
+ * block is found from its address. A thread takes an arena when it first
+ * allocates, a new one while there are less than ARENA_MAX.
+ *
+ * Requests up to SLAB_MAX bytes are served from slabs: runs of SLAB_SIZE
+ * bytes, aligned to it, holding objects of one size class with no header.
+ * A run is an allocated block of its arena, and the page map of the arena
+ * tells the objects of runs from the blocks. Free objects of a run are a
+ * stack linked through them, objects never used are taken from its end.
+ *
+ * Small objects freed by a thread are kept in its own bins (tcache) and
+ * handed out again without a lock. A block freed by a thread of another
+ * arena is pushed to the remote-free stack of its arena, and freed by the
+ * arena when it next holds its lock.
+ *
+ * Headers stay 32-bit: links are offsets in units of 8 bytes, so an arena
+ * reaches 32 GB, and free blocks stop coalescing at BLOCK_MAX. Requests of
+ * MMAP_MIN bytes and more are mapped on their own, aligned to huge pages,
+ * with the length of the mapping in 8 bytes before the header, and the
+ * mapped bit (0x4) set in the header. They are unmapped on free.
+ *
+ * Memory goes back to the OS by decay: a free block of PURGE_MIN bytes
+ * and more that stayed in the tree for a whole DECAY_MS has its pages
+ * released with madvise, and the free block at the top of an arena other
+ * than the main one is cut off its region. mm_trim() does it all at once.
+ *
+ * The heap grows by at least a->grow bytes, from CHUNKSIZE: doubled when
+ * the arena extends again within GROW_FITS fits, up to a part of its heap,
+ * halved when extensions get rare, and back to CHUNKSIZE on a trim.
  */
 
 #include <assert.h>
@@ -8,6 +41,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "contracts.h"
 
 #include "mm.h"
@@ -28,17 +64,21 @@
  *  -----------------
  *  - dbg_printf acts like printf, but will not be run in a release build.
  *  - checkheap acts like mm_checkheap, but prints the line it failed on and
- *    exits if it fails.
+ *    exits if it fails. It only runs in a DEBUG build, after every call.
  */
 
 #ifndef NDEBUG
 #define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#ifdef DEBUG
 #define checkheap(verbose) do {if (mm_checkheap(verbose)) {  \
                              printf("Checkheap failed on line %d\n", __LINE__);\
                              exit(-1);  \
                         }}while(0)
 #else
-#define dbg_printf(...)
 #define checkheap(...)
 #endif
 
@@ -47,17 +87,173 @@
 #define ALIGNMENT 8         //double word alignment
 #define WSIZE 4             //word size
 #define DSIZE 8             //double word size
-#define CHUNKSIZE (1 << 9)  //extend heap by chunksize
+#define CHUNKSIZE (1 << 9)  //smallest heap extension
+#define GROW_MAX (1 << 20)          //largest heap extension
+#define GROW_RATIO 64               //extensions up to this part of the heap
+#define GROW_FITS 16                //fits between extensions that grow them
+#define BLOCK_MAX (1UL << 31)       //largest block, free ones included
+#define SHRINK_MIN 64               //smallest tail freed by realloc
+#define HEAP_MAX (1L << 35)         //of an arena, 32-bit links of 8 bytes
+
+#define MMAP_MIN (1L << 22)         //smallest request mapped on its own
+#define HUGE_SIZE (1L << 21)        //alignment of mapped blocks
+
+#define SL_LOG 3                    //log2 of lists of a power of two
+#define SL_NUM (1 << SL_LOG)        //second-level lists of a first level
+#define FL_SHIFT (SL_LOG + 3)       //blocks under 1 << FL_SHIFT are level 0
+#define TREE_SHIFT 12               //blocks from 1 << TREE_SHIFT are in the tree
+#define FL_NUM (TREE_SHIFT - FL_SHIFT + 1)      //first levels of lists
+#define LIST_NUM (FL_NUM * SL_NUM)  //number of free list
+
+#define ARENA_MAX 16                //max number of arenas, main one included
+#define ARENA_SIZE (1L << 26)       //region of an arena other than the main one
+
+#define SLAB_MAX 256                //largest request served from slabs
+#define SLAB_SIZE 2048              //size and alignment of a run
+#define SLAB_CLASSES 16             //size classes of slabs
+#define MAIN_PAGES (HEAP_MAX / SLAB_SIZE)       //page map of main arena
+
+#define PURGE_MIN (1 << 16)         //smallest free block whose pages decay
+#define DECAY_MS 1000               //time before free pages are released
+#define PURGED 0xffffffffU          //stamp of a block whose pages are released
+
+#define TCACHE_COUNT 7              //max objects of a bin
+
+
+/*
+ * counts of an arena, under its lock, printed by mm_stats()
+ * blocks are counted by the list of their size, the tree last
+ */
+typedef struct stats {
+    unsigned long slab_allocs[SLAB_CLASSES];    //objects taken from runs
+    unsigned long slab_frees[SLAB_CLASSES];     //objects put back to runs
+    unsigned long allocs[LIST_NUM + 1];
+    unsigned long frees[LIST_NUM + 1];
+    unsigned long fits;         //searches of the lists and tree
+    unsigned long probes;       //free blocks looked at by them
+    unsigned long probe_max;    //by one search
+    unsigned long extends;      //of the heap
+    unsigned long extend_bytes;
+} stats;
+
+/*
+ * an arena: a heap with its own free lists and lock
+ * free lists are two-level (TLSF): a first level for each power of two,
+ * split in SL_NUM lists, with a bitmap of the lists that are not empty
+ * blocks of 1 << TREE_SHIFT bytes and more are in a treap instead,
+ * ordered by size then address
+ * links, heads and the root are 32-bit offsets from basep, 0 for none
+ */
+typedef struct arena {
+    char *listp;                //payload of prologue
+    char *basep;
+    unsigned int fl_map;        //bit fl set if a list of level fl has blocks
+    unsigned int sl_map[FL_NUM];        //bit sl set if list (fl, sl) has blocks
+    unsigned int heads[LIST_NUM];
+    unsigned int root;          //of the tree of large free blocks
+    char *brk;                  //end of region in use, not for main arena
+    char *max;                  //end of region
+    pthread_mutex_t lock;
+    void *remote;               //blocks freed by other threads, lock-free stack
+    struct slab *partial[SLAB_CLASSES];     //runs with free objects
+    uint64_t *pages;            //page map, a bit set for each run
+    char *page_base;            //address of page 0
+    size_t page_num;            //pages of the page map
+    size_t page_words;          //words of the page map ever set
+    unsigned int epoch;         //of decay, stamped on blocks put in the tree
+    long decay_time;            //when the epoch began, in ms
+    size_t purged;              //bytes of free blocks released to the OS
+    size_t grow;                //least bytes of the next heap extension
+    unsigned long grow_fits;    //fits at the last one
+    stats st;
+} arena;
+
+/*
+ * a run of objects of one size class, at the start of its SLAB_SIZE page
+ * the objects follow it up to end
+ */
+typedef struct slab {
+    struct slab *next;          //in the partial list of its class
+    struct slab *prev;
+    void *free;                 //free objects, linked through them
+    char *bump;                 //objects from here on were never used
+    char *end;
+    unsigned int cls;
+    unsigned int used;          //objects not free in the run
+} slab;
+
+/* bins of free slab objects of a thread, linked through them */
+typedef struct tcache {
+    void *bin[SLAB_CLASSES];    //by size class
+    unsigned char count[SLAB_CLASSES];
+    int blocks;                 //in all bins
+    unsigned long hits[SLAB_CLASSES];   //objects taken from the bins
+    unsigned long puts[SLAB_CLASSES];   //objects kept in them
+} tcache;
 
-#define LIST_NUM 10         //number of free list
-#define LIST_TRSH 2         //threshold of best fit and first fit
+/* Global vars */
+static arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static arena *arenas[ARENA_MAX];    //main arena first
+static uint64_t main_pages[MAIN_PAGES / 64];    //page map of main arena
+static int arena_num = 0;
+static unsigned int arena_next = 0; //threads given an arena
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int heap_gen = 0;   //heaps made by mm_init
+static size_t map_bytes = 0;        //of blocks mapped on their own
+static unsigned long bin_hits[SLAB_CLASSES];    //of the bins of exited threads
+static unsigned long bin_puts[SLAB_CLASSES];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+/* thread state, valid for the heap of thread_gen */
+static __thread arena *thread_arena;
+static __thread tcache thread_cache;
+static __thread unsigned int thread_gen;
+
+/* object size of each slab class */
+static const unsigned int slab_size[SLAB_CLASSES] = {
+    8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+
+/* slab class of a request, by its size rounded up to 8 bytes */
+static const unsigned char slab_class[SLAB_MAX / ALIGNMENT + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15
+};
 
 
 /* helper inline functions */
 
 /* Return whether the pointer is in the heap */
 static inline int in_heap(const void* p) {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+    if (p <= mem_heap_hi() && p >= mem_heap_lo()) {
+        return 1;
+    }
+
+    /* or in the region of another arena */
+    for (int i = 1; i < ARENA_MAX && arenas[i] != NULL; i++) {
+        if (p >= (void *)arenas[i] && p < (void *)arenas[i]->brk) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * return the arena of a block
+ * by the arena table, the brk of the main heap moves under its lock
+ */
+static inline arena *arena_of(void *bp){
+    arena *a = (arena *)((uintptr_t)bp & ~(ARENA_SIZE - 1));
+    int n = __atomic_load_n(&arena_num, __ATOMIC_ACQUIRE);
+
+    for (int i = 1; i < n; i++) {
+        if (arenas[i] == a) {
+            return a;
+        }
+    }
+    return &main_arena;
 }
 
 /* return the larger one of the two arguments */
@@ -65,23 +261,32 @@ static inline size_t max(size_t x, size_t y){
     return (x > y) ? x : y;
 }
 
+/* return the smaller one of the two arguments */
+static inline size_t min(size_t x, size_t y){
+    return (x < y) ? x : y;
+}
+
 /* pack size, prev_alloc and alloc into one word (header) */
 static inline size_t pack(size_t size, size_t prev_alloc, size_t alloc){
     return size | prev_alloc | alloc;
 }
 
-/* return the word and adress p */
+/*
+ * return the word and adress p
+ * relaxed atomic, as free() reads the size of a header without the lock
+ * while the owner of its arena may set its prev_alloc bit
+ */
 static inline unsigned int get(void *p){
     REQUIRES(p != NULL);
     REQUIRES(in_heap(p));
-    return *(unsigned int *)p;
+    return __atomic_load_n((unsigned int *)p, __ATOMIC_RELAXED);
 }
 
 /* write val at address p */
 static inline void put(void *p, size_t val){
     REQUIRES(p != NULL);
     REQUIRES(in_heap(p));
-    *(unsigned int *)p = val;
+    __atomic_store_n((unsigned int *)p, val, __ATOMIC_RELAXED);
 }
 
 /* return the size bit of header */
@@ -108,28 +313,28 @@ static inline size_t getAlloc(void *p){
 /* return the address of header */
 static inline char* getHdAddr(void *bp){
     REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+    REQUIRES(in_heap((char *)bp - WSIZE));
     return (char *)bp - WSIZE;
 }
 
 /* return the address of footer */
 static inline char* getFtAddr(void *bp){
     REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+    REQUIRES(in_heap((char *)bp - WSIZE));
     return (char *)bp + getSize(getHdAddr(bp)) - DSIZE;
 }
 
 /* return the address of next block */
 static inline char* nextAddr(void *bp){
     REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+    REQUIRES(in_heap((char *)bp - WSIZE));
     return (char *)bp + getSize((char *)bp - WSIZE);
 }
 
 /* return the address of previous block */
 static inline char* prevAddr(void *bp){
     REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+    REQUIRES(in_heap((char *)bp - WSIZE));
     return (char *)bp - getSize((char *)bp - DSIZE);
 }
 
@@ -147,6 +352,24 @@ static inline void* prevPtr(void *bp){
     return (char *)bp + WSIZE;
 }
 
+/* return the block at a link offset of arena */
+static inline char *atOffset(arena *a, unsigned int offset){
+    return a->basep + ((size_t)offset << 3);
+}
+
+/* return the link offset of a block of arena */
+static inline unsigned int offsetOf(arena *a, void *bp){
+    return ((char *)bp - a->basep) >> 3;
+}
+
+/*
+ * return whether bp is a block mapped on its own
+ * not for slab objects, which have no header
+ */
+static inline int isMapped(void *bp){
+    return __atomic_load_n((unsigned int *)bp - 1, __ATOMIC_RELAXED) & 0x4;
+}
+
 /* set the prev_alloc bit to 1 */
 static inline void setPrevAlloc(void *p){
     REQUIRES(p != NULL);
@@ -166,30 +389,130 @@ static inline size_t align(size_t size){
     return (size + (ALIGNMENT - 1)) & ~0X7;
 }
 
+/* return the block size of a request of size bytes */
+static inline size_t adjust(size_t size){
+    if (size <= (DSIZE + WSIZE)){
+        return 2 * DSIZE;
+    }
+    return align(size + WSIZE);
+}
+
 /* Check if the given pointer is 8-byte aligned */
 static inline int aligned(void *p) {
     REQUIRES(p != NULL);
     REQUIRES(in_heap(p));
-    return align(getSize(getHdAddr(p)) == getSize(getHdAddr(p)));
+    return ((uintptr_t)p & (DSIZE - 1)) == 0;
 }
 
-/* Global vars */
-static char *heap_listp = 0;
-static char *heap_basep = 0;
+/* return the slab class of a request of size bytes */
+static inline size_t slabClass(size_t size){
+    return slab_class[(size + ALIGNMENT - 1) / ALIGNMENT];
+}
+
+/* return the run holding a slab object */
+static inline slab *slabOf(void *bp){
+    return (slab *)((uintptr_t)bp & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/*
+ * return whether bp is an object of a run of arena
+ * read without the lock: the bit of an object in use does not change
+ */
+static inline int isSlab(arena *a, void *bp){
+    size_t page = ((char *)bp - a->page_base) / SLAB_SIZE;
+
+    if (page >= a->page_num) {
+        /* a mapped block */
+        return 0;
+    }
+    return (__atomic_load_n(&a->pages[page / 64], __ATOMIC_RELAXED) >>
+        (page % 64)) & 1;
+}
+
+/* return the bytes before the run in the free block at bp */
+static inline size_t runLead(void *bp){
+    size_t lead = -(uintptr_t)bp & (SLAB_SIZE - 1);
+
+    if (lead != 0 && lead < 2 * DSIZE) {
+        /* too small for a free block */
+        lead += SLAB_SIZE;
+    }
+    return lead;
+}
 
 /* basic helper funtions for malloc */
-static void *extend_heap(size_t words);
-static void *coalesce(void *bp);
-static void *find_fit(size_t asize);
-static void place(void *bp, size_t asize);
+static void *extend_heap(arena *a, size_t words);
+static void *arena_grow(arena *a, size_t asize);
+static void *coalesce(arena *a, void *bp);
+static void *find_fit(arena *a, size_t asize);
+static void *search_fit(arena *a, size_t asize);
+static void place(arena *a, void *bp, size_t asize);
+static void carve(arena *a, void *bp, size_t asize, size_t n, void **ptrs);
+static int ptr_cmp(const void *x, const void *y);
+static void free_block(arena *a, void *bp);
+static int grow(arena *a, void *bp, size_t asize);
+static void *resize(arena *a, void *bp, size_t asize);
+
+/* helper functions for arenas and threads */
+static void *arena_sbrk(arena *a, size_t incr);
+static int arena_init(arena *a);
+static void *arena_malloc(arena *a, size_t size);
+static void arena_free(arena *a, void *bp);
+static size_t arena_malloc_batch(arena *a, size_t size, size_t n, void **ptrs);
+static arena *relock(arena *locked, arena *a);
+static void release(void *bp);
+static void remote_drain(arena *a);
+static inline void *tcache_get(size_t cls);
+static inline int tcache_put(void *bp, size_t cls);
+static void tcache_flush(arena *locked);
+static void thread_init_key(void);
+static inline void thread_init(void);
+
+/* helper functions for mapped blocks */
+static void *map_malloc(size_t size);
+static void map_free(void *bp);
+static inline size_t mapSize(void *bp);
+
+/* helper functions for trimming */
+static char *heap_end(arena *a);
+static size_t purge_block(arena *a, void *bp, size_t keep);
+static void purge_old(arena *a, size_t minSize, unsigned int epoch);
+static size_t trim_top(arena *a, size_t pad);
+static void arena_decay(arena *a);
+static void arena_stats(arena *a, size_t *mapped, size_t *resident);
+
+/* helper functions for slabs */
+static void *slab_malloc(arena *a, size_t cls);
+static void slab_free(arena *a, void *bp);
+static slab *slab_new(arena *a, size_t cls);
+static void *run_fit(arena *a);
+static void *search_run(arena *a);
+static void place_run(arena *a, void *bp);
+
+/* helper functions for checking and stats */
+static int check_fail(arena *a, void *bp, const char *msg);
+static int check_heap(arena *a, size_t *freeBlocks);
+static int check_lists(arena *a, size_t *listed);
+static int check_tree(arena *a, unsigned int t, void *lo, void *hi, size_t *listed);
+static int check_runs(arena *a);
+static void arena_frag(arena *a, size_t *freeBytes, size_t *freeBlocks, size_t *largest);
 
 /* helper functions for list management */
-static inline void insert_node(void *bp, size_t index);
-static inline void delete_node(void *bp);
+static inline void insert_node(arena *a, void *bp, size_t index);
+static inline void delete_node(arena *a, void *bp);
 static size_t getListNum(size_t size);
+static size_t listSize(size_t index);
+static inline size_t nextList(arena *a, size_t index);
 
-static inline void* nextInList(void *bp);
-static inline void* prevInList(void *bp);
+static inline void* nextInList(arena *a, void *bp);
+
+/* helper functions for the tree of large blocks */
+static void tree_insert(arena *a, void *bp);
+static void tree_delete(arena *a, void *bp);
+static void *tree_fit(arena *a, size_t asize);
+static void *tree_next(arena *a, void *bp);
+static inline unsigned int *stampPtr(void *bp);
+static inline unsigned int *purgedPtr(void *bp);
 
 
 /*
@@ -200,36 +523,27 @@ static inline void* prevInList(void *bp);
 
 /*
  * Performs necessary initializations, such as allocating the initial heap area
+ * the arenas of the last heap are dropped
  * return -1 on error, 0 on success.
  */
 int mm_init(void){
-    size_t prologue_size = (2 * LIST_NUM + 2) * WSIZE;
-
-    if ((heap_listp = mem_sbrk(prologue_size + DSIZE)) == (void *)-1) {
-        return -1;
-    }
-
-    put(heap_listp, pack(0, 0, 0));         /* alignment padding */
-    put(heap_listp + WSIZE, pack(prologue_size, 2, 1));     /* prologue header */
-
-    /* use prologue body to save list head nodes */
-    size_t list_head;
-    for (size_t i = 0; i < LIST_NUM; i++) {
-        list_head = (i + 1) * DSIZE;
-        put(heap_listp + list_head, list_head);
-        put(heap_listp + (list_head + WSIZE), list_head);
-    }
-
-    heap_basep = heap_listp;
-    heap_listp = heap_listp + DSIZE;        /* move heap_listp to the payload of prologue */
-    put(getFtAddr(heap_listp), pack(prologue_size, 2, 1));      /* prologue footer */
-    put(getFtAddr(heap_listp) + WSIZE, pack(0, 2, 1));      /* epilogue header */
+    pthread_once(&thread_once, thread_init_key);
 
-    if (extend_heap(CHUNKSIZE * 8 / WSIZE) == NULL){
-        return -1;
+    for (int i = 1; i < arena_num; i++) {
+        munmap(arenas[i], ARENA_SIZE);
+        arenas[i] = NULL;
     }
-
-    return 0;
+    main_arena.remote = NULL;
+    main_arena.pages = main_pages;
+    main_arena.page_num = MAIN_PAGES;
+    arenas[0] = &main_arena;
+    arena_num = 1;
+    arena_next = 0;
+    heap_gen++;
+    memset(bin_hits, 0, sizeof(bin_hits));
+    memset(bin_puts, 0, sizeof(bin_puts));
+
+    return arena_init(&main_arena);
 }
 
 /*
@@ -239,41 +553,37 @@ int mm_init(void){
  * always return 8-byte aligned pointers
  */
 void *malloc(size_t size){
-    //mm_checkheap(0);
-
-    size_t asize;
-    size_t extendsize;
+    arena *a;
     char *bp;
 
     if (size <= 0){
         return NULL;
     }
 
-    /* align size to double word */
-    if (size <= (DSIZE + WSIZE)){
-        asize = 2 * DSIZE;
-    }
-    else{
-        asize = align(size + WSIZE);
+    if (size >= MMAP_MIN) {
+        /* too large for the heap */
+        return map_malloc(size);
     }
 
-    /* search the freelist for a fit */
-    if ((bp = find_fit(asize)) != NULL){
-        place(bp, asize);
+    /* an object of the class freed by this thread */
+    thread_init();
+    if (size <= SLAB_MAX && (bp = tcache_get(slabClass(size))) != NULL) {
         return bp;
     }
 
-    /* no fit found --> extend heap */
-    extendsize = max(asize, CHUNKSIZE);
+    a = thread_arena;
+    pthread_mutex_lock(&a->lock);
+    bp = arena_malloc(a, size);
+    pthread_mutex_unlock(&a->lock);
 
-    if ((bp = extend_heap(extendsize / WSIZE)) == NULL){
-        return NULL;
+    if (bp == NULL && a != &main_arena) {
+        /* region of the arena is full */
+        pthread_mutex_lock(&main_arena.lock);
+        bp = arena_malloc(&main_arena, size);
+        pthread_mutex_unlock(&main_arena.lock);
     }
 
-    /* allocate in newly extended memory */
-    place(bp, asize);
-    
-    //mm_checkheap(0);
+    checkheap(0);
     return bp;
 }
 
@@ -284,19 +594,26 @@ void *malloc(size_t size){
  * free(NULL) has no effect
  */
 void free(void *ptr){
+    arena *a;
 
     if (ptr == NULL) {
         return;
     }
 
-    size_t size = getSize(getHdAddr(ptr));              //size of the block to free
-    size_t prev_alloc = getPrevAlloc(getHdAddr(ptr));   //the prev_alloc bit
-
-    /* set allocate bit to 0 */
-    put(getHdAddr(ptr), pack(size, prev_alloc, 0));
-    put(getFtAddr(ptr), size);
-
-    coalesce(ptr);
+    /* kept by this thread if it is a slab object */
+    thread_init();
+    a = arena_of(ptr);
+    if (isSlab(a, ptr)) {
+        if (tcache_put(ptr, slabOf(ptr)->cls)) {
+            return;
+        }
+    }
+    else if (isMapped(ptr)) {
+        map_free(ptr);
+        return;
+    }
+    release(ptr);
+    checkheap(0);
 }
 
 /*
@@ -318,68 +635,72 @@ void *realloc(void *ptr, size_t size){
 
     void *newptr;       //ptr to newly allocated block
     size_t newSize;     //aligned size of the new block
-    size_t oldSize = getSize(getHdAddr(ptr));           //size of the old block
-    size_t prev_alloc = getPrevAlloc(getHdAddr(ptr));       //if the prev block is allocated
-    size_t tSize;
-
-    /* align realloc size */
-    if (size <= (DSIZE + WSIZE)){
-        newSize = 2 * DSIZE;
+    size_t oldSize;     //size of the old block
+    arena *a = arena_of(ptr);                           //arena of the old block
+
+    if (isSlab(a, ptr)) {
+        /* objects of a run do not grow */
+        oldSize = slab_size[slabOf(ptr)->cls];
+        if (size <= oldSize) {
+            return ptr;
+        }
+        if ((newptr = malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, ptr, oldSize);
+        free(ptr);
+        return newptr;
     }
-    else{
-        newSize = align(size + WSIZE);
+
+    if (isMapped(ptr)) {
+        /* mapped blocks do not grow either */
+        oldSize = mapSize(ptr);
+        if (size <= oldSize) {
+            return ptr;
+        }
+        if ((newptr = malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, ptr, oldSize);
+        free(ptr);
+        return newptr;
     }
 
-    if (newSize <= oldSize){
-        /* the old block is big enough for the new one */
+    /* align realloc size */
+    oldSize = getSize(getHdAddr(ptr));
+    newSize = adjust(size);
+
+    if (newSize <= oldSize && oldSize - newSize < SHRINK_MIN){
+        /* the old block is big enough for the new one, with no tail to free */
         return ptr;
     }
-    else {
-        size_t next_alloc = getAlloc(getHdAddr(nextAddr(ptr)));
-
-        if (!next_alloc) {
-            /* next block of the old block is free */
-            tSize = oldSize + getSize(getHdAddr(nextAddr(ptr)));
-
-            if (tSize >= newSize){
-                /* old block size plus next block size is large enough for the new block */
-                delete_node(nextAddr(ptr));
-
-                if (tSize - newSize >= 2 * DSIZE){
-                    /* free part of the next block is large enough to form a new free block */
-                    /* first part as the new block */
-                    put(getHdAddr(ptr), pack(newSize, prev_alloc, 1));
-
-                    /* second part as a new free block */
-                    put(getHdAddr(nextAddr(ptr)), pack(tSize - newSize, 2, 0));
-                    put(getFtAddr(nextAddr(ptr)), pack(tSize - newSize, 0, 0));
-                    setPrevFree(getHdAddr(nextAddr(nextAddr(ptr))));
-                    insert_node(nextAddr(ptr), getListNum(tSize - newSize));
-                }
-                else{
-                    /* do not need to split the block */
-                    put(getHdAddr(ptr), pack(tSize, prev_alloc, 1));
-                    setPrevAlloc(getHdAddr(nextAddr(ptr)));
-                }
-
-                return ptr;
-            }
-        }
 
-        /* if the sum size of old block and the next block is not large enough 
-        ** call malloc, copy the contents and free the old block */
-        newptr = malloc(size);
+    if (size < MMAP_MIN) {
+        /* the neighbours are in the arena of the old block */
+        pthread_mutex_lock(&a->lock);
+        newptr = resize(a, ptr, newSize);
+        pthread_mutex_unlock(&a->lock);
 
-        if (!newptr){
-            return NULL;
+        if (newptr != NULL) {
+            checkheap(0);
+            return newptr;
         }
+    }
 
-        memcpy(newptr, ptr, oldSize);
-        free(ptr);
+    /* if the sum size of old block and the next block is not large enough 
+    ** call malloc, copy the contents and free the old block */
+    newptr = malloc(size);
 
-        //mm_checkheap(0);
-        return newptr;
+    if (!newptr){
+        return NULL;
     }
+
+    /* the payload, not the header */
+    memcpy(newptr, ptr, oldSize - WSIZE);
+    free(ptr);
+
+    checkheap(0);
+    return newptr;
 }
 
 /*
@@ -396,21 +717,259 @@ void *calloc(size_t nmemb, size_t size){
     return newptr;
 }
 
-/* scans the heap and checks it for correctness */
+/*
+ * allocate n blocks of size bytes each into ptrs, under one lock
+ * blocks are carved side by side from one free block, with one split
+ * return the number of blocks allocated, less than n if out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs){
+    size_t got = 0;
+    arena *a;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (size >= MMAP_MIN) {
+        while (got < n && (ptrs[got] = map_malloc(size)) != NULL) {
+            got++;
+        }
+        return got;
+    }
+
+    /* objects of the class freed by this thread first */
+    thread_init();
+    if (size <= SLAB_MAX) {
+        while (got < n && (ptrs[got] = tcache_get(slabClass(size))) != NULL) {
+            got++;
+        }
+    }
+
+    a = thread_arena;
+    if (got < n) {
+        pthread_mutex_lock(&a->lock);
+        got += arena_malloc_batch(a, size, n - got, ptrs + got);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    if (got < n && a != &main_arena) {
+        /* region of the arena is full */
+        pthread_mutex_lock(&main_arena.lock);
+        got += arena_malloc_batch(&main_arena, size, n - got, ptrs + got);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+
+    checkheap(0);
+    return got;
+}
+
+/*
+ * free the n blocks of ptrs, NULL ones skipped
+ * slab objects go to the bins of this thread or their runs, then the
+ * blocks are sorted by address in the front of ptrs, so that those of an
+ * arena are freed under one lock, and blocks side by side are merged
+ * first, with one coalesce and one list insert for each such run
+ */
+void mm_free_batch(void **ptrs, size_t n){
+    arena *locked = NULL;
+    size_t i, m = 0;
+    size_t size;
+    char *bp;
+    arena *a;
+
+    thread_init();
+    for (i = 0; i < n; i++) {
+        if ((bp = ptrs[i]) == NULL) {
+            continue;
+        }
+
+        a = arena_of(bp);
+        if (isSlab(a, bp)) {
+            if (!tcache_put(bp, slabOf(bp)->cls)) {
+                locked = relock(locked, a);
+                slab_free(a, bp);
+            }
+        }
+        else if (isMapped(bp)) {
+            map_free(bp);
+        }
+        else {
+            ptrs[m++] = bp;
+        }
+    }
+
+    qsort(ptrs, m, sizeof(void *), ptr_cmp);
+    for (i = 0; i < m; i++) {
+        bp = ptrs[i];
+        a = arena_of(bp);
+        locked = relock(locked, a);
+
+        /* the blocks right after it, as one block */
+        size = getSize(getHdAddr(bp));
+        a->st.frees[min(getListNum(size), LIST_NUM)]++;
+        while (i + 1 < m && (char *)ptrs[i + 1] == bp + size &&
+            size + getSize(getHdAddr(ptrs[i + 1])) <= BLOCK_MAX) {
+            i++;
+            a->st.frees[min(getListNum(getSize(getHdAddr(ptrs[i]))), LIST_NUM)]++;
+            size += getSize(getHdAddr(ptrs[i]));
+        }
+        put(getHdAddr(bp), pack(size, getPrevAlloc(getHdAddr(bp)), 1));
+        free_block(a, bp);
+    }
+
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    checkheap(0);
+}
+
+/*
+ * give the free memory of all arenas back to the OS, like malloc_trim
+ * pad bytes are kept at the top of each heap
+ * return 1 if any memory was released, 0 if none
+ */
+int mm_trim(size_t pad){
+    int n = __atomic_load_n(&arena_num, __ATOMIC_ACQUIRE);
+    size_t mapped, before, after;
+    int released = 0;
+    arena *a;
+
+    for (int i = 0; i < n; i++) {
+        a = arenas[i];
+        pthread_mutex_lock(&a->lock);
+        remote_drain(a);
+        arena_stats(a, &mapped, &before);
+        purge_old(a, 0, PURGED);
+        trim_top(a, pad);
+        arena_stats(a, &mapped, &after);
+        pthread_mutex_unlock(&a->lock);
+
+        if (after < before) {
+            released = 1;
+        }
+    }
+
+    return released;
+}
+
+/*
+ * count the bytes mapped for the heaps and for large blocks, and the
+ * part of them still resident, not released to the OS
+ */
+void mm_memstats(size_t *mapped, size_t *resident){
+    int n = __atomic_load_n(&arena_num, __ATOMIC_ACQUIRE);
+    size_t m, r;
+
+    *mapped = *resident = __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+        arena_stats(arenas[i], &m, &r);
+        pthread_mutex_unlock(&arenas[i]->lock);
+        *mapped += m;
+        *resident += r;
+    }
+}
+
+/*
+ * print the counts of each arena, the fragmentation of its free blocks,
+ * and the objects of each class served by the bins of threads
+ */
+void mm_stats(FILE *fp){
+    int n = __atomic_load_n(&arena_num, __ATOMIC_ACQUIRE);
+    unsigned long hits[SLAB_CLASSES], puts[SLAB_CLASSES];
+    size_t freeBytes, freeBlocks, largest;
+    stats st;
+    size_t i;
+
+    for (int k = 0; k < n; k++) {
+        pthread_mutex_lock(&arenas[k]->lock);
+        st = arenas[k]->st;
+        arena_frag(arenas[k], &freeBytes, &freeBlocks, &largest);
+        pthread_mutex_unlock(&arenas[k]->lock);
+
+        fprintf(fp, "arena %d: %lu fits, %.2f probes per fit, %lu at most, "
+            "%lu extends of %lu bytes\n", k, st.fits,
+            st.fits ? (double)st.probes / st.fits : 0.0, st.probe_max,
+            st.extends, st.extend_bytes);
+        fprintf(fp, "  free %zu bytes in %zu blocks, largest %zu, "
+            "external fragmentation %.1f%%\n", freeBytes, freeBlocks, largest,
+            freeBytes ? 100.0 * (1 - (double)largest / freeBytes) : 0.0);
+
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            if (st.slab_allocs[i] || st.slab_frees[i]) {
+                fprintf(fp, "  class %2zu %4u bytes  %10lu allocs %10lu frees\n",
+                    i, slab_size[i], st.slab_allocs[i], st.slab_frees[i]);
+            }
+        }
+        for (i = 0; i <= LIST_NUM; i++) {
+            if (st.allocs[i] || st.frees[i]) {
+                fprintf(fp, "  list %2zu %6zu bytes %10lu allocs %10lu frees\n",
+                    i, listSize(i), st.allocs[i], st.frees[i]);
+            }
+        }
+    }
+
+    /* the bins of exited threads, and of this one */
+    pthread_mutex_lock(&stats_lock);
+    memcpy(hits, bin_hits, sizeof(hits));
+    memcpy(puts, bin_puts, sizeof(puts));
+    pthread_mutex_unlock(&stats_lock);
+    if (thread_gen == heap_gen) {
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            hits[i] += thread_cache.hits[i];
+            puts[i] += thread_cache.puts[i];
+        }
+    }
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        if (hits[i] || puts[i]) {
+            fprintf(fp, "bins class %2zu %4u bytes  %10lu hits %10lu puts\n",
+                i, slab_size[i], hits[i], puts[i]);
+        }
+    }
+}
+
+/*
+ * scans the heap and checks it for correctness
+ * each arena under its lock: blocks by a walk of its heap, its free lists
+ * and tree, and its runs
+ * return 0 if it is consistent, else the number of arenas that are not
+ */
 int mm_checkheap(int verbose) {
-    verbose = verbose;
+    int n = __atomic_load_n(&arena_num, __ATOMIC_ACQUIRE);
+    size_t freeBlocks, listed;
+    int errors = 0;
+    int bad;
+    arena *a;
+
+    for (int k = 0; k < n; k++) {
+        a = arenas[k];
+        pthread_mutex_lock(&a->lock);
+        freeBlocks = listed = 0;
+        bad = check_heap(a, &freeBlocks) | check_lists(a, &listed) |
+            check_tree(a, a->root, NULL, NULL, &listed) | check_runs(a);
+        if (!bad && listed != freeBlocks) {
+            bad = check_fail(a, NULL, "free blocks missing from lists");
+        }
+        pthread_mutex_unlock(&a->lock);
 
-    return 0;
+        if (verbose) {
+            printf("arena %d: %zu free blocks, %s\n", k, freeBlocks,
+                bad ? "bad" : "ok");
+        }
+        errors += bad;
+    }
+
+    return errors;
 }
 
 
 /* ----------- basic helper functions ------------ */
 
 /* 
- * extend the heap for size(words) and return a ptr to the extend memory
+ * extend the heap of arena for size(words) and return a ptr to the extend memory
  * return NULL if fail 
  */
-static void *extend_heap(size_t words){
+static void *extend_heap(arena *a, size_t words){
     char *bp;
     size_t size;
     size_t prev_alloc;
@@ -418,9 +977,11 @@ static void *extend_heap(size_t words){
     /* align size to multiple of 8 bytes */
     size = (words % 2) ? (words + 1) * WSIZE : (words * WSIZE);
 
-    if ((long)(bp = mem_sbrk(size)) == -1){
+    if ((long)(bp = arena_sbrk(a, size)) == -1){
         return NULL;
     }
+    a->st.extends++;
+    a->st.extend_bytes += size;
 
     /* new free block */
     prev_alloc = getPrevAlloc(getHdAddr(bp));
@@ -430,36 +991,82 @@ static void *extend_heap(size_t words){
     /* epilogue header */
     put(getHdAddr(nextAddr(bp)), pack(0, prev_alloc, 1));
 
-    return coalesce(bp);
+    return coalesce(a, bp);
+}
+
+/*
+ * extend the heap of arena for a block of asize bytes, with its lock held
+ * by what the free block at its top lacks, and at least a->grow bytes,
+ * which doubles when extensions are less than GROW_FITS fits apart, up to
+ * 1 / GROW_RATIO of the heap, and halves when they are far apart
+ * return the free block holding asize bytes, NULL on error
+ */
+static void *arena_grow(arena *a, size_t asize){
+    char *end = heap_end(a);
+    size_t fits = a->st.fits - a->grow_fits;
+    size_t top = 0;
+    size_t size, most;
+    char *bp;
+
+    /* the free block at the top coalesces with the extension */
+    if (!getPrevAlloc(end - WSIZE)) {
+        top = getSize(end - DSIZE);
+    }
+    if (top >= asize || top + max(asize - top, a->grow) > BLOCK_MAX) {
+        top = 0;
+    }
+
+    size = max(asize - top, a->grow);
+    if ((bp = extend_heap(a, size / WSIZE)) == NULL) {
+        return NULL;
+    }
+
+    /* size of the next one */
+    most = max(min((end - a->basep) / GROW_RATIO, GROW_MAX), CHUNKSIZE);
+    if (fits < GROW_FITS) {
+        a->grow = min(a->grow * 2, align(most));
+    }
+    else if (fits > GROW_FITS * 8) {
+        a->grow = max(a->grow / 2, CHUNKSIZE);
+    }
+    a->grow_fits = a->st.fits;
+
+    return bp;
 }
 
 /*
  * coalesce the free block pointed by bp with its prev and next blocks if free
  * return a ptr to the coalesced block
  */
-static void *coalesce(void *bp){
+static void *coalesce(arena *a, void *bp){
     size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
     size_t next_alloc = getAlloc(getHdAddr(nextAddr(bp)));
     size_t prev_prev_alloc;
     size_t size = getSize(getHdAddr(bp));
+    size_t prevSize = prev_alloc ? 0 : getSize(getHdAddr(prevAddr(bp)));
+    size_t nextSize = next_alloc ? 0 : getSize(getHdAddr(nextAddr(bp)));
+
+    /* a free neighbour stays apart if the block would outgrow BLOCK_MAX */
+    int merge_prev = !prev_alloc && size + prevSize <= BLOCK_MAX;
+    int merge_next = !next_alloc && size + prevSize * merge_prev + nextSize <= BLOCK_MAX;
 
-    if (prev_alloc && next_alloc) {
-        /* both prev and next blocks are allocated */
+    if (!merge_prev && !merge_next) {
+        /* nothing to merge */
         setPrevFree(getHdAddr(nextAddr(bp)));
     }
-    else if (prev_alloc && !next_alloc) {
+    else if (!merge_prev) {
         /* next block is free */
-        size += getSize(getHdAddr(nextAddr(bp)));
-        delete_node(nextAddr(bp));
+        size += nextSize;
+        delete_node(a, nextAddr(bp));
 
         put(getHdAddr(bp), pack(size, prev_alloc, 0));
         put(getFtAddr(bp), size);
     }
-    else if (!prev_alloc && next_alloc) {
+    else if (!merge_next) {
         /* prev block is free */
-        size += getSize(getHdAddr(prevAddr(bp)));
+        size += prevSize;
         prev_prev_alloc = getPrevAlloc(getHdAddr(prevAddr(bp)));
-        delete_node(prevAddr(bp));
+        delete_node(a, prevAddr(bp));
 
         put(getFtAddr(bp), size);
         bp = prevAddr(bp);
@@ -468,73 +1075,70 @@ static void *coalesce(void *bp){
     }
     else {
         /* both prev and next blocks are free */
-        size += getSize(getHdAddr(prevAddr(bp))) +
-            getSize(getFtAddr(nextAddr(bp)));
+        size += prevSize + nextSize;
         prev_prev_alloc = getPrevAlloc(getHdAddr(prevAddr(bp)));
-        delete_node(nextAddr(bp));
-        delete_node(prevAddr(bp));
+        delete_node(a, nextAddr(bp));
+        delete_node(a, prevAddr(bp));
 
         put(getHdAddr(prevAddr(bp)), pack(size, prev_prev_alloc, 0));
         put(getFtAddr(nextAddr(bp)), size);
         bp = prevAddr(bp);
     }
 
-    insert_node(bp, getListNum(size));
+    insert_node(a, bp, getListNum(size));
     return bp;
 }
 
 /*
  * find a block with enough size from the seg free list
- * use first fit for small blocks and best fit for large blocks
- * threshold = (1 << 7) 
+ * best fit in the list of asize, whose blocks may be smaller than asize,
+ * else the first block of the next list that is not empty: every block
+ * of it fits, and is at most 1 / SL_NUM larger than the others
+ * large blocks are best fit from the tree
  */
-static void *find_fit(size_t asize){
+static void *find_fit(arena *a, size_t asize){
+    unsigned long probes = a->st.probes;
+    void *bp = search_fit(a, asize);
+
+    a->st.fits++;
+    a->st.probe_max = max(a->st.probe_max, a->st.probes - probes);
+    return bp;
+}
+
+/* search the lists and tree of arena for a fit, see find_fit() */
+static void *search_fit(arena *a, size_t asize){
     size_t index = getListNum(asize);
-    char *list = heap_listp + index * DSIZE;
-    void *temp_list;
+    void *min = NULL;
+    size_t minSize = 0;
     void *ptr;
 
-    if (index > LIST_TRSH){
-        /* best fit */
-        void *min = NULL;
-        size_t minSize = 1 << 31;
-
-        /* go through seg lists */
-        for (temp_list = list; temp_list != getFtAddr(heap_listp);
-            temp_list = (char *)temp_list + DSIZE) {
-            /* go through blocks in each list */
-            for (ptr = nextInList(temp_list); ptr != temp_list;
-                ptr = nextInList(ptr)) {
-                if (asize <= getSize(getHdAddr(ptr))) {
-                    if (min == NULL || getSize(getHdAddr(ptr)) < minSize) {
-                        /* no nodes in the current list or 
-                        ** size of the node is smaller than best size */
-                        min = ptr;
-                        minSize = getSize(getHdAddr(ptr));
-                    }
-                }
-            }
-        }
-
-        return min;
+    if (index >= LIST_NUM) {
+        return tree_fit(a, asize);
     }
-    else{
-        /* first fit */
-        /* go through seg lists */
-        for (temp_list = list; temp_list != getFtAddr(heap_listp);
-            temp_list = (char *)temp_list + DSIZE){
-            /* go through blocks in each list */
-            for (ptr = nextInList(temp_list); ptr != temp_list;
-                ptr = nextInList(ptr)){
-                if (asize <= getSize(getHdAddr(ptr))){
-                    /* return ptr to the first block with greater size */
-                    return ptr;
-                }
+
+    /* go through blocks in the list of asize */
+    for (ptr = a->heads[index] ? atOffset(a, a->heads[index]) : NULL;
+        ptr != NULL; ptr = nextInList(a, ptr)) {
+        a->st.probes++;
+        if (asize <= getSize(getHdAddr(ptr)) &&
+            (min == NULL || getSize(getHdAddr(ptr)) < minSize)) {
+            min = ptr;
+            minSize = getSize(getHdAddr(ptr));
+            if (minSize == asize) {
+                break;
             }
         }
     }
+    if (min != NULL) {
+        return min;
+    }
 
-    return NULL;
+    /* a larger list, by the bitmaps */
+    if ((index = nextList(a, index + 1)) == LIST_NUM) {
+        return tree_fit(a, asize);
+    }
+    a->st.probes++;
+    return atOffset(a, a->heads[index]);
 }
 
 /*
@@ -542,12 +1146,12 @@ static void *find_fit(size_t asize){
  * split the block pointed by bp if 
  * the remaining space is large enough for a new free block
  */
-static void place(void *bp, size_t asize){
+static void place(arena *a, void *bp, size_t asize){
     size_t csize = getSize(getHdAddr(bp));
     size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
     size_t dif = csize - asize;
 
-    delete_node(bp);
+    delete_node(a, bp);
 
     /* split block into two part */
     if (dif >= (2 * DSIZE)) {
@@ -556,10 +1160,10 @@ static void place(void *bp, size_t asize){
 
         /* second part as free */
         bp = nextAddr(bp);
-        put(getHdAddr(bp), pack(dif, prev_alloc, 0));
+        put(getHdAddr(bp), pack(dif, 2, 0));
         put(getFtAddr(bp), pack(dif, 0, 0));
 
-        insert_node(bp, getListNum(dif));
+        insert_node(a, bp, getListNum(dif));
     }
     /* no need to split */
     else{
@@ -569,73 +1173,1440 @@ static void place(void *bp, size_t asize){
 }
 
 
-/* ----------list functions------------ */
+/*
+ * allocate n blocks of asize bytes side by side from the free block at bp,
+ * into ptrs
+ * the rest is a free block if large enough, else it goes to the last one
+ */
+static void carve(arena *a, void *bp, size_t asize, size_t n, void **ptrs){
+    size_t csize = getSize(getHdAddr(bp));
+    size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
+    size_t dif = csize - n * asize;
 
-/* insert node to the segregated free list */
-static inline void insert_node(void *bp, size_t index){
-    REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+    delete_node(a, bp);
 
-    put(nextPtr(bp), get(nextPtr(heap_listp + index * DSIZE)));
-    put(prevPtr(bp), get(prevPtr(nextInList(bp))));
+    for (size_t i = 0; i < n; i++) {
+        ptrs[i] = bp;
+        if (i + 1 == n && dif < 2 * DSIZE) {
+            /* no need to split the block */
+            put(getHdAddr(bp), pack(asize + dif, prev_alloc, 1));
+            setPrevAlloc(getHdAddr(nextAddr(bp)));
+            return;
+        }
+        put(getHdAddr(bp), pack(asize, prev_alloc, 1));
+        prev_alloc = 2;
+        bp = nextAddr(bp);
+    }
 
-    put(nextPtr(heap_listp + index * DSIZE), (long)bp - (long)heap_basep);
-    put(prevPtr(nextInList(bp)), (long)bp - (long)heap_basep);
+    /* second part as free */
+    put(getHdAddr(bp), pack(dif, 2, 0));
+    put(getFtAddr(bp), pack(dif, 0, 0));
+    insert_node(a, bp, getListNum(dif));
 }
 
-/* delete the node from segregated free list */
-static inline void delete_node(void *bp){
-    REQUIRES(bp != NULL);
-    REQUIRES(in_heap(bp));
+/* order two pointers by address, for qsort() */
+static int ptr_cmp(const void *x, const void *y){
+    uintptr_t p = (uintptr_t)*(void * const *)x;
+    uintptr_t q = (uintptr_t)*(void * const *)y;
 
-    put(prevPtr(nextInList(bp)), get(prevPtr(bp)));
-    put(nextPtr(prevInList(bp)), get(nextPtr(bp)));
+    return (p > q) - (p < q);
 }
 
-/* return the index of list according to the free block size */
-static size_t getListNum(size_t asize){
-    if (asize <= (1 << 4)){
-        return 0;
-    }
-    else if (asize < (1 << 5)){
-        return 1;
-    }
-    else if (asize < (1 << 6)){
-        return 2;
-    }
-    else if (asize < (1 << 7)){
-        return 3;
+/*
+ * free a block of arena, with its lock held
+ */
+static void free_block(arena *a, void *bp){
+    size_t size = getSize(getHdAddr(bp));              //size of the block to free
+    size_t prev_alloc = getPrevAlloc(getHdAddr(bp));   //the prev_alloc bit
+
+    /* set allocate bit to 0 */
+    put(getHdAddr(bp), pack(size, prev_alloc, 0));
+    put(getFtAddr(bp), size);
+
+    bp = coalesce(a, bp);
+    if (getSize(getHdAddr(bp)) >= PURGE_MIN) {
+        /* time to release the pages of old free blocks */
+        arena_decay(a);
     }
-    else if (asize < (1 << 8)){
-        return 4;
+}
+
+/*
+ * grow the block at bp to asize bytes into the next block if it is free,
+ * with the lock of arena held
+ * return 1 on success, 0 if the next block is not free or too small
+ */
+static int grow(arena *a, void *bp, size_t asize){
+    size_t oldSize = getSize(getHdAddr(bp));
+    size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
+    size_t next_alloc = getAlloc(getHdAddr(nextAddr(bp)));
+    size_t tSize;
+
+    if (next_alloc) {
+        return 0;
+    }
+
+    /* next block of the old block is free */
+    tSize = oldSize + getSize(getHdAddr(nextAddr(bp)));
+    if (tSize < asize) {
+        return 0;
+    }
+
+    /* old block size plus next block size is large enough for the new block */
+    delete_node(a, nextAddr(bp));
+
+    if (tSize - asize >= 2 * DSIZE){
+        /* free part of the next block is large enough to form a new free block */
+        /* first part as the new block */
+        put(getHdAddr(bp), pack(asize, prev_alloc, 1));
+
+        /* second part as a new free block */
+        put(getHdAddr(nextAddr(bp)), pack(tSize - asize, 2, 0));
+        put(getFtAddr(nextAddr(bp)), pack(tSize - asize, 0, 0));
+        setPrevFree(getHdAddr(nextAddr(nextAddr(bp))));
+        insert_node(a, nextAddr(bp), getListNum(tSize - asize));
+    }
+    else{
+        /* do not need to split the block */
+        put(getHdAddr(bp), pack(tSize, prev_alloc, 1));
+        setPrevAlloc(getHdAddr(nextAddr(bp)));
+    }
+
+    return 1;
+}
+
+/*
+ * resize the block at bp to asize bytes in place, with the lock of arena held
+ * a smaller block frees a tail of SHRINK_MIN bytes and more, a smaller
+ * tail would only be taken back by the next growth
+ * a larger one takes the next block if free, then the top of the heap,
+ * then the previous block if free, with the payload moved down to it
+ * return the block, NULL if it cannot be resized in place
+ */
+static void *resize(arena *a, void *bp, size_t asize){
+    size_t oldSize = getSize(getHdAddr(bp));
+    size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
+    char *next = nextAddr(bp);
+    size_t nextSize = getAlloc(getHdAddr(next)) ? 0 : getSize(getHdAddr(next));
+    size_t prev_prev_alloc, tSize;
+    char *prev;
+
+    if (asize <= oldSize) {
+        if (oldSize - asize >= SHRINK_MIN) {
+            /* free the tail */
+            put(getHdAddr(bp), pack(asize, prev_alloc, 1));
+            put(getHdAddr(nextAddr(bp)), pack(oldSize - asize, 2, 1));
+            free_block(a, nextAddr(bp));
+        }
+        return bp;
+    }
+
+    if (grow(a, bp, asize)) {
+        return bp;
+    }
+
+    /* the block, or the free one after it, is at the top of the heap */
+    if (nextAddr(bp) + nextSize == heap_end(a) &&
+        extend_heap(a, max(asize - oldSize - nextSize, 2 * DSIZE) / WSIZE) != NULL &&
+        grow(a, bp, asize)) {
+        return bp;
+    }
+
+    if (prev_alloc) {
+        return NULL;
+    }
+
+    /* the previous block, and the next one if free, with the block */
+    prev = prevAddr(bp);
+    nextSize = getAlloc(getHdAddr(next)) ? 0 : getSize(getHdAddr(next));
+    tSize = getSize(getHdAddr(prev)) + oldSize + nextSize;
+    if (tSize < asize || tSize > BLOCK_MAX) {
+        return NULL;
+    }
+
+    prev_prev_alloc = getPrevAlloc(getHdAddr(prev));
+    delete_node(a, prev);
+    if (nextSize) {
+        delete_node(a, next);
+    }
+    memmove(prev, bp, oldSize - WSIZE);
+
+    if (tSize - asize >= 2 * DSIZE) {
+        /* free the tail */
+        put(getHdAddr(prev), pack(asize, prev_prev_alloc, 1));
+        put(getHdAddr(nextAddr(prev)), pack(tSize - asize, 2, 1));
+        free_block(a, nextAddr(prev));
+    }
+    else {
+        put(getHdAddr(prev), pack(tSize, prev_prev_alloc, 1));
+        setPrevAlloc(getHdAddr(nextAddr(prev)));
+    }
+
+    return prev;
+}
+
+
+/* ----------arena and thread functions------------ */
+
+/* extend the region of arena by incr bytes, like mem_sbrk for the main arena */
+static void *arena_sbrk(arena *a, size_t incr){
+    char *old = a->brk;
+
+    if (a == &main_arena) {
+        /* links and the page map reach HEAP_MAX */
+        if (mem_heapsize() + incr > HEAP_MAX) {
+            return (void *)-1;
+        }
+        return mem_sbrk(incr);
+    }
+
+    if (incr > (size_t)(a->max - a->brk)) {
+        return (void *)-1;
+    }
+    a->brk += incr;
+    return old;
+}
+
+/*
+ * make the prologue and the first free block of arena
+ * return -1 on error
+ */
+static int arena_init(arena *a){
+    size_t prologue_size = DSIZE;
+
+    if ((a->basep = arena_sbrk(a, prologue_size + DSIZE)) == (void *)-1) {
+        return -1;
+    }
+
+    put(a->basep, pack(0, 0, 0));         /* alignment padding */
+    put(a->basep + WSIZE, pack(prologue_size, 2, 1));     /* prologue header */
+
+    /* all lists empty */
+    a->fl_map = 0;
+    memset(a->sl_map, 0, sizeof(a->sl_map));
+    memset(a->heads, 0, sizeof(a->heads));
+    a->root = 0;
+
+    /* no runs yet */
+    a->page_base = (char *)((uintptr_t)a->basep & ~(uintptr_t)(SLAB_SIZE - 1));
+    memset(a->pages, 0, a->page_words * sizeof(uint64_t));
+    a->page_words = 0;
+    memset(a->partial, 0, sizeof(a->partial));
+
+    /* heap extensions start small */
+    a->grow = CHUNKSIZE;
+    a->grow_fits = 0;
+
+    /* nothing released yet, nothing counted */
+    a->epoch = 0;
+    a->decay_time = 0;
+    a->purged = 0;
+    memset(&a->st, 0, sizeof(stats));
+
+    a->listp = a->basep + DSIZE;        /* move listp to the payload of prologue */
+    put(getFtAddr(a->listp), pack(prologue_size, 2, 1));      /* prologue footer */
+    put(getFtAddr(a->listp) + WSIZE, pack(0, 2, 1));      /* epilogue header */
+
+    if (extend_heap(a, CHUNKSIZE * 8 / WSIZE) == NULL){
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * map the region of a new arena in slot of the arena table
+ * return NULL on error
+ */
+static arena *arena_new(int slot){
+    char *p, *region;
+    size_t lead;
+    arena *a;
+
+    /* twice the size, to cut out a region aligned to it */
+    p = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    region = (char *)(((uintptr_t)p + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1));
+    lead = region - p;
+    if (lead > 0) {
+        munmap(p, lead);
+    }
+    munmap(region + ARENA_SIZE, ARENA_SIZE - lead);
+
+    /* the arena is at the start of its region, its heap follows */
+    a = (arena *)region;
+    pthread_mutex_init(&a->lock, NULL);
+    a->remote = NULL;
+    a->pages = (uint64_t *)(region + align(sizeof(arena)));
+    a->page_num = ARENA_SIZE / SLAB_SIZE;
+    a->page_words = 0;
+    a->brk = (char *)(a->pages + ARENA_SIZE / SLAB_SIZE / 64);
+    a->max = region + ARENA_SIZE;
+
+    /* in the table while its heap is made, see in_heap() */
+    arenas[slot] = a;
+    if (arena_init(a) < 0) {
+        arenas[slot] = NULL;
+        munmap(region, ARENA_SIZE);
+        return NULL;
+    }
+
+    return a;
+}
+
+/*
+ * pick the arena of a thread
+ * a new one while there are less than ARENA_MAX, then round robin
+ */
+static arena *arena_pick(void){
+    arena *a;
+    unsigned int n;
+
+    pthread_mutex_lock(&arenas_lock);
+    n = arena_next++;
+    if (n < (unsigned int)arena_num) {
+        a = arenas[n];
+    }
+    else if (arena_num < ARENA_MAX && (a = arena_new(arena_num)) != NULL) {
+        /* arena_of() reads the table without the lock */
+        __atomic_store_n(&arena_num, arena_num + 1, __ATOMIC_RELEASE);
+    }
+    else {
+        a = arenas[n % arena_num];
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    return a;
+}
+
+/* push a block freed by another thread to the remote-free stack of arena */
+static void remote_push(arena *a, void *bp){
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+    do {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, bp, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * free the blocks of the remote-free stack of arena, with its lock held
+ * the stack is taken whole, so pops never race with pushes
+ */
+static void remote_drain(arena *a){
+    void *bp, *next;
+
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; bp != NULL; bp = next) {
+        next = *(void **)bp;
+        arena_free(a, bp);
+    }
+}
+
+/*
+ * allocate size bytes from arena, with its lock held
+ * return NULL if its heap cannot grow
+ */
+static void *arena_malloc(arena *a, size_t size){
+    size_t asize;
+    char *bp;
+
+    remote_drain(a);
+
+    if (size <= SLAB_MAX) {
+        return slab_malloc(a, slabClass(size));
+    }
+
+    /* align size to double word */
+    asize = adjust(size);
+    a->st.allocs[min(getListNum(asize), LIST_NUM)]++;
+
+    /* search the freelist for a fit */
+    if ((bp = find_fit(a, asize)) != NULL){
+        place(a, bp, asize);
+        return bp;
+    }
+
+    /* blocks kept by this thread may coalesce into one */
+    if (thread_cache.blocks > 0) {
+        tcache_flush(a);
+        if ((bp = find_fit(a, asize)) != NULL){
+            place(a, bp, asize);
+            return bp;
+        }
+    }
+
+    /* no fit found --> extend heap */
+    if ((bp = arena_grow(a, asize)) == NULL){
+        return NULL;
+    }
+
+    /* allocate in newly extended memory */
+    place(a, bp, asize);
+    return bp;
+}
+
+/* free a slab object or a block of arena, with its lock held */
+static void arena_free(arena *a, void *bp){
+    if (isSlab(a, bp)) {
+        slab_free(a, bp);
+    }
+    else {
+        a->st.frees[min(getListNum(getSize(getHdAddr(bp))), LIST_NUM)]++;
+        free_block(a, bp);
+    }
+}
+
+/*
+ * allocate n blocks of size bytes from arena into ptrs, with its lock held
+ * slab objects one by one, blocks carved from one free block for each
+ * MMAP_MIN bytes of them
+ * return the number of blocks allocated, less than n if its heap cannot grow
+ */
+static size_t arena_malloc_batch(arena *a, size_t size, size_t n, void **ptrs){
+    size_t asize, k;
+    size_t got = 0;
+    char *bp;
+
+    remote_drain(a);
+
+    if (size <= SLAB_MAX) {
+        while (got < n && (ptrs[got] = slab_malloc(a, slabClass(size))) != NULL) {
+            got++;
+        }
+        return got;
+    }
+
+    asize = adjust(size);
+    while (got < n) {
+        k = min(n - got, max(MMAP_MIN / asize, 1));
+
+        /* one free block for the k blocks, else grow the heap for them */
+        if ((bp = find_fit(a, k * asize)) == NULL &&
+            (bp = arena_grow(a, k * asize)) == NULL) {
+            break;
+        }
+        carve(a, bp, asize, k, ptrs + got);
+        a->st.allocs[min(getListNum(asize), LIST_NUM)] += k;
+        got += k;
+    }
+    return got;
+}
+
+/*
+ * hold the lock of arena a instead of that of locked, NULL if none
+ * return a
+ */
+static arena *relock(arena *locked, arena *a){
+    if (a != locked) {
+        if (locked != NULL) {
+            pthread_mutex_unlock(&locked->lock);
+        }
+        pthread_mutex_lock(&a->lock);
+    }
+    return a;
+}
+
+/*
+ * give a block back to its arena
+ * through the remote-free stack if it is not the arena of this thread
+ */
+static void release(void *bp){
+    arena *a = arena_of(bp);
+
+    if (a != thread_arena) {
+        remote_push(a, bp);
+        return;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    arena_free(a, bp);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* take an object of class cls from the bins of this thread, NULL if none */
+static inline void *tcache_get(size_t cls){
+    void *bp;
+
+    if ((bp = thread_cache.bin[cls]) == NULL) {
+        return NULL;
+    }
+
+    thread_cache.bin[cls] = *(void **)bp;
+    thread_cache.count[cls]--;
+    thread_cache.blocks--;
+    thread_cache.hits[cls]++;
+    return bp;
+}
+
+/* keep a freed object in the bins of this thread, return 0 if its bin is full */
+static inline int tcache_put(void *bp, size_t cls){
+    if (thread_cache.count[cls] >= TCACHE_COUNT) {
+        return 0;
+    }
+
+    /* still in use for its run */
+    *(void **)bp = thread_cache.bin[cls];
+    thread_cache.bin[cls] = bp;
+    thread_cache.count[cls]++;
+    thread_cache.blocks++;
+    thread_cache.puts[cls]++;
+    return 1;
+}
+
+/*
+ * give the blocks in the bins of this thread back to their arenas
+ * locked is the arena whose lock is held, NULL if none
+ */
+static void tcache_flush(arena *locked){
+    void *bp;
+
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        while ((bp = thread_cache.bin[i]) != NULL) {
+            thread_cache.bin[i] = *(void **)bp;
+            if (locked != NULL && arena_of(bp) == locked) {
+                slab_free(locked, bp);
+            }
+            else if (locked != NULL) {
+                remote_push(arena_of(bp), bp);
+            }
+            else {
+                release(bp);
+            }
+        }
+        thread_cache.count[i] = 0;
+    }
+    thread_cache.blocks = 0;
+}
+
+/* flush the bins of a thread when it exits */
+static void thread_exit(void *arg){
+    arg = arg;
+
+    if (thread_gen == heap_gen) {
+        tcache_flush(NULL);
+
+        /* keep the counts of its bins */
+        pthread_mutex_lock(&stats_lock);
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            bin_hits[i] += thread_cache.hits[i];
+            bin_puts[i] += thread_cache.puts[i];
+        }
+        pthread_mutex_unlock(&stats_lock);
+    }
+    thread_gen = 0;
+}
+
+/* create the key whose destructor runs thread_exit() */
+static void thread_init_key(void){
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+/* set up the state of this thread if it has none for the current heap */
+static inline void thread_init(void){
+    if (thread_gen == heap_gen) {
+        return;
+    }
+
+    memset(&thread_cache, 0, sizeof(tcache));
+    thread_arena = arena_pick();
+    thread_gen = heap_gen;
+    pthread_setspecific(thread_key, &thread_cache);
+}
+
+
+/* ----------mapped block functions------------ */
+
+/*
+ * map a block of size bytes on its own, aligned to HUGE_SIZE so that it
+ * can be backed by huge pages
+ * return NULL on error
+ */
+static void *map_malloc(size_t size){
+    size_t page = mem_pagesize();
+    size_t len = (size + DSIZE * 2 + page - 1) & ~(page - 1);
+    size_t lead;
+    char *p, *chunk;
+
+    /* more by HUGE_SIZE, to cut out a chunk aligned to it */
+    p = mmap(NULL, len + HUGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    chunk = (char *)(((uintptr_t)p + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1));
+    lead = chunk - p;
+    if (lead > 0) {
+        munmap(p, lead);
+    }
+    munmap(chunk + len, HUGE_SIZE - lead);
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, len, MADV_HUGEPAGE);
+#endif
+
+    /* length of the mapping, then a header with the mapped bit */
+    *(size_t *)chunk = len;
+    __atomic_add_fetch(&map_bytes, len, __ATOMIC_RELAXED);
+    *(unsigned int *)(chunk + DSIZE + WSIZE) = pack(0, 0x4, 1);
+    return chunk + DSIZE * 2;
+}
+
+/* unmap a block mapped on its own */
+static void map_free(void *bp){
+    char *chunk = (char *)bp - DSIZE * 2;
+
+    __atomic_sub_fetch(&map_bytes, *(size_t *)chunk, __ATOMIC_RELAXED);
+    munmap(chunk, *(size_t *)chunk);
+}
+
+/* return the payload size of a block mapped on its own */
+static inline size_t mapSize(void *bp){
+    return *(size_t *)((char *)bp - DSIZE * 2) - DSIZE * 2;
+}
+
+
+/* ----------trim functions------------ */
+
+/* return the monotonic time in ms */
+static long clock_ms(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* return the end of the heap of arena, just past its epilogue */
+static char *heap_end(arena *a){
+    if (a == &main_arena) {
+        return (char *)mem_heap_hi() + 1;
+    }
+    return a->brk;
+}
+
+/*
+ * release the pages of a free block of the tree, but its first keep bytes
+ * and the words of its links, stamp and footer
+ * return the bytes newly released
+ */
+static size_t purge_block(arena *a, void *bp, size_t keep){
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)bp + max(keep, 4 * WSIZE) + page - 1) & ~(page - 1);
+    uintptr_t hi = (uintptr_t)getFtAddr(bp) & ~(page - 1);
+    size_t old = 0;
+
+    if (*stampPtr(bp) == PURGED) {
+        old = (size_t)*purgedPtr(bp) * page;
+        a->purged -= old;
+    }
+    if (hi <= lo) {
+        *purgedPtr(bp) = 0;
+        *stampPtr(bp) = PURGED;
+        return 0;
+    }
+
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+    a->purged += hi - lo;
+    *purgedPtr(bp) = (hi - lo) / page;
+    *stampPtr(bp) = PURGED;
+    return hi - lo > old ? hi - lo - old : 0;
+}
+
+/*
+ * release the pages of the free blocks of minSize bytes and more put in
+ * the tree of arena before epoch, but the one at the top of its heap
+ */
+static void purge_old(arena *a, size_t minSize, unsigned int epoch){
+    char *end = heap_end(a);
+    char *bp;
+
+    for (bp = tree_fit(a, minSize); bp != NULL; bp = tree_next(a, bp)) {
+        if (*stampPtr(bp) < epoch && bp + getSize(getHdAddr(bp)) != end) {
+            purge_block(a, bp, 0);
+        }
+    }
+}
+
+/*
+ * release the free block at the top of the heap of arena, but pad bytes
+ * the region of an arena other than the main one shrinks, the heap of
+ * memlib cannot, so only its pages are released
+ * return the bytes released
+ */
+static size_t trim_top(arena *a, size_t pad){
+    uintptr_t page = mem_pagesize();
+    char *end = heap_end(a);
+    char *bp, *newEnd;
+    size_t size, prev_alloc;
+
+    /* the top block, if free and in the tree */
+    if (getPrevAlloc(end - WSIZE)) {
+        return 0;
+    }
+    size = getSize(end - DSIZE);
+    bp = end - size;
+    if (size < (1 << TREE_SHIFT)) {
+        return 0;
+    }
+
+    /* the heap shrinks, so its extensions start small again */
+    a->grow = CHUNKSIZE;
+    a->grow_fits = a->st.fits;
+
+    if (a == &main_arena) {
+        return purge_block(a, bp, pad);
+    }
+
+    /* cut the region at the first page past the pad */
+    newEnd = (char *)(((uintptr_t)bp + max(align(pad), 2 * DSIZE) + page - 1)
+        & ~(page - 1));
+    if (newEnd >= end) {
+        return 0;
+    }
+
+    delete_node(a, bp);
+    prev_alloc = getPrevAlloc(getHdAddr(bp));
+    put(getHdAddr(bp), pack(newEnd - (char *)bp, prev_alloc, 0));
+    put(getFtAddr(bp), newEnd - (char *)bp);
+    put(newEnd - WSIZE, pack(0, 0, 1));       /* epilogue header */
+    insert_node(a, bp, getListNum(newEnd - (char *)bp));
+
+    madvise(newEnd, end - newEnd, MADV_DONTNEED);
+    a->brk = newEnd;
+    return end - newEnd;
+}
+
+/*
+ * begin a new epoch of decay when DECAY_MS has passed since the last one,
+ * and release the free blocks of PURGE_MIN bytes and more that have been
+ * in the tree since before the last one
+ */
+static void arena_decay(arena *a){
+    long now = clock_ms();
+    char *end;
+
+    if (now - a->decay_time < DECAY_MS) {
+        return;
     }
-    else if (asize < (1 << 9)){
-        return 5;
+
+    purge_old(a, PURGE_MIN, a->epoch);
+    end = heap_end(a);
+    if (!getPrevAlloc(end - WSIZE) && getSize(end - DSIZE) >= PURGE_MIN &&
+        *stampPtr(end - getSize(end - DSIZE)) < a->epoch) {
+        trim_top(a, 0);
+    }
+
+    a->epoch++;
+    a->decay_time = now;
+}
+
+/* count the bytes mapped for the heap of arena and the part still resident */
+static void arena_stats(arena *a, size_t *mapped, size_t *resident){
+    if (a == &main_arena) {
+        *mapped = mem_heapsize();
     }
-    else if (asize < (1 << 10)) {
-        return 6;
+    else {
+        *mapped = a->brk - (char *)a;
     }
-    else if (asize < (1 << 11)){
-        return 7;
+    *resident = *mapped - a->purged;
+}
+
+
+/* ----------slab functions------------ */
+
+/*
+ * take an object of class cls from a run of arena, with its lock held
+ * return NULL if its heap cannot grow
+ */
+static void *slab_malloc(arena *a, size_t cls){
+    size_t size = slab_size[cls];
+    slab *s = a->partial[cls];
+    void *bp;
+
+    if (s == NULL && (s = slab_new(a, cls)) == NULL) {
+        return NULL;
     }
-    else if (asize < (1 << 12)){
-        return 8;
+
+    if (s->free != NULL) {
+        bp = s->free;
+        s->free = *(void **)bp;
     }
-    else{
-        return 9;
+    else {
+        bp = s->bump;
+        s->bump += size;
+    }
+    s->used++;
+    a->st.slab_allocs[cls]++;
+
+    if (s->free == NULL && s->bump + size > s->end) {
+        /* full, off the partial list */
+        a->partial[cls] = s->next;
+        if (s->next != NULL) {
+            s->next->prev = NULL;
+        }
+    }
+    return bp;
+}
+
+/*
+ * put an object back to its run of arena, with its lock held
+ * an empty run is freed as a block, the bins of threads keep reuse cheap
+ */
+static void slab_free(arena *a, void *bp){
+    slab *s = slabOf(bp);
+    size_t size = slab_size[s->cls];
+    size_t page;
+
+    if (s->free == NULL && s->bump + size > s->end) {
+        /* was full, back to the partial list */
+        s->prev = NULL;
+        s->next = a->partial[s->cls];
+        if (s->next != NULL) {
+            s->next->prev = s;
+        }
+        a->partial[s->cls] = s;
+    }
+
+    *(void **)bp = s->free;
+    s->free = bp;
+    s->used--;
+    a->st.slab_frees[s->cls]++;
+
+    if (s->used > 0) {
+        return;
+    }
+
+    /* empty, give its page back */
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    }
+    else {
+        a->partial[s->cls] = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+
+    page = ((char *)s - a->page_base) / SLAB_SIZE;
+    __atomic_fetch_and(&a->pages[page / 64], ~(1UL << (page % 64)),
+        __ATOMIC_RELAXED);
+    free_block(a, s);
+}
+
+/*
+ * make a run of class cls in arena, with its lock held
+ * return NULL if its heap cannot grow
+ */
+static slab *slab_new(arena *a, size_t cls){
+    size_t page;
+    char *bp;
+    slab *s;
+
+    /* a free block holding an aligned run, else grow the top of heap */
+    while ((bp = run_fit(a)) == NULL) {
+        if (arena_grow(a, SLAB_SIZE) == NULL) {
+            return NULL;
+        }
+    }
+    s = (slab *)(bp + runLead(bp));
+    place_run(a, bp);
+
+    s->next = a->partial[cls];
+    s->prev = NULL;
+    if (s->next != NULL) {
+        s->next->prev = s;
+    }
+    a->partial[cls] = s;
+    s->free = NULL;
+    s->bump = (char *)s + align(sizeof(slab));
+    s->end = (char *)s + SLAB_SIZE - WSIZE;     /* header of next block */
+    s->cls = cls;
+    s->used = 0;
+
+    page = ((char *)s - a->page_base) / SLAB_SIZE;
+    __atomic_fetch_or(&a->pages[page / 64], 1UL << (page % 64),
+        __ATOMIC_RELAXED);
+    a->page_words = max(a->page_words, page / 64 + 1);
+    return s;
+}
+
+/*
+ * find a free block of arena holding an aligned run
+ * best fit among blocks that may be too small for the alignment, else
+ * the first block of a list where every block holds one, else the tree
+ */
+static void *run_fit(arena *a){
+    unsigned long probes = a->st.probes;
+    void *bp = search_run(a);
+
+    a->st.fits++;
+    a->st.probe_max = max(a->st.probe_max, a->st.probes - probes);
+    return bp;
+}
+
+/* search the lists and tree of arena for a run, see run_fit() */
+static void *search_run(arena *a){
+    size_t last = getListNum(2 * SLAB_SIZE + DSIZE);
+    size_t index;
+    void *ptr;
+    void *min = NULL;
+
+    for (index = nextList(a, getListNum(SLAB_SIZE)); index <= last &&
+        index < LIST_NUM; index = nextList(a, index + 1)) {
+        for (ptr = atOffset(a, a->heads[index]); ptr != NULL;
+            ptr = nextInList(a, ptr)) {
+            a->st.probes++;
+            if (runLead(ptr) + SLAB_SIZE <= getSize(getHdAddr(ptr)) &&
+                (min == NULL ||
+                getSize(getHdAddr(ptr)) < getSize(getHdAddr(min)))) {
+                min = ptr;
+            }
+        }
+    }
+    if (min != NULL) {
+        return min;
+    }
+    if (index < LIST_NUM) {
+        a->st.probes++;
+        return atOffset(a, a->heads[index]);
+    }
+
+    /* in the tree, walked in order while blocks may be too small */
+    for (ptr = tree_fit(a, SLAB_SIZE);
+        ptr != NULL && getSize(getHdAddr(ptr)) < 2 * SLAB_SIZE + DSIZE;
+        ptr = tree_next(a, ptr)) {
+        a->st.probes++;
+        if (runLead(ptr) + SLAB_SIZE <= getSize(getHdAddr(ptr))) {
+            return ptr;
+        }
+    }
+
+    return ptr;
+}
+
+/*
+ * allocate the aligned run in the free block at bp
+ * the parts before and after it are free blocks if large enough
+ */
+static void place_run(arena *a, void *bp){
+    size_t csize = getSize(getHdAddr(bp));
+    size_t prev_alloc = getPrevAlloc(getHdAddr(bp));
+    size_t lead = runLead(bp);
+    size_t rest = csize - lead - SLAB_SIZE;
+
+    delete_node(a, bp);
+
+    if (lead > 0) {
+        /* free part before the run */
+        put(getHdAddr(bp), pack(lead, prev_alloc, 0));
+        put(getFtAddr(bp), pack(lead, 0, 0));
+        insert_node(a, bp, getListNum(lead));
+        bp = nextAddr(bp);
+        prev_alloc = 0;
+    }
+
+    if (rest >= 2 * DSIZE) {
+        /* free part after the run */
+        put(getHdAddr(bp), pack(SLAB_SIZE, prev_alloc, 1));
+        bp = nextAddr(bp);
+        put(getHdAddr(bp), pack(rest, 2, 0));
+        put(getFtAddr(bp), pack(rest, 0, 0));
+        insert_node(a, bp, getListNum(rest));
+    }
+    else {
+        put(getHdAddr(bp), pack(csize - lead, prev_alloc, 1));
+        setPrevAlloc(getHdAddr(nextAddr(bp)));
+    }
+}
+
+
+/* ----------list functions------------ */
+
+/* insert node to the segregated free list of arena, or to its tree */
+static inline void insert_node(arena *a, void *bp, size_t index){
+    unsigned int offset = offsetOf(a, bp);
+
+    REQUIRES(bp != NULL);
+    REQUIRES(in_heap(bp));
+
+    if (index >= LIST_NUM) {
+        tree_insert(a, bp);
+        return;
+    }
+
+    put(nextPtr(bp), a->heads[index]);
+    put(prevPtr(bp), 0);
+    if (a->heads[index] != 0) {
+        put(prevPtr(atOffset(a, a->heads[index])), offset);
+    }
+    a->heads[index] = offset;
+
+    a->fl_map |= 1U << (index / SL_NUM);
+    a->sl_map[index / SL_NUM] |= 1U << (index % SL_NUM);
+}
+
+/* delete the node from segregated free list of arena, or from its tree */
+static inline void delete_node(arena *a, void *bp){
+    size_t index;
+    unsigned int next, prev;
+
+    REQUIRES(bp != NULL);
+    REQUIRES(in_heap(bp));
+
+    index = getListNum(getSize(getHdAddr(bp)));
+    if (index >= LIST_NUM) {
+        tree_delete(a, bp);
+        return;
+    }
+    next = get(nextPtr(bp));
+    prev = get(prevPtr(bp));
+
+    if (next != 0) {
+        put(prevPtr(atOffset(a, next)), prev);
+    }
+    if (prev != 0) {
+        put(nextPtr(atOffset(a, prev)), next);
+        return;
+    }
+
+    /* the first node of its list */
+    a->heads[index] = next;
+    if (next == 0) {
+        a->sl_map[index / SL_NUM] &= ~(1U << (index % SL_NUM));
+        if (a->sl_map[index / SL_NUM] == 0) {
+            a->fl_map &= ~(1U << (index / SL_NUM));
+        }
+    }
+}
+
+/*
+ * return the index of list according to the free block size
+ * level 0 lists sizes under 1 << FL_SHIFT by 8 bytes, then the first
+ * level is the highest bit of the size, the second the SL_LOG bits after
+ * LIST_NUM and more for blocks of the tree
+ */
+static size_t getListNum(size_t asize){
+    unsigned int fl;
+
+    if (asize < (1 << FL_SHIFT)) {
+        return asize / ALIGNMENT;
+    }
+
+    fl = 31 - __builtin_clz((unsigned int)asize);
+    return (fl - FL_SHIFT + 1) * SL_NUM +
+        ((asize >> (fl - SL_LOG)) & (SL_NUM - 1));
+}
+
+/* return the smallest size of blocks in list index, the tree for LIST_NUM */
+static size_t listSize(size_t index){
+    size_t fl = index / SL_NUM + FL_SHIFT - 1;
+
+    if (index < SL_NUM) {
+        return index * ALIGNMENT;
+    }
+    return ((size_t)1 << fl) + (index % SL_NUM) * ((size_t)1 << (fl - SL_LOG));
+}
+
+/* return the first list from index on that is not empty, LIST_NUM if none */
+static inline size_t nextList(arena *a, size_t index){
+    size_t fl = index / SL_NUM;
+    unsigned int map;
+
+    if (fl >= FL_NUM) {
+        return LIST_NUM;
+    }
+
+    /* in the level of index */
+    map = a->sl_map[fl] & (~0U << (index % SL_NUM));
+    if (map != 0) {
+        return fl * SL_NUM + __builtin_ctz(map);
+    }
+
+    /* else in the first larger level */
+    map = fl + 1 < FL_NUM ? a->fl_map & (~0U << (fl + 1)) : 0;
+    if (map == 0) {
+        return LIST_NUM;
     }
+    fl = __builtin_ctz(map);
+    return fl * SL_NUM + __builtin_ctz(a->sl_map[fl]);
+}
+
+/* return the next node in free list, NULL if none */
+static inline void* nextInList(arena *a, void *bp){
+    unsigned int next;
+
+    REQUIRES(bp != NULL);
+    REQUIRES(in_heap(bp));
+
+    next = get(nextPtr(bp));
+    return next != 0 ? atOffset(a, next) : NULL;
+}
+
+
+/* ----------tree functions------------ */
+
+/*
+ * the tree of large free blocks is a treap: a search tree by size then
+ * address, and a heap by a priority hashed from the address, which keeps
+ * it balanced without storing anything but the two child links
+ */
+
+/* return the address saving the left child of a tree node */
+static inline unsigned int *leftPtr(void *bp){
+    REQUIRES(bp != NULL);
+    REQUIRES(in_heap(bp));
+    return (unsigned int *)bp;
+}
+
+/* return the address saving the right child of a tree node */
+static inline unsigned int *rightPtr(void *bp){
+    REQUIRES(bp != NULL);
+    REQUIRES(in_heap(bp));
+    return (unsigned int *)bp + 1;
 }
 
-/* return the next node in free list */
-static inline void* nextInList(void *bp){
+/* return the address saving the decay stamp of a tree node */
+static inline unsigned int *stampPtr(void *bp){
     REQUIRES(bp != NULL);
     REQUIRES(in_heap(bp));
-    return heap_basep + *(unsigned int *)nextPtr(bp);
+    return (unsigned int *)bp + 2;
 }
 
-/* return the previous node in free list */
-static inline void* prevInList(void *bp){
+/* return the address saving the pages released of a tree node */
+static inline unsigned int *purgedPtr(void *bp){
     REQUIRES(bp != NULL);
     REQUIRES(in_heap(bp));
-    return heap_basep + *(unsigned int *)prevPtr(bp);
+    return (unsigned int *)bp + 3;
+}
+
+/* return the priority of a tree node */
+static inline unsigned int treePrio(arena *a, void *bp){
+    return offsetOf(a, bp) * 2654435761U;
+}
+
+/* return whether the node x goes before y, by size then address */
+static inline int treeLess(void *x, void *y){
+    size_t xSize = getSize(getHdAddr(x));
+    size_t ySize = getSize(getHdAddr(y));
+
+    return xSize < ySize || (xSize == ySize && (char *)x < (char *)y);
+}
+
+/* insert a free block to the tree of arena */
+static void tree_insert(arena *a, void *bp){
+    unsigned int prio = treePrio(a, bp);
+    unsigned int *link = &a->root;
+    unsigned int *l = leftPtr(bp);
+    unsigned int *r = rightPtr(bp);
+    unsigned int t;
+    char *node;
+
+    /* down to the first node of lower priority */
+    while (*link != 0 && treePrio(a, atOffset(a, *link)) > prio) {
+        node = atOffset(a, *link);
+        link = treeLess(bp, node) ? leftPtr(node) : rightPtr(node);
+    }
+
+    /* split its subtree into the children of bp */
+    for (t = *link; t != 0; ) {
+        node = atOffset(a, t);
+        if (treeLess(node, bp)) {
+            *l = t;
+            l = rightPtr(node);
+            t = *l;
+        }
+        else {
+            *r = t;
+            r = leftPtr(node);
+            t = *r;
+        }
+    }
+    *l = 0;
+    *r = 0;
+    *stampPtr(bp) = a->epoch;
+
+    *link = offsetOf(a, bp);
+}
+
+/* delete a free block from the tree of arena */
+static void tree_delete(arena *a, void *bp){
+    unsigned int *link = &a->root;
+    unsigned int l = *leftPtr(bp);
+    unsigned int r = *rightPtr(bp);
+    char *node;
+
+    if (*stampPtr(bp) == PURGED) {
+        /* its pages come back on use */
+        a->purged -= (size_t)*purgedPtr(bp) * mem_pagesize();
+    }
+
+    while (atOffset(a, *link) != bp) {
+        node = atOffset(a, *link);
+        link = treeLess(bp, node) ? leftPtr(node) : rightPtr(node);
+    }
+
+    /* merge its children in its place */
+    while (l != 0 && r != 0) {
+        if (treePrio(a, atOffset(a, l)) > treePrio(a, atOffset(a, r))) {
+            *link = l;
+            link = rightPtr(atOffset(a, l));
+            l = *link;
+        }
+        else {
+            *link = r;
+            link = leftPtr(atOffset(a, r));
+            r = *link;
+        }
+    }
+    *link = l != 0 ? l : r;
+}
+
+/* return the first block of the tree of at least asize bytes, NULL if none */
+static void *tree_fit(arena *a, size_t asize){
+    unsigned int t = a->root;
+    void *best = NULL;
+    char *node;
+
+    while (t != 0) {
+        node = atOffset(a, t);
+        a->st.probes++;
+        if (getSize(getHdAddr(node)) >= asize) {
+            best = node;
+            t = *leftPtr(node);
+        }
+        else {
+            t = *rightPtr(node);
+        }
+    }
+    return best;
+}
+
+/* return the block after bp in the tree, NULL if none */
+static void *tree_next(arena *a, void *bp){
+    unsigned int t = a->root;
+    void *next = NULL;
+    char *node;
+
+    while (t != 0) {
+        node = atOffset(a, t);
+        if (treeLess(bp, node)) {
+            next = node;
+            t = *leftPtr(node);
+        }
+        else {
+            t = *rightPtr(node);
+        }
+    }
+    return next;
+}
+
+
+/* ----------check functions------------ */
+
+/* report an error of arena at block bp, return 1 */
+static int check_fail(arena *a, void *bp, const char *msg){
+    printf("mm_checkheap: arena %p, block %p: %s\n", (void *)a, bp, msg);
+    return 1;
+}
+
+/*
+ * walk the heap of arena: header and footer of free blocks agree, the
+ * prev_alloc bits, no free blocks side by side unless they would outgrow
+ * BLOCK_MAX, prologue and epilogue
+ * count the free blocks in freeBlocks, return 1 on error
+ */
+static int check_heap(arena *a, size_t *freeBlocks){
+    char *end = heap_end(a);
+    char *bp = a->listp;
+    size_t size, prevSize = 0;
+    size_t prev_alloc = 1;
+    int bad = 0;
+
+    if (get(getHdAddr(bp)) != pack(DSIZE, 2, 1) ||
+        get(getFtAddr(bp)) != get(getHdAddr(bp))) {
+        return check_fail(a, bp, "bad prologue");
+    }
+
+    for (bp = nextAddr(bp); (size = getSize(getHdAddr(bp))) != 0;
+        bp = nextAddr(bp)) {
+        if (!aligned(bp) || size < 2 * DSIZE || size % ALIGNMENT != 0 ||
+            bp + size > end) {
+            /* cannot walk on */
+            return check_fail(a, bp, "bad block size or alignment");
+        }
+        if ((getPrevAlloc(getHdAddr(bp)) != 0) != prev_alloc) {
+            bad |= check_fail(a, bp, "prev_alloc bit differs from prev block");
+        }
+        if (get(getHdAddr(bp)) & 0x4) {
+            bad |= check_fail(a, bp, "mapped bit in the heap");
+        }
+
+        if (!getAlloc(getHdAddr(bp))) {
+            if (getSize(getFtAddr(bp)) != size) {
+                bad |= check_fail(a, bp, "footer differs from header");
+            }
+            if (!prev_alloc && prevSize + size <= BLOCK_MAX) {
+                bad |= check_fail(a, bp, "free blocks not coalesced");
+            }
+            (*freeBlocks)++;
+        }
+        prev_alloc = getAlloc(getHdAddr(bp));
+        prevSize = size;
+    }
+
+    if (bp != end || !getAlloc(getHdAddr(bp)) ||
+        (getPrevAlloc(getHdAddr(bp)) != 0) != prev_alloc) {
+        bad |= check_fail(a, bp, "bad epilogue");
+    }
+    return bad;
+}
+
+/*
+ * check the free lists of arena: links, bitmaps, and the list of each
+ * block by its size
+ * count the blocks in listed, return 1 on error
+ */
+static int check_lists(arena *a, size_t *listed){
+    size_t most = (heap_end(a) - a->basep) / (2 * DSIZE);
+    unsigned int off, prev;
+    int bad = 0;
+    size_t index;
+    char *bp;
+
+    for (index = 0; index < LIST_NUM; index++) {
+        if (((a->sl_map[index / SL_NUM] >> (index % SL_NUM)) & 1) !=
+            (a->heads[index] != 0)) {
+            bad |= check_fail(a, NULL, "list bitmap differs from its list");
+        }
+
+        prev = 0;
+        for (off = a->heads[index]; off != 0; off = get(nextPtr(bp))) {
+            bp = atOffset(a, off);
+            if (!in_heap(bp) || !aligned(bp) || ++*listed > most) {
+                return check_fail(a, bp, "list link out of heap, or a cycle");
+            }
+            if (getAlloc(getHdAddr(bp))) {
+                bad |= check_fail(a, bp, "allocated block in a list");
+            }
+            if (getListNum(getSize(getHdAddr(bp))) != index) {
+                bad |= check_fail(a, bp, "block in the list of another size");
+            }
+            if (get(prevPtr(bp)) != prev) {
+                bad |= check_fail(a, bp, "prev link differs from prev node");
+            }
+            prev = off;
+        }
+    }
+
+    for (index = 0; index < FL_NUM; index++) {
+        if (((a->fl_map >> index) & 1) != (a->sl_map[index] != 0)) {
+            bad |= check_fail(a, NULL, "first-level bitmap differs");
+        }
+    }
+    return bad;
+}
+
+/*
+ * check the subtree t of arena, whose nodes go between lo and hi
+ * the order by size then address, the priorities, and the size of blocks
+ * count the blocks in listed, return 1 on error
+ */
+static int check_tree(arena *a, unsigned int t, void *lo, void *hi, size_t *listed){
+    unsigned int l, r;
+    int bad = 0;
+    char *bp;
+
+    if (t == 0) {
+        return 0;
+    }
+
+    bp = atOffset(a, t);
+    if (!in_heap(bp) || !aligned(bp) || (lo != NULL && !treeLess(lo, bp)) ||
+        (hi != NULL && !treeLess(bp, hi))) {
+        /* out of order, maybe a cycle */
+        return check_fail(a, bp, "tree link out of heap or out of order");
+    }
+    if (getAlloc(getHdAddr(bp))) {
+        bad |= check_fail(a, bp, "allocated block in the tree");
+    }
+    if (getListNum(getSize(getHdAddr(bp))) < LIST_NUM) {
+        bad |= check_fail(a, bp, "block of a list in the tree");
+    }
+
+    l = *leftPtr(bp);
+    r = *rightPtr(bp);
+    if ((l != 0 && treePrio(a, atOffset(a, l)) > treePrio(a, bp)) ||
+        (r != 0 && treePrio(a, atOffset(a, r)) > treePrio(a, bp))) {
+        bad |= check_fail(a, bp, "child of higher priority in the tree");
+    }
+    (*listed)++;
+
+    return bad | check_tree(a, l, lo, bp, listed) |
+        check_tree(a, r, bp, hi, listed);
+}
+
+/*
+ * check the runs of arena: each page in the page map is an allocated
+ * block holding a run, and the partial lists link runs of their class
+ * return 1 on error
+ */
+static int check_runs(arena *a){
+    size_t page, cls;
+    slab *s, *prev;
+    int bad = 0;
+
+    for (page = 0; page < a->page_words * 64; page++) {
+        if (!((a->pages[page / 64] >> (page % 64)) & 1)) {
+            continue;
+        }
+
+        s = (slab *)(a->page_base + page * SLAB_SIZE);
+        if (!in_heap(s) || !getAlloc(getHdAddr(s)) ||
+            getSize(getHdAddr(s)) < SLAB_SIZE) {
+            bad |= check_fail(a, s, "page map has no run there");
+            continue;
+        }
+        if (s->cls >= SLAB_CLASSES || s->end != (char *)s + SLAB_SIZE - WSIZE ||
+            s->bump < (char *)s + align(sizeof(slab)) || s->bump > s->end ||
+            s->used == 0 || s->used > (SLAB_SIZE - align(sizeof(slab))) /
+            slab_size[s->cls]) {
+            bad |= check_fail(a, s, "bad run");
+        }
+    }
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        prev = NULL;
+        for (s = a->partial[cls]; s != NULL; s = s->next) {
+            if (!isSlab(a, s) || s->cls != cls || s->prev != prev) {
+                /* cannot walk on */
+                return check_fail(a, s, "bad partial list");
+            }
+            if (s->free == NULL && s->bump + slab_size[cls] > s->end) {
+                bad |= check_fail(a, s, "full run in a partial list");
+            }
+            prev = s;
+        }
+    }
+    return bad;
+}
+
+/* count the free bytes and blocks of arena, and the largest one */
+static void arena_frag(arena *a, size_t *freeBytes, size_t *freeBlocks, size_t *largest){
+    size_t size;
+    char *bp;
+
+    *freeBytes = *freeBlocks = *largest = 0;
+    for (bp = nextAddr(a->listp); (size = getSize(getHdAddr(bp))) != 0;
+        bp = nextAddr(bp)) {
+        if (!getAlloc(getHdAddr(bp))) {
+            *freeBytes += size;
+            (*freeBlocks)++;
+            *largest = max(*largest, size);
+        }
+    }
 }
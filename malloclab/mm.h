@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+extern int mm_init (void);
+extern void *mm_malloc (size_t size);
+extern void mm_free (void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern int mm_checkheap(int verbose);
+
+/* many blocks of one size under one lock */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* free memory given back to the OS, and what is left of it */
+extern int mm_trim(size_t pad);
+extern void mm_memstats(size_t *mapped, size_t *resident);
+extern void mm_stats(FILE *fp);
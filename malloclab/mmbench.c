@@ -0,0 +1,180 @@
+/*
+ * mmbench.c
+ *
+ * Scaling benchmark for mm.c. Threads malloc and free blocks at random
+ * in slots of their own, mostly small ones of 16 to 256 bytes with some
+ * up to 4096 bytes. With -r, that percent of the blocks is handed to the
+ * other threads through a shared array, so that they are freed by a
+ * thread other than the one that allocated them. It reports millions of
+ * operations per second for each thread count, and the speedup over one
+ * thread. With -c the same runs use the malloc of libc, to compare.
+ *
+ * build: gcc -O2 -DDRIVER -o mmbench mmbench.c mm.c memlib.c -lpthread
+ * usage: mmbench [-n ops_per_thread] [-s slots] [-r remote_percent] [-c]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 32
+#define SHARED_SLOTS 4096
+
+/* the run */
+static int nops = 1000000;
+static int nslots = 1024;
+static int remote;              //percent of blocks freed by another thread
+static int use_libc;
+
+static void *shared[SHARED_SLOTS];
+static pthread_barrier_t start;
+
+/* the allocator under test */
+static void *bench_malloc(size_t size){
+    return use_libc ? malloc(size) : mm_malloc(size);
+}
+
+static void bench_free(void *ptr){
+    if (use_libc) {
+        free(ptr);
+    }
+    else {
+        mm_free(ptr);
+    }
+}
+
+/* draw a size, 16 to 256 bytes 9 times in 10, else up to 4096 */
+static size_t draw_size(unsigned int *seed){
+    if (rand_r(seed) % 10 != 0) {
+        return 16 + rand_r(seed) % 241;
+    }
+    return 16 + rand_r(seed) % 4081;
+}
+
+/* malloc and free nops times in the slots of this thread */
+static void *worker(void *arg){
+    unsigned int seed = (unsigned int)(long)arg * 7919 + 1;
+    void **slots = calloc(nslots, sizeof(void *));
+    void *bp, *old;
+    int i, k;
+
+    pthread_barrier_wait(&start);
+
+    for (i = 0; i < nops; i++) {
+        k = rand_r(&seed) % nslots;
+        if (slots[k] != NULL) {
+            bench_free(slots[k]);
+            slots[k] = NULL;
+            continue;
+        }
+
+        if ((bp = bench_malloc(draw_size(&seed))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        *(char *)bp = (char)i;
+
+        if (remote > 0 && rand_r(&seed) % 100 < remote) {
+            /* free the block left there, most likely by another thread */
+            k = rand_r(&seed) % SHARED_SLOTS;
+            old = __atomic_exchange_n(&shared[k], bp, __ATOMIC_ACQ_REL);
+            if (old != NULL) {
+                bench_free(old);
+            }
+        }
+        else {
+            slots[k] = bp;
+        }
+    }
+
+    for (k = 0; k < nslots; k++) {
+        if (slots[k] != NULL) {
+            bench_free(slots[k]);
+        }
+    }
+    free(slots);
+    return NULL;
+}
+
+/* run with n threads, return the seconds taken */
+static double run(int n){
+    pthread_t tids[MAX_THREADS];
+    struct timespec t0, t1;
+    int i;
+
+    if (!use_libc) {
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+    }
+    memset(shared, 0, sizeof(shared));
+
+    pthread_barrier_init(&start, NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        pthread_create(&tids[i], NULL, worker, (void *)(long)i);
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+
+    for (i = 0; i < SHARED_SLOTS; i++) {
+        if (shared[i] != NULL) {
+            bench_free(shared[i]);
+        }
+    }
+
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv){
+    int threads[] = { 1, 2, 4, 8, 16, 32 };
+    double secs, mops, base = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:r:c")) != -1) {
+        switch (c) {
+        case 'n': nops = atoi(optarg); break;
+        case 's': nslots = atoi(optarg); break;
+        case 'r': remote = atoi(optarg); break;
+        case 'c': use_libc = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-n ops_per_thread] [-s slots] "
+                "[-r remote_percent] [-c]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nslots < 1 || remote < 0 || remote > 100) {
+        fprintf(stderr, "bad slots or remote percent\n");
+        exit(1);
+    }
+
+    if (!use_libc) {
+        mem_init();
+    }
+
+    printf("%s, %d ops per thread, %d slots, %d%% remote frees\n",
+        use_libc ? "libc" : "mm", nops, nslots, remote);
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        secs = run(threads[i]);
+        mops = (double)nops * threads[i] / secs / 1e6;
+        if (i == 0) {
+            base = mops;
+        }
+        printf("threads %2d  %8.2f Mops/s  speedup %5.2f\n",
+            threads[i], mops, mops / base);
+    }
+
+    return 0;
+}
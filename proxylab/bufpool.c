@@ -0,0 +1,92 @@
+/*
+ * bufpool.c
+ *
+ * The free list is a LIFO stack threaded through the free chunks
+ * themselves, so a recycled chunk is likely still in cache. It keeps at
+ * most the budget worth of chunks, the rest are returned to malloc.
+ *
+ * bufpool_get() never fails for lack of budget: a request being served
+ * gets its buffers, the budget is only enforced before accepting a new
+ * connection.
+ */
+
+#include "csapp.h"
+#include "bufpool.h"
+
+static char *free_list;
+static size_t nfree;            //chunks in free list
+static size_t nused;            //chunks handed out
+static size_t npeak;
+static size_t budget;
+static unsigned long accept_waits;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* set the budget of buffers in use */
+void bufpool_init(size_t bytes){
+    budget = bytes;
+}
+
+/* get a buffer of BUF_CHUNK bytes */
+char *bufpool_get(void){
+    char *buf;
+
+    pthread_mutex_lock(&lock);
+    if ((buf = free_list) != NULL) {
+        free_list = *(char **)buf;
+        nfree--;
+    }
+    if (++nused > npeak) {
+        npeak = nused;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (buf == NULL) {
+        buf = Malloc(BUF_CHUNK);
+    }
+    return buf;
+}
+
+/* return a buffer to the pool */
+void bufpool_put(char *buf){
+    int keep;
+
+    pthread_mutex_lock(&lock);
+    nused--;
+    if ((keep = (nused + nfree) * BUF_CHUNK < budget)) {
+        *(char **)buf = free_list;
+        free_list = buf;
+        nfree++;
+    }
+    if (nused * BUF_CHUNK < budget) {
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!keep) {
+        free(buf);
+    }
+}
+
+/* wait until the buffers in use are under budget */
+void bufpool_wait(void){
+    pthread_mutex_lock(&lock);
+    if (nused * BUF_CHUNK >= budget) {
+        accept_waits++;
+        while (nused * BUF_CHUNK >= budget) {
+            pthread_cond_wait(&cond, &lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* get a snapshot of the pool */
+void bufpool_stats(bufpool_stat *st){
+    pthread_mutex_lock(&lock);
+    st->budget = budget;
+    st->in_use = nused * BUF_CHUNK;
+    st->free = nfree * BUF_CHUNK;
+    st->peak = npeak * BUF_CHUNK;
+    st->accept_waits = accept_waits;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+/*
+ * bufpool.h
+ *
+ * Pool of I/O buffers of BUF_CHUNK bytes shared by all connections.
+ * Chunks are allocated on demand and recycled through a free list.
+ * The chunks in use are held to a global budget: when it is exhausted
+ * the proxy stops accepting connections until some are returned.
+ */
+
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+#define BUF_CHUNK 16384             //size of a buffer
+#define BUF_BUDGET (64L << 20)      //default bytes of buffers in use
+
+typedef struct bufpool_stat {
+    size_t budget;                  //bytes
+    size_t in_use;                  //bytes of chunks handed out
+    size_t free;                    //bytes of chunks in free list
+    size_t peak;                    //max of in_use
+    unsigned long accept_waits;     //accepts delayed by the budget
+} bufpool_stat;
+
+void bufpool_init(size_t budget);
+char *bufpool_get(void);
+void bufpool_put(char *buf);
+void bufpool_wait(void);
+void bufpool_stats(bufpool_stat *st);
+
+#endif
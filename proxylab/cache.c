@@ -0,0 +1,563 @@
+/*
+ * cache.c
+ *
+ * Blocks of both tiers share one hash table keyed by uri. Each tier
+ * hands its blocks to its eviction policy, which picks victims until a
+ * new object fits in the tier.
+ *
+ * cache_match() hands out a reference to the block, so that an evicted
+ * block stays alive until the requests still sending it release it.
+ * Disk blocks are mapped on their first hit and unmapped when freed.
+ *
+ * Freshness is computed from the header of the object when it is
+ * inserted, or when a block loaded from the disk index is first mapped.
+ * Blocks loaded from a snapshot keep the freshness it recorded.
+ *
+ * A snapshot takes a reference to every memory block under the lock,
+ * then writes them without it, so requests are not held up by the disk.
+ * Blocks are not changed once inserted, only their freshness, which is
+ * copied under the lock.
+ */
+
+#include "csapp.h"
+#include "policy.h"
+
+/* return the 64-bit hash of a uri (FNV-1a) */
+static inline uint64_t uri_key(char *uri){
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*uri) {
+        h = (h ^ (unsigned char)*uri++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* find the block of uri */
+static cache_block *lookup(cache *cache_ptr, char *uri, uint64_t key){
+    cache_block *block;
+
+    for (block = cache_ptr->table[key % CACHE_BUCKETS]; block != NULL;
+        block = block->hnext) {
+        if (block->key == key && !strcmp(block->uri, uri)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* release the memory of a block */
+static void free_block(cache_block *block){
+    if (block->snap != NULL) {
+        snap_map_put(block->snap);
+    }
+    else if (block->tier == CACHE_MEM) {
+        free(block->object);
+    }
+    else if (block->map != NULL) {
+        disk_unmap(block->map, block->map_size);
+    }
+
+    free(block->etag);
+    free(block->last_modified);
+    free(block->file);
+    free(block->uri);
+    free(block);
+}
+
+/*
+ * set the freshness and validators of a block from its caching headers,
+ * once: requests holding the block read its validators without the lock
+ */
+static void set_fresh(cache_block *block, fresh_hdr *h, time_t response_time){
+    fresh_lifetime(h, response_time, &block->fresh_until, &block->stale_until);
+
+    block->etag = h->etag[0] ? strdup(h->etag) : NULL;
+    block->last_modified = h->last_modified[0] ? strdup(h->last_modified) : NULL;
+    block->has_fresh = 1;
+}
+
+/*
+ * remove a block from cache
+ * it is freed now, or by the last request still holding it
+ */
+static void evict(cache *cache_ptr, cache_block *block){
+    cache_tier *tier = &cache_ptr->tier[block->tier];
+    cache_block **pp;
+
+    for (pp = &cache_ptr->table[block->key % CACHE_BUCKETS]; *pp != NULL;
+        pp = &(*pp)->hnext) {
+        if (*pp == block) {
+            *pp = block->hnext;
+            break;
+        }
+    }
+
+    tier->policy->remove(tier, block);
+    tier->size -= block->object_size;
+
+    if (block->tier == CACHE_DISK) {
+        disk_remove(cache_ptr->dir, block->file);
+        if (cache_ptr->index_fd >= 0) {
+            disk_index_remove(cache_ptr->index_fd, block->file);
+        }
+    }
+
+    if (block->refcnt == 0) {
+        free_block(block);
+    }
+    else {
+        block->is_evicted = 1;
+    }
+}
+
+/* evict victims of the tier policy until size bytes fit in the tier */
+static void make_room(cache *cache_ptr, int tier, size_t size){
+    cache_tier *t = &cache_ptr->tier[tier];
+    cache_block *victim;
+
+    while (t->size + size > t->max_size &&
+        (victim = t->policy->victim(t)) != NULL) {
+        evict(cache_ptr, victim);
+    }
+}
+
+/* create a block and add it to cache */
+static cache_block *add_block(cache *cache_ptr, int tier, char *uri,
+    uint64_t key, char *object, size_t object_size, char *file){
+
+    cache_block *block = Malloc(sizeof(cache_block));
+    cache_tier *t = &cache_ptr->tier[tier];
+    size_t i = key % CACHE_BUCKETS;
+
+    block->uri = strdup(uri);
+    block->key = key;
+    block->object = object;
+    block->object_size = object_size;
+    block->tier = tier;
+    block->refcnt = 0;
+    block->is_evicted = 0;
+    block->file = (file != NULL) ? strdup(file) : NULL;
+    block->map = NULL;
+    block->map_size = 0;
+    block->snap = NULL;
+    block->snap_off = 0;
+    block->queue = 0;
+    block->freq = 0;
+    block->priority = 0;
+    block->heap_idx = 0;
+    block->prev = block->next = NULL;
+    block->has_fresh = 0;
+    block->fresh_until = block->stale_until = 0;
+    block->etag = block->last_modified = NULL;
+    block->is_revalidating = 0;
+
+    block->hnext = cache_ptr->table[i];
+    cache_ptr->table[i] = block;
+    t->policy->insert(t, block);
+    t->size += object_size;
+
+    return block;
+}
+
+/* add an object found in the disk index on startup */
+static void load_block(void *arg, char *file, size_t object_size, char *uri){
+    cache *cache_ptr = arg;
+    cache_block *block;
+    uint64_t key = uri_key(uri);
+
+    if ((block = lookup(cache_ptr, uri, key)) != NULL) {
+        evict(cache_ptr, block);
+    }
+
+    make_room(cache_ptr, CACHE_DISK, object_size);
+    add_block(cache_ptr, CACHE_DISK, uri, key, NULL, object_size, file);
+}
+
+/*
+ * init an empty cache
+ * objects larger than mem_object go to the disk store in dir,
+ * the disk tier is disabled if dir is NULL
+ * both tiers evict by the named policy, with TinyLFU admission if admit
+ */
+cache *cache_init(size_t mem_size, size_t mem_object,
+    char *dir, size_t disk_size, size_t disk_object,
+    char *policy, int admit){
+
+    cache *cache_ptr = Malloc(sizeof(cache));
+    cache_policy *p;
+
+    if ((p = policy_find(policy)) == NULL) {
+        fprintf(stderr, "unknown cache policy %s\n", policy);
+        exit(1);
+    }
+
+    memset(cache_ptr, 0, sizeof(cache));
+    pthread_mutex_init(&cache_ptr->lock, NULL);
+
+    cache_ptr->tier[CACHE_MEM].max_size = mem_size;
+    cache_ptr->tier[CACHE_MEM].max_object = mem_object;
+    cache_ptr->tier[CACHE_DISK].max_size = disk_size;
+    cache_ptr->tier[CACHE_DISK].max_object = disk_object;
+    cache_ptr->index_fd = -1;
+    policy_init(&cache_ptr->tier[CACHE_MEM], p, admit);
+    policy_init(&cache_ptr->tier[CACHE_DISK], p, admit);
+
+    if (dir != NULL) {
+        /* warm start from the objects already in the store */
+        cache_ptr->dir = strdup(dir);
+        if ((cache_ptr->index_fd = disk_load(dir, load_block, cache_ptr)) < 0) {
+            fprintf(stderr, "cannot open disk cache in %s: %s\n",
+                dir, strerror(errno));
+            exit(1);
+        }
+    }
+
+    return cache_ptr;
+}
+
+/*
+ * look for the object of uri in cache
+ * return the block with a reference held, or NULL on miss
+ */
+cache_block *cache_match(cache *cache_ptr, char *uri){
+    cache_block *block;
+    uint64_t key = uri_key(uri);
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    policy_access(&cache_ptr->tier[CACHE_MEM], key);
+    policy_access(&cache_ptr->tier[CACHE_DISK], key);
+
+    if ((block = lookup(cache_ptr, uri, key)) != NULL) {
+        if (block->object == NULL) {
+            /* first hit of a disk block */
+            block->map = disk_map(cache_ptr->dir, block->file,
+                &block->map_size, &block->object, &block->object_size);
+
+            if (block->map == NULL) {
+                evict(cache_ptr, block);
+                block = NULL;
+            }
+        }
+    }
+
+    if (block != NULL && !block->has_fresh) {
+        /* loaded from disk index, the time it was received is unknown */
+        fresh_hdr h;
+
+        fresh_init(&h);
+        fresh_scan(&h, block->object, block->object_size);
+        set_fresh(block, &h, 0);
+    }
+
+    if (block != NULL) {
+        cache_tier *tier = &cache_ptr->tier[block->tier];
+        tier->policy->hit(tier, block);
+        block->refcnt++;
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return block;
+}
+
+/* return 1 if uri is cached, the access is not counted by the policy */
+int cache_contains(cache *cache_ptr, char *uri){
+    int found;
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    found = lookup(cache_ptr, uri, uri_key(uri)) != NULL;
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return found;
+}
+
+/* drop the reference taken by cache_match() */
+void cache_release(cache *cache_ptr, cache_block *block){
+    pthread_mutex_lock(&cache_ptr->lock);
+    if (--block->refcnt == 0 && block->is_evicted) {
+        free_block(block);
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+}
+
+/* insert a copy of object to the memory tier */
+void cache_insert(cache *cache_ptr, char *uri, char *object, size_t object_size){
+    cache_tier *tier = &cache_ptr->tier[CACHE_MEM];
+    cache_block *block;
+    uint64_t key = uri_key(uri);
+    char *copy;
+    fresh_hdr h;
+
+    if (object_size > tier->max_object || object_size > tier->max_size) {
+        return;
+    }
+
+    fresh_init(&h);
+    fresh_scan(&h, object, object_size);
+    if (h.no_store || h.vary_other) {
+        return;
+    }
+
+    copy = Malloc(object_size);
+    memcpy(copy, object, object_size);
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    if ((block = lookup(cache_ptr, uri, key)) != NULL) {
+        evict(cache_ptr, block);
+    }
+
+    if (!policy_admit(tier, key, object_size)) {
+        /* not popular enough to push others out */
+        pthread_mutex_unlock(&cache_ptr->lock);
+        free(copy);
+        return;
+    }
+
+    make_room(cache_ptr, CACHE_MEM, object_size);
+    block = add_block(cache_ptr, CACHE_MEM, uri, key, copy, object_size, NULL);
+    set_fresh(block, &h, time(NULL));
+    pthread_mutex_unlock(&cache_ptr->lock);
+}
+
+/* commit the object written by w and insert it to the disk tier */
+void cache_insert_disk(cache *cache_ptr, disk_writer *w){
+    cache_tier *tier = &cache_ptr->tier[CACHE_DISK];
+    cache_block *block;
+    uint64_t key = uri_key(w->uri);
+    size_t object_size;
+    fresh_hdr h;
+
+    fresh_init(&h);
+    fresh_scan(&h, w->hdr, w->hdr_size);
+    if (h.no_store || h.vary_other || disk_commit(w, &object_size) < 0) {
+        disk_abort(w);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    if ((block = lookup(cache_ptr, w->uri, key)) != NULL) {
+        evict(cache_ptr, block);
+    }
+
+    if (object_size > tier->max_size || !policy_admit(tier, key, object_size)) {
+        disk_remove(cache_ptr->dir, w->file);
+    }
+    else {
+        make_room(cache_ptr, CACHE_DISK, object_size);
+        block = add_block(cache_ptr, CACHE_DISK, w->uri, key, NULL,
+            object_size, w->file);
+        set_fresh(block, &h, time(NULL));
+        disk_index_add(cache_ptr->index_fd, w->file, object_size, w->uri);
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    disk_close(w);
+}
+
+/* return whether a block held by cache_match() can be served at now */
+int cache_freshness(cache *cache_ptr, cache_block *block, time_t now){
+    int rc;
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    if (now < block->fresh_until) {
+        rc = CACHE_FRESH;
+    }
+    else if (now < block->stale_until) {
+        rc = CACHE_STALE_OK;
+    }
+    else {
+        rc = CACHE_STALE;
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return rc;
+}
+
+/*
+ * make a block held by cache_match() fresh again after the server
+ * answered 304 Not Modified with hdr
+ * the header of the 304 overrides the stored one for the lifetime, the
+ * validators of the block are kept: a 304 naming others is for another
+ * version, and leaves the block stale
+ */
+void cache_refresh(cache *cache_ptr, cache_block *block, char *hdr, size_t hdr_size){
+    fresh_hdr h;
+
+    fresh_init(&h);
+    fresh_scan(&h, hdr, hdr_size);
+    if (h.etag[0] ? block->etag == NULL || strcmp(h.etag, block->etag) :
+        h.last_modified[0] && (block->last_modified == NULL ||
+        strcmp(h.last_modified, block->last_modified))) {
+        return;
+    }
+
+    fresh_init(&h);
+    fresh_scan(&h, block->object, block->object_size);
+    fresh_scan(&h, hdr, hdr_size);
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    fresh_lifetime(&h, time(NULL), &block->fresh_until, &block->stale_until);
+    pthread_mutex_unlock(&cache_ptr->lock);
+}
+
+/*
+ * start a background revalidation of a block held by cache_match()
+ * return 1 if the caller is to run it and then call
+ * cache_revalidate_end(), 0 if one is already running
+ */
+int cache_revalidate_begin(cache *cache_ptr, cache_block *block){
+    int rc = 0;
+
+    pthread_mutex_lock(&cache_ptr->lock);
+    if (!block->is_revalidating && !block->is_evicted) {
+        block->is_revalidating = 1;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return rc;
+}
+
+/* end a background revalidation and drop the reference of the block */
+void cache_revalidate_end(cache *cache_ptr, cache_block *block){
+    pthread_mutex_lock(&cache_ptr->lock);
+    block->is_revalidating = 0;
+    if (--block->refcnt == 0 && block->is_evicted) {
+        free_block(block);
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+}
+
+/* add an object of the snapshot on startup, its body stays in the map */
+static void load_snap_block(void *arg, snap_map *map, uint64_t off, char *uri,
+    char *object, size_t object_size, time_t fresh_until, time_t stale_until){
+
+    cache *cache_ptr = arg;
+    cache_tier *tier = &cache_ptr->tier[CACHE_MEM];
+    cache_block *block;
+    uint64_t key = uri_key(uri);
+    fresh_hdr h;
+
+    /* too large for the tier as it is configured now, or on disk */
+    if (object_size > tier->max_object || object_size > tier->max_size ||
+        lookup(cache_ptr, uri, key) != NULL) {
+        return;
+    }
+
+    make_room(cache_ptr, CACHE_MEM, object_size);
+    block = add_block(cache_ptr, CACHE_MEM, uri, key, object, object_size,
+        NULL);
+    block->snap = map;
+    block->snap_off = off;
+    map->refcnt++;
+
+    /* validators from the header, lifetime as of the snapshot */
+    fresh_init(&h);
+    fresh_scan(&h, object, object_size);
+    set_fresh(block, &h, 0);
+    block->fresh_until = fresh_until;
+    block->stale_until = stale_until;
+}
+
+/*
+ * open the snapshot file at path and load its objects to the memory tier
+ * return -1 on error
+ */
+int cache_load_snapshot(cache *cache_ptr, char *path){
+    pthread_mutex_lock(&cache_ptr->lock);
+    cache_ptr->snap = snap_open(path, load_snap_block, cache_ptr);
+    if (cache_ptr->snap != NULL) {
+        cache_ptr->snap_st = cache_ptr->snap->st;
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return (cache_ptr->snap != NULL) ? 0 : -1;
+}
+
+/*
+ * snapshot the memory tier, appending the blocks not in the file yet
+ * called by one thread at a time
+ * return -1 on error
+ */
+int cache_snapshot(cache *cache_ptr){
+    snap_file *s = cache_ptr->snap;
+    cache_block **blocks, *block;
+    snap_entry *entries, *listed;
+    size_t n = 0, live = 0, kept = 0;
+    int rewrite, rc;
+
+    if (s == NULL) {
+        return 0;
+    }
+
+    /* hold the blocks of the memory tier */
+    pthread_mutex_lock(&cache_ptr->lock);
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        for (block = cache_ptr->table[i]; block != NULL; block = block->hnext) {
+            n += (block->tier == CACHE_MEM);
+        }
+    }
+    blocks = Malloc((n + 1) * sizeof(cache_block *));
+    entries = Malloc((n + 1) * sizeof(snap_entry));
+    listed = Malloc((n + 1) * sizeof(snap_entry));
+    n = 0;
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        for (block = cache_ptr->table[i]; block != NULL; block = block->hnext) {
+            if (block->tier == CACHE_MEM) {
+                block->refcnt++;
+                blocks[n] = block;
+                entries[n].off = block->snap_off;
+                entries[n].fresh_until = block->fresh_until;
+                entries[n].stale_until = block->stale_until;
+                live += block->object_size;
+                n++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    /* write the new blocks, or all of them to a new file */
+    rewrite = snap_begin(s, live);
+    for (size_t i = 0; i < n; i++) {
+        if (rewrite || entries[i].off == 0) {
+            entries[i].off = snap_append(s, blocks[i]->uri, blocks[i]->object,
+                blocks[i]->object_size);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (entries[i].off != 0) {
+            listed[kept++] = entries[i];
+        }
+        else {
+            live -= blocks[i]->object_size;
+        }
+    }
+    rc = snap_commit(s, listed, kept, live);
+
+    /* remember where the blocks are, and let them go */
+    pthread_mutex_lock(&cache_ptr->lock);
+    for (size_t i = 0; i < n; i++) {
+        block = blocks[i];
+        if (rc == 0) {
+            block->snap_off = entries[i].off;
+        }
+        if (--block->refcnt == 0 && block->is_evicted) {
+            free_block(block);
+        }
+    }
+    cache_ptr->snap_st = s->st;
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    free(blocks);
+    free(entries);
+    free(listed);
+    return rc;
+}
+
+/* get the counts of snapshots, return 0 if there is no snapshot file */
+int cache_snapshot_stats(cache *cache_ptr, snap_stat *st){
+    pthread_mutex_lock(&cache_ptr->lock);
+    *st = cache_ptr->snap_st;
+    pthread_mutex_unlock(&cache_ptr->lock);
+
+    return cache_ptr->snap != NULL;
+}
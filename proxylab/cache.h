@@ -0,0 +1,120 @@
+/*
+ * cache.h
+ *
+ * Two-tier web object cache. Small objects are kept in memory, large
+ * ones in files of a disk store that are mapped into memory when they
+ * are served. Each tier evicts by its own policy (see policy.h), LRU
+ * using linked list by default.
+ *
+ * A block is served as it is while it is fresh, and has to be
+ * revalidated with the server once it is stale (see fresh.h).
+ *
+ * The memory tier can be snapshotted to a file and loaded back on
+ * startup (see snap.h).
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "disk.h"
+#include "fresh.h"
+#include "snap.h"
+
+#define CACHE_BUCKETS 1024      //number of uri hash buckets
+#define CACHE_QUEUES 3          //max number of queues of a policy
+
+/* cache tiers */
+#define CACHE_MEM 0
+#define CACHE_DISK 1
+
+/* freshness of a block */
+#define CACHE_FRESH 0           //serve it
+#define CACHE_STALE_OK 1        //serve it and revalidate in background
+#define CACHE_STALE 2           //revalidate before serving
+
+typedef struct cache_block {
+    char *uri;
+    char *object;               //whole response, NULL if disk block not mapped
+    size_t object_size;
+    int tier;
+    int refcnt;                 //references held by requests being served
+    int is_evicted;             //free when the last reference is dropped
+    char *file;                 //file name in disk store
+    char *map;                  //mapping of the file
+    size_t map_size;
+    snap_map *snap;             //snapshot the object is in, NULL if none
+    uint64_t snap_off;          //record in snapshot file, 0 if not written
+    uint64_t key;               //hash of uri
+    struct cache_block *hnext;  //hash chain
+
+    /* freshness, set when the object is first in memory */
+    int has_fresh;
+    time_t fresh_until;         //served without revalidation until
+    time_t stale_until;         //served while revalidating until
+    char *etag;                 //validators, NULL if none, fixed once set
+    char *last_modified;
+    int is_revalidating;        //a background revalidation is running
+
+    /* eviction policy state */
+    int queue;                  //queue of the block in its tier
+    int freq;                   //accesses since insertion
+    double priority;            //GDSF priority
+    size_t heap_idx;            //position in GDSF heap
+    struct cache_block *prev;   //queue of the block
+    struct cache_block *next;
+} cache_block;
+
+/* doubly linked queue, head is the most recently inserted */
+typedef struct cache_queue {
+    cache_block *head;
+    cache_block *tail;
+    size_t size;                //bytes of objects in the queue
+} cache_queue;
+
+struct cache_policy;
+struct sketch;
+
+typedef struct cache_tier {
+    size_t max_size;            //total size of objects in the tier
+    size_t max_object;          //size of the largest object in the tier
+    size_t size;
+
+    /* eviction policy state */
+    struct cache_policy *policy;
+    int admit;                  //TinyLFU admission in front of policy
+    cache_queue queue[CACHE_QUEUES];
+    cache_block **heap;         //GDSF min-heap of priority
+    size_t heap_len;
+    size_t heap_cap;
+    double clock;               //GDSF inflation value
+    uint64_t *ghost;            //S3-FIFO keys evicted from small queue
+    struct sketch *sketch;      //access frequencies, NULL if not needed
+} cache_tier;
+
+typedef struct cache {
+    cache_tier tier[2];
+    cache_block *table[CACHE_BUCKETS];
+    char *dir;                  //disk store, NULL if there is no disk tier
+    int index_fd;
+    snap_file *snap;            //snapshot file, NULL if none
+    snap_stat snap_st;          //as of the last snapshot
+    pthread_mutex_t lock;
+} cache;
+
+cache *cache_init(size_t mem_size, size_t mem_object,
+    char *dir, size_t disk_size, size_t disk_object,
+    char *policy, int admit);
+cache_block *cache_match(cache *cache_ptr, char *uri);
+int cache_contains(cache *cache_ptr, char *uri);
+void cache_release(cache *cache_ptr, cache_block *block);
+void cache_insert(cache *cache_ptr, char *uri, char *object, size_t object_size);
+void cache_insert_disk(cache *cache_ptr, disk_writer *w);
+int cache_freshness(cache *cache_ptr, cache_block *block, time_t now);
+void cache_refresh(cache *cache_ptr, cache_block *block, char *hdr, size_t hdr_size);
+int cache_revalidate_begin(cache *cache_ptr, cache_block *block);
+void cache_revalidate_end(cache *cache_ptr, cache_block *block);
+int cache_load_snapshot(cache *cache_ptr, char *path);
+int cache_snapshot(cache *cache_ptr);
+int cache_snapshot_stats(cache *cache_ptr, snap_stat *st);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * disk.c
+ *
+ * An object file is laid out as
+ * [disk_record][uri][header][DISK_RESERVE][body]
+ * while it is written under a temporary name. On commit the header is
+ * moved next to the body with a Content-Length line filling the gap, the
+ * record is filled in and the file is renamed to its final name, so a
+ * crash never leaves a half written object under a final name.
+ *
+ * The index log has one line per event:
+ * + <file> <object size> <uri>
+ * - <file>
+ * It is replayed and compacted on startup.
+ */
+
+#include <dirent.h>
+#include "csapp.h"
+#include "disk.h"
+
+static unsigned int file_seq = 0;
+static pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* an object listed in the index while it is replayed */
+typedef struct disk_entry {
+    char *file;
+    size_t object_size;
+    char *uri;
+    struct disk_entry *next;
+} disk_entry;
+
+/* build the path of a file in the store */
+static inline void path(char *buf, char *dir, char *file){
+    snprintf(buf, MAXLINE, "%s/%s", dir, file);
+}
+
+/* return 1 if the name ends with suffix */
+static inline int has_suffix(char *name, char *suffix){
+    size_t n = strlen(name), m = strlen(suffix);
+    return n >= m && !strcmp(name + n - m, suffix);
+}
+
+/* write the whole buffer at offset, return -1 on error */
+static int pwriten(int fd, void *buf, size_t n, off_t off){
+    char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = pwrite(fd, p, n, off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += rc;
+        off += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+/* return 1 if the object file is complete and holds uri */
+static int check_file(char *dir, char *file, char *uri){
+    char name[MAXLINE], stored[MAXLINE];
+    size_t len = strlen(uri);
+    disk_record rec;
+    int fd, ok = 0;
+    struct stat st;
+
+    path(name, dir, file);
+    if ((fd = open(name, O_RDONLY)) < 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) == 0 &&
+        pread(fd, &rec, sizeof(rec), 0) == sizeof(rec) &&
+        rec.magic == DISK_MAGIC &&
+        rec.uri_len == len && len < MAXLINE &&
+        pread(fd, stored, len, sizeof(rec)) == (ssize_t)len &&
+        !memcmp(stored, uri, len) &&
+        rec.obj_off + rec.obj_size <= (uint64_t)st.st_size) {
+        ok = 1;
+    }
+
+    close(fd);
+    return ok;
+}
+
+/* remove files left by writers that never committed */
+static void remove_temp(char *dir){
+    DIR *d;
+    struct dirent *ent;
+
+    if ((d = opendir(dir)) == NULL) {
+        return;
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+        if (has_suffix(ent->d_name, ".tmp")) {
+            disk_remove(dir, ent->d_name);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * open the disk store in dir, creating it if needed
+ * objects of the index are passed to fn in the order they were added,
+ * then the index is compacted
+ * return the fd of the index log, -1 on error
+ */
+int disk_load(char *dir, disk_load_fn *fn, void *arg){
+    char name[MAXLINE], tmp[MAXLINE], line[MAXLINE];
+    char file[MAXLINE], uri[MAXLINE];
+    disk_entry *head = NULL, **tail = &head, **pp, *e;
+    unsigned long size;
+    FILE *fp;
+    int fd;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    remove_temp(dir);
+
+    /* replay the index */
+    path(name, dir, DISK_INDEX);
+    if ((fp = fopen(name, "r")) != NULL) {
+        while (fgets(line, MAXLINE, fp) != NULL) {
+            if (sscanf(line, "+ %s %lu %s", file, &size, uri) == 3) {
+                e = Malloc(sizeof(disk_entry));
+                e->file = strdup(file);
+                e->object_size = size;
+                e->uri = strdup(uri);
+                e->next = NULL;
+                *tail = e;
+                tail = &e->next;
+            }
+            else if (sscanf(line, "- %s", file) == 1) {
+                for (pp = &head; *pp != NULL; pp = &(*pp)->next) {
+                    if (!strcmp((*pp)->file, file)) {
+                        e = *pp;
+                        *pp = e->next;
+                        if (tail == &e->next) {
+                            tail = pp;
+                        }
+                        free(e->file);
+                        free(e->uri);
+                        free(e);
+                        break;
+                    }
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    /* write the live objects to a new index */
+    path(tmp, dir, DISK_INDEX ".tmp");
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+
+    while ((e = head) != NULL) {
+        head = e->next;
+
+        if (check_file(dir, e->file, e->uri)) {
+            fprintf(fp, "+ %s %lu %s\n", e->file,
+                (unsigned long)e->object_size, e->uri);
+            fn(arg, e->file, e->object_size, e->uri);
+        }
+        else {
+            disk_remove(dir, e->file);
+        }
+
+        free(e->file);
+        free(e->uri);
+        free(e);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, name) < 0) {
+        return -1;
+    }
+
+    if ((fd = open(name, O_WRONLY | O_APPEND)) < 0) {
+        return -1;
+    }
+    return fd;
+}
+
+/* log an object added to the store */
+void disk_index_add(int index_fd, char *file, size_t object_size, char *uri){
+    char line[MAXLINE];
+
+    /* one write per line, O_APPEND keeps the lines whole */
+    snprintf(line, MAXLINE, "+ %s %lu %s\n", file,
+        (unsigned long)object_size, uri);
+    if (write(index_fd, line, strlen(line)) < 0) {
+        fprintf(stderr, "disk index: %s\n", strerror(errno));
+    }
+}
+
+/* log an object removed from the store */
+void disk_index_remove(int index_fd, char *file){
+    char line[MAXLINE];
+
+    snprintf(line, MAXLINE, "- %s\n", file);
+    if (write(index_fd, line, strlen(line)) < 0) {
+        fprintf(stderr, "disk index: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * start writing the object of uri to a new file
+ * hdr is the status line and headers without Content-Length and the
+ * empty line, return NULL on error
+ */
+disk_writer *disk_begin(char *dir, char *uri, char *hdr, size_t hdr_size,
+    size_t max_object){
+
+    char name[MAXLINE];
+    disk_writer *w;
+    unsigned int seq;
+
+    if (hdr_size + DISK_RESERVE > max_object) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&seq_lock);
+    seq = file_seq++;
+    pthread_mutex_unlock(&seq_lock);
+
+    w = Malloc(sizeof(disk_writer));
+    snprintf(w->file, sizeof(w->file), "%lx-%d-%u.obj",
+        (unsigned long)time(NULL), (int)getpid(), seq);
+    snprintf(name, MAXLINE, "%s/%s.tmp", dir, w->file);
+
+    if ((w->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free(w);
+        return NULL;
+    }
+
+    w->dir = dir;
+    w->uri = strdup(uri);
+    w->hdr = Malloc(hdr_size);
+    memcpy(w->hdr, hdr, hdr_size);
+    w->hdr_size = hdr_size;
+    w->hdr_off = sizeof(disk_record) + strlen(uri);
+    w->body_size = 0;
+    w->max_object = max_object;
+
+    if (pwriten(w->fd, uri, strlen(uri), sizeof(disk_record)) < 0 ||
+        pwriten(w->fd, hdr, hdr_size, w->hdr_off) < 0) {
+        disk_abort(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+/*
+ * append part of the body
+ * return -1 on error or when the object grows too large
+ */
+int disk_write(disk_writer *w, char *buf, size_t n){
+    off_t off = w->hdr_off + w->hdr_size + DISK_RESERVE + w->body_size;
+
+    if (w->hdr_size + DISK_RESERVE + w->body_size + n > w->max_object) {
+        return -1;
+    }
+
+    if (pwriten(w->fd, buf, n, off) < 0) {
+        return -1;
+    }
+
+    w->body_size += n;
+    return 0;
+}
+
+/*
+ * finish the object file and give it its final name
+ * return -1 on error
+ */
+int disk_commit(disk_writer *w, size_t *object_size){
+    char name[MAXLINE], tmp[MAXLINE], line[DISK_RESERVE];
+    disk_record rec;
+    size_t len;
+
+    sprintf(line, "Content-Length: %lu\r\n\r\n", (unsigned long)w->body_size);
+    len = strlen(line);
+
+    rec.magic = DISK_MAGIC;
+    rec.uri_len = strlen(w->uri);
+    rec.obj_off = w->hdr_off + DISK_RESERVE - len;
+    rec.obj_size = w->hdr_size + len + w->body_size;
+
+    /* move header next to the body and fill the gap */
+    if (pwriten(w->fd, w->hdr, w->hdr_size, rec.obj_off) < 0 ||
+        pwriten(w->fd, line, len, rec.obj_off + w->hdr_size) < 0 ||
+        pwriten(w->fd, &rec, sizeof(rec), 0) < 0) {
+        return -1;
+    }
+
+    close(w->fd);
+    w->fd = -1;
+
+    path(name, w->dir, w->file);
+    snprintf(tmp, MAXLINE, "%s/%s.tmp", w->dir, w->file);
+    if (rename(tmp, name) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    *object_size = rec.obj_size;
+    return 0;
+}
+
+/* release a committed writer */
+void disk_close(disk_writer *w){
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+    free(w->hdr);
+    free(w->uri);
+    free(w);
+}
+
+/* drop the object being written */
+void disk_abort(disk_writer *w){
+    char tmp[MAXLINE];
+
+    snprintf(tmp, MAXLINE, "%s/%s.tmp", w->dir, w->file);
+    unlink(tmp);
+    disk_close(w);
+}
+
+/*
+ * map an object file into memory
+ * return the mapping and set object to the response in it, NULL on error
+ */
+char *disk_map(char *dir, char *file, size_t *map_size,
+    char **object, size_t *object_size){
+
+    char name[MAXLINE];
+    struct stat st;
+    disk_record *rec;
+    char *map;
+    int fd;
+
+    path(name, dir, file);
+    if ((fd = open(name, O_RDONLY)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(disk_record)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    rec = (disk_record *)map;
+    if (rec->magic != DISK_MAGIC ||
+        rec->obj_off + rec->obj_size > (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *map_size = st.st_size;
+    *object = map + rec->obj_off;
+    *object_size = rec->obj_size;
+    return map;
+}
+
+/* unmap an object file */
+void disk_unmap(char *map, size_t map_size){
+    munmap(map, map_size);
+}
+
+/* delete a file of the store */
+void disk_remove(char *dir, char *file){
+    char name[MAXLINE];
+
+    path(name, dir, file);
+    unlink(name);
+}
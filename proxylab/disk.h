@@ -0,0 +1,58 @@
+/*
+ * disk.h
+ *
+ * File store of the disk cache tier. Every object is kept in a file of
+ * its own, which starts with a disk_record and the uri. The store keeps
+ * an append-only index log so that the tier is warm after a restart.
+ */
+
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdint.h>
+
+#define DISK_MAGIC 0x4f43504bU  //"KPCO"
+#define DISK_RESERVE 48         //room between header and body in a file
+#define DISK_INDEX "index"      //name of the index log in the store
+
+/* head of an object file, the object follows at obj_off */
+typedef struct disk_record {
+    uint32_t magic;
+    uint32_t uri_len;
+    uint64_t obj_off;
+    uint64_t obj_size;
+} disk_record;
+
+/* object file being written while the response is relayed */
+typedef struct disk_writer {
+    char *dir;
+    char *uri;
+    char file[64];
+    int fd;
+    char *hdr;                  //header kept to be rewritten on commit
+    size_t hdr_size;
+    size_t hdr_off;
+    size_t body_size;
+    size_t max_object;
+} disk_writer;
+
+/* called for every object found in the index on startup */
+typedef void disk_load_fn(void *arg, char *file, size_t object_size, char *uri);
+
+int disk_load(char *dir, disk_load_fn *fn, void *arg);
+void disk_index_add(int index_fd, char *file, size_t object_size, char *uri);
+void disk_index_remove(int index_fd, char *file);
+
+disk_writer *disk_begin(char *dir, char *uri, char *hdr, size_t hdr_size,
+    size_t max_object);
+int disk_write(disk_writer *w, char *buf, size_t n);
+int disk_commit(disk_writer *w, size_t *object_size);
+void disk_close(disk_writer *w);
+void disk_abort(disk_writer *w);
+
+char *disk_map(char *dir, char *file, size_t *map_size,
+    char **object, size_t *object_size);
+void disk_unmap(char *map, size_t map_size);
+void disk_remove(char *dir, char *file);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * dns.c
+ *
+ * Names live in a hash table of buckets under one lock. The first
+ * lookup of a name resolves it in the calling thread while later ones
+ * for the same name wait for that answer. Once a name is known, lookups
+ * never block: an expired answer is still returned (for at most
+ * DNS_STALE_MAX seconds) while the refresh thread resolves it again.
+ *
+ * dns_connect() orders the addresses so that the families alternate,
+ * starting with the family of the first answer (RFC 8305), and starts a
+ * non-blocking connect to the next address every DNS_ATTEMPT_DELAY ms,
+ * or as soon as one fails, until the first one succeeds.
+ */
+
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "dns.h"
+
+typedef struct dns_entry {
+    char *host;
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int naddrs;                 //0 for a failed lookup
+    time_t expires;             //0 until the first answer
+    time_t last_used;
+    int is_resolving;
+    struct dns_entry *next;
+} dns_entry;
+
+/* an entry of the hosts file */
+typedef struct dns_host {
+    char *name;
+    dns_addr addr;
+    struct dns_host *next;
+} dns_host;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+
+static dns_host *hosts;         //hosts file entries
+static int use_hosts;           //resolve from hosts file only
+
+/* return the bucket index of a host name */
+static inline size_t hash(char *host){
+    size_t h = 5381;
+
+    while (*host) {
+        h = h * 33 + tolower((unsigned char)*host++);
+    }
+    return h % DNS_BUCKETS;
+}
+
+/* parse a numeric IPv4 or IPv6 address, return 0 on success */
+static int parse_addr(char *s, dns_addr *addr){
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr->sa;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr->sa;
+
+    memset(addr, 0, sizeof(dns_addr));
+    if (inet_pton(AF_INET, s, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        addr->len = sizeof(struct sockaddr_in);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, s, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        addr->len = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+    return -1;
+}
+
+/* read a hosts file, "<address> <name> [aliases]" per line */
+static void load_hosts(char *file){
+    char line[MAXLINE], *p, *name;
+    dns_addr addr;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        unix_error("cannot open hosts file");
+    }
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strtok(line, " \t\r\n")) == NULL || parse_addr(p, &addr) < 0) {
+            continue;
+        }
+
+        while ((name = strtok(NULL, " \t\r\n")) != NULL) {
+            dns_host *h = Malloc(sizeof(dns_host));
+            h->name = strdup(name);
+            h->addr = addr;
+            h->next = hosts;
+            hosts = h;
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * resolve a host name without the cache
+ * the addresses are ordered with families alternating
+ * return the number of addresses, 0 if the name cannot be resolved
+ */
+static int resolve(char *host, dns_addr *addrs){
+    dns_addr found[DNS_MAX_ADDRS], *v4[DNS_MAX_ADDRS], *v6[DNS_MAX_ADDRS];
+    int n = 0, n4 = 0, n6 = 0, i4 = 0, i6 = 0, first;
+    struct addrinfo hints, *res, *ai;
+    dns_host *h;
+
+    if (parse_addr(host, &found[0]) == 0) {
+        n = 1;
+    }
+    else if (use_hosts) {
+        /* the file lists the lines of a name in order, the list is reversed */
+        for (h = hosts; h != NULL; h = h->next) {
+            if (!strcasecmp(h->name, host) && n < DNS_MAX_ADDRS) {
+                memmove(&found[1], &found[0], n * sizeof(dns_addr));
+                found[0] = h->addr;
+                n++;
+            }
+        }
+    }
+    else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+
+        if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+            return 0;
+        }
+        for (ai = res; ai != NULL && n < DNS_MAX_ADDRS; ai = ai->ai_next) {
+            memset(&found[n], 0, sizeof(dns_addr));
+            memcpy(&found[n].sa, ai->ai_addr, ai->ai_addrlen);
+            found[n].len = ai->ai_addrlen;
+            n++;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    /* interleave the families */
+    for (int i = 0; i < n; i++) {
+        if (found[i].sa.ss_family == AF_INET6) {
+            v6[n6++] = &found[i];
+        }
+        else {
+            v4[n4++] = &found[i];
+        }
+    }
+
+    first = found[0].sa.ss_family;
+    for (int i = 0; i < n; i++) {
+        int want6 = (i % 2 == 0) == (first == AF_INET6);
+
+        if ((want6 && i6 < n6) || i4 == n4) {
+            addrs[i] = *v6[i6++];
+        }
+        else {
+            addrs[i] = *v4[i4++];
+        }
+    }
+    return n;
+}
+
+/* find the entry of a host name, called with dns_lock held */
+static dns_entry *lookup(char *host){
+    dns_entry *e;
+
+    for (e = buckets[hash(host)]; e != NULL; e = e->next) {
+        if (!strcasecmp(e->host, host)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* store the answer of a resolution, called with dns_lock held */
+static void set_answer(dns_entry *e, dns_addr *addrs, int n, time_t now){
+    if (n > 0) {
+        memcpy(e->addrs, addrs, n * sizeof(dns_addr));
+        e->naddrs = n;
+        e->expires = now + DNS_TTL;
+    }
+    else if (e->naddrs > 0 && now - e->expires < DNS_STALE_MAX) {
+        /* keep the old answer a little longer, retry soon */
+        e->expires = now + DNS_NEG_TTL;
+    }
+    else {
+        e->naddrs = 0;
+        e->expires = now + DNS_NEG_TTL;
+    }
+}
+
+/*
+ * resolve names in use again before they expire,
+ * and drop the names not used for DNS_IDLE seconds
+ */
+static void *refresh(void *arg){
+    dns_addr addrs[DNS_MAX_ADDRS];
+    char host[MAXLINE];
+    dns_entry *e, **pp;
+    time_t now;
+    int n;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        sleep(DNS_REFRESH_INTERVAL);
+
+        for (size_t i = 0; i < DNS_BUCKETS; i++) {
+            now = time(NULL);
+            host[0] = '\0';
+
+            pthread_mutex_lock(&dns_lock);
+            for (pp = &buckets[i]; *pp != NULL; ) {
+                e = *pp;
+
+                if (!e->is_resolving && now - e->last_used >= DNS_IDLE) {
+                    *pp = e->next;
+                    free(e->host);
+                    free(e);
+                    continue;
+                }
+
+                /* one name per scan of a bucket is enough */
+                if (host[0] == '\0' && !e->is_resolving && e->expires != 0 &&
+                    e->expires - now <= DNS_REFRESH_INTERVAL &&
+                    now - e->last_used < DNS_TTL) {
+                    e->is_resolving = 1;
+                    strcpy(host, e->host);
+                }
+                pp = &e->next;
+            }
+            pthread_mutex_unlock(&dns_lock);
+
+            if (host[0] == '\0') {
+                continue;
+            }
+
+            n = resolve(host, addrs);
+
+            pthread_mutex_lock(&dns_lock);
+            if ((e = lookup(host)) != NULL) {
+                set_answer(e, addrs, n, time(NULL));
+                e->is_resolving = 0;
+            }
+            pthread_mutex_unlock(&dns_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * init the name cache and start the refresh thread
+ * names are resolved only from hosts_file if it is not NULL
+ */
+void dns_init(char *hosts_file){
+    pthread_t tid;
+
+    if (hosts_file != NULL) {
+        load_hosts(hosts_file);
+        use_hosts = 1;
+    }
+
+    Pthread_create(&tid, NULL, refresh, NULL);
+}
+
+/*
+ * get the addresses of a host name, at most max of them
+ * return the number of addresses, -1 if the name cannot be resolved
+ */
+int dns_lookup(char *host, dns_addr *addrs, int max){
+    dns_addr found[DNS_MAX_ADDRS];
+    dns_entry *e;
+    time_t now = time(NULL);
+    int n;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = lookup(host)) == NULL) {
+        size_t i = hash(host);
+
+        e = Malloc(sizeof(dns_entry));
+        e->host = strdup(host);
+        e->naddrs = 0;
+        e->expires = 0;
+        e->is_resolving = 0;
+        e->next = buckets[i];
+        buckets[i] = e;
+    }
+    e->last_used = now;
+
+    /* wait for the first answer being resolved by another request */
+    while (e->is_resolving && e->expires == 0) {
+        pthread_cond_wait(&dns_cond, &dns_lock);
+    }
+
+    if (!e->is_resolving &&
+        (e->expires == 0 ||
+        (e->naddrs == 0 && now >= e->expires) ||
+        now - e->expires >= DNS_STALE_MAX)) {
+        /* unknown, failed long enough ago, or too old to use */
+        e->is_resolving = 1;
+        pthread_mutex_unlock(&dns_lock);
+
+        n = resolve(host, found);
+
+        pthread_mutex_lock(&dns_lock);
+        set_answer(e, found, n, time(NULL));
+        e->is_resolving = 0;
+        pthread_cond_broadcast(&dns_cond);
+    }
+
+    n = (e->naddrs < max) ? e->naddrs : max;
+    memcpy(addrs, e->addrs, n * sizeof(dns_addr));
+    pthread_mutex_unlock(&dns_lock);
+
+    return (n > 0) ? n : -1;
+}
+
+/* start a non-blocking connect, return the fd or -1 if it failed at once */
+static int start_connect(dns_addr *addr, int port, int *done){
+    dns_addr a = *addr;
+    int fd, one = 1;
+
+    if (a.sa.ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)&a.sa)->sin6_port = htons(port);
+    }
+    else {
+        ((struct sockaddr_in *)&a.sa)->sin_port = htons(port);
+    }
+
+    if ((fd = socket(a.sa.ss_family, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    /* requests are written whole, do not hold back their last segment */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    *done = 0;
+    if (connect(fd, (struct sockaddr *)&a.sa, a.len) == 0) {
+        *done = 1;
+    }
+    else if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * open a connection to <host, port>, racing its addresses
+ * return the connected fd in blocking mode, -1 on error
+ */
+int dns_connect(char *host, int port){
+    dns_addr addrs[DNS_MAX_ADDRS];
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    int n, next = 0, live = 0, fd = -1, done, err;
+    socklen_t errlen;
+    long waited = 0;
+
+    if ((n = dns_lookup(host, addrs, DNS_MAX_ADDRS)) < 0) {
+        return -1;
+    }
+
+    while (fd < 0) {
+        /* start the next attempt */
+        if (next < n) {
+            int s = start_connect(&addrs[next++], port, &done);
+
+            if (s >= 0 && done) {
+                fd = s;
+                break;
+            }
+            if (s >= 0) {
+                pfd[live].fd = s;
+                pfd[live].events = POLLOUT;
+                live++;
+            }
+            else {
+                /* failed at once, go on with the next address */
+                continue;
+            }
+        }
+
+        if (live == 0 || waited >= DNS_CONNECT_TIMEOUT) {
+            break;
+        }
+
+        int timeout = (next < n) ? DNS_ATTEMPT_DELAY : DNS_CONNECT_TIMEOUT - waited;
+        int rc = poll(pfd, live, timeout);
+
+        if (rc < 0 && errno != EINTR) {
+            break;
+        }
+        if (rc <= 0) {
+            waited += timeout;
+            continue;
+        }
+
+        for (int i = 0; i < live; ) {
+            if (pfd[i].revents == 0) {
+                i++;
+                continue;
+            }
+
+            errlen = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+                err == 0) {
+                fd = pfd[i].fd;
+            }
+            else {
+                close(pfd[i].fd);
+            }
+            pfd[i] = pfd[--live];
+
+            if (fd >= 0) {
+                break;
+            }
+        }
+    }
+
+    /* close the attempts that lost the race */
+    for (int i = 0; i < live; i++) {
+        close(pfd[i].fd);
+    }
+
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    return fd;
+}
@@ -0,0 +1,37 @@
+/*
+ * dns.h
+ *
+ * Cache of resolved origin host names, and Happy Eyeballs connect.
+ * Answers are kept for DNS_TTL seconds and failures for DNS_NEG_TTL.
+ * A background thread resolves names in use again before they expire,
+ * so that a miss rarely waits for the resolver.
+ *
+ * Names are resolved by getaddrinfo(), or only from a hosts file in
+ * /etc/hosts format when one is given, to run without a network.
+ */
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <sys/socket.h>
+
+#define DNS_BUCKETS 64              //number of host name hash buckets
+#define DNS_MAX_ADDRS 8             //addresses kept per name
+#define DNS_TTL 60                  //seconds an answer is fresh
+#define DNS_NEG_TTL 5               //seconds a failure is remembered
+#define DNS_STALE_MAX 300           //seconds an expired answer is still used
+#define DNS_IDLE 600                //seconds before an unused name is dropped
+#define DNS_REFRESH_INTERVAL 1      //seconds between refresh scans
+#define DNS_ATTEMPT_DELAY 250       //ms before racing the next address
+#define DNS_CONNECT_TIMEOUT 10000   //ms before giving up a connect
+
+typedef struct dns_addr {
+    struct sockaddr_storage sa;
+    socklen_t len;
+} dns_addr;
+
+void dns_init(char *hosts_file);
+int dns_lookup(char *host, dns_addr *addrs, int max);
+int dns_connect(char *host, int port);
+
+#endif
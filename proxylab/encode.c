@@ -0,0 +1,221 @@
+/*
+ * encode.c
+ *
+ * Jobs are a ring under one lock, taken by the threads of the pool.
+ * A job has a copy of the object, the cache may evict the original
+ * while it waits. The body is compressed in one deflate() call into a
+ * buffer of deflateBound() bytes, after room for the new header.
+ *
+ * The variant has the header of the original with Content-Encoding and
+ * Vary added, without its ETag, which names the uncompressed body.
+ */
+
+#include "csapp.h"
+#include <zlib.h>
+#include "encode.h"
+
+typedef struct job {
+    char *uri;
+    char *object;
+    size_t object_size;
+} job;
+
+static struct {
+    job ring[ENCODE_QUEUE];
+    int head;
+    int len;
+    int threads;
+    encode_done done;
+    encode_stat st;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* return 1 if the header line at p is named name */
+static int is_hdr(char *p, char *name){
+    return !strncasecmp(p, name, strlen(name));
+}
+
+/*
+ * return 1 if a cached 200 object is worth compressing: text of some
+ * size, not encoded already, and the server allows transforming it
+ */
+int encode_compressible(char *object, size_t object_size){
+    char *end = memmem(object, object_size, "\r\n\r\n", 4), *p, *eol;
+    int text = 0;
+
+    if (pool.threads == 0 || end == NULL ||
+        object + object_size - (end + 4) < ENCODE_MIN_SIZE) {
+        return 0;
+    }
+
+    for (p = object; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end + 2 - p);
+
+        if (is_hdr(p, "Content-Encoding:")) {
+            return 0;
+        }
+        if (is_hdr(p, "Cache-Control:") &&
+            memmem(p, eol - p, "no-transform", 12) != NULL) {
+            return 0;
+        }
+        if (is_hdr(p, "Content-Type:")) {
+            char type[64];
+            size_t n = eol - p - 13;
+
+            n = (n < sizeof(type) - 1) ? n : sizeof(type) - 1;
+            memcpy(type, p + 13, n);
+            type[n] = '\0';
+            text = strcasestr(type, "text/") != NULL ||
+                strcasestr(type, "json") != NULL ||
+                strcasestr(type, "javascript") != NULL ||
+                strcasestr(type, "xml") != NULL;
+        }
+    }
+    return text;
+}
+
+/* make the cache key of the gzip variant of uri */
+void encode_key(char *key, char *uri){
+    sprintf(key, "%s%s", uri, ENCODE_GZIP_SUFFIX);
+}
+
+/*
+ * make the gzip variant of an object
+ * return it in a new buffer, or NULL if it is not smaller enough
+ */
+static char *gzip_object(char *object, size_t object_size, size_t *size){
+    char *end = memmem(object, object_size, "\r\n\r\n", 4) + 2, *p, *eol;
+    char *body = end + 2, *out, *q, line[64];
+    size_t body_size = object + object_size - body, hdr_size;
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, ENCODE_LEVEL, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    /* header of original without what is replaced */
+    out = q = Malloc((end - object) + 128 + deflateBound(&z, body_size));
+    for (p = object; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (!is_hdr(p, "Content-Length:") && !is_hdr(p, "ETag:") &&
+            !is_hdr(p, "Vary:")) {
+            memcpy(q, p, eol + 1 - p);
+            q += eol + 1 - p;
+        }
+    }
+    q += sprintf(q, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+    hdr_size = q - out;
+
+    /* body after room for Content-Length */
+    z.next_in = (Bytef *)body;
+    z.avail_in = body_size;
+    z.next_out = (Bytef *)(q + sizeof(line));
+    z.avail_out = deflateBound(&z, body_size);
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END ||
+        z.total_out > body_size * ENCODE_MAX_RATIO) {
+        deflateEnd(&z);
+        free(out);
+        return NULL;
+    }
+
+    sprintf(line, "Content-Length: %lu\r\n\r\n", (unsigned long)z.total_out);
+    memcpy(q, line, strlen(line));
+    memmove(q + strlen(line), q + sizeof(line), z.total_out);
+    *size = hdr_size + strlen(line) + z.total_out;
+
+    deflateEnd(&z);
+    return out;
+}
+
+/* thread of the pool */
+static void *worker(void *arg){
+    char key[MAXLINE + sizeof(ENCODE_GZIP_SUFFIX)], *variant;
+    size_t size, body;
+    job j;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.len == 0) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        j = pool.ring[pool.head];
+        pool.head = (pool.head + 1) % ENCODE_QUEUE;
+        pool.len--;
+        pthread_mutex_unlock(&pool.lock);
+
+        body = j.object_size -
+            ((char *)memmem(j.object, j.object_size, "\r\n\r\n", 4) + 4 - j.object);
+        variant = gzip_object(j.object, j.object_size, &size);
+
+        pthread_mutex_lock(&pool.lock);
+        if (variant != NULL) {
+            pool.st.encoded++;
+            pool.st.bytes_in += body;
+            pool.st.bytes_out += size - (j.object_size - body);
+        }
+        else {
+            pool.st.not_worth++;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (variant != NULL) {
+            encode_key(key, j.uri);
+            pool.done(key, variant, size);
+            free(variant);
+        }
+        free(j.object);
+        free(j.uri);
+    }
+    return NULL;
+}
+
+/* start the pool, no compression if threads is 0 */
+void encode_init(int threads, encode_done done){
+    pthread_t tid;
+
+    pool.threads = threads;
+    pool.done = done;
+    for (int i = 0; i < threads; i++) {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
+}
+
+/* queue a copy of a compressible object to make its gzip variant */
+void encode_later(char *uri, char *object, size_t object_size){
+    job j = { strdup(uri), Malloc(object_size), object_size };
+
+    memcpy(j.object, object, object_size);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.len < ENCODE_QUEUE) {
+        pool.ring[(pool.head + pool.len) % ENCODE_QUEUE] = j;
+        pool.len++;
+        pool.st.queued++;
+        pthread_cond_signal(&pool.cond);
+        j.object = NULL;
+    }
+    else {
+        pool.st.dropped++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (j.object != NULL) {
+        free(j.object);
+        free(j.uri);
+    }
+}
+
+void encode_stats(encode_stat *st){
+    pthread_mutex_lock(&pool.lock);
+    *st = pool.st;
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,50 @@
+/*
+ * encode.h
+ *
+ * Compression of cached responses. An uncompressed text response put
+ * in cache is handed to a pool of threads, which gzips it once and
+ * gives the gzip variant back to be cached beside it, under the uri
+ * with a suffix. Clients accepting gzip are then served the smaller
+ * variant, from less cache memory.
+ *
+ * Jobs beyond the queue are dropped, the response is simply cached
+ * uncompressed only. A variant is kept only if it is worth it.
+ *
+ * Link with -lz.
+ */
+
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#include <stddef.h>
+
+#define ENCODE_THREADS 2            //default threads of pool
+#define ENCODE_QUEUE 64             //max jobs waiting
+#define ENCODE_MIN_SIZE 512         //smaller bodies are left alone
+#define ENCODE_LEVEL 6
+#define ENCODE_MAX_RATIO 0.9        //max size of variant over original
+
+/* suffix of the cache key of a gzip variant, a fragment since those are
+ * never sent to the proxy, and with no space for the disk index */
+#define ENCODE_GZIP_SUFFIX "#gzip"
+
+/* counts of jobs, and bytes of the bodies compressed */
+typedef struct encode_stat {
+    unsigned long queued;
+    unsigned long dropped;          //queue was full
+    unsigned long encoded;
+    unsigned long not_worth;        //variant too large
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+} encode_stat;
+
+/* called by the pool with a gzip variant to cache */
+typedef void (*encode_done)(char *key, char *object, size_t object_size);
+
+void encode_init(int threads, encode_done done);
+void encode_key(char *key, char *uri);
+int encode_compressible(char *object, size_t object_size);
+void encode_later(char *uri, char *object, size_t object_size);
+void encode_stats(encode_stat *st);
+
+#endif
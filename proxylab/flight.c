@@ -0,0 +1,290 @@
+/*
+ * flight.c
+ *
+ * Flights in progress are kept in a hash table keyed by uri. A request
+ * missing in cache joins the flight of its uri if there is one, or
+ * creates it and becomes the leader.
+ *
+ * The leader appends the response to the flight buffer while relaying
+ * it to its own client; followers copy out what has arrived so far and
+ * wait on the condition variable for more. A flight leaves the table
+ * when it finishes, or as soon as the response turns out too large to
+ * cache: from then on nobody new joins it, and the rest of the body is
+ * not buffered. So that the buffer stays within the size of a cached
+ * object, followers only stream a response known to fit, and fetch the
+ * others on their own.
+ */
+
+#include "csapp.h"
+#include "flight.h"
+
+#define FLIGHT_INIT_CAP (1 << 14)   //initial buffer size
+
+static flight *table[FLIGHT_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t max_object_size;
+
+/* return the bucket index of a uri */
+static inline size_t hash(char *uri){
+    size_t h = 5381;
+
+    while (*uri) {
+        h = h * 33 + (unsigned char)*uri++;
+    }
+    return h % FLIGHT_BUCKETS;
+}
+
+/* return the offset of body in the flight buffer */
+static inline size_t body_off(flight *f){
+    return f->hdr_size + FLIGHT_RESERVE;
+}
+
+/* make room for n more bytes in the flight buffer */
+static void grow(flight *f, size_t n){
+    if (f->size + n <= f->cap) {
+        return;
+    }
+
+    while (f->size + n > f->cap) {
+        f->cap *= 2;
+    }
+
+    if ((f->buf = realloc(f->buf, f->cap)) == NULL) {
+        unix_error("realloc error");
+    }
+}
+
+/* remove a flight from the table so that nobody joins it anymore */
+static void unpublish(flight *f){
+    flight **pp;
+
+    pthread_mutex_lock(&table_lock);
+    for (pp = &table[hash(f->uri)]; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&f->lock);
+    f->is_shared = 0;
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* set the size limit of objects that can be cached */
+void flight_init(size_t max_object){
+    max_object_size = max_object;
+}
+
+/*
+ * join the flight of a variant of uri, or start one if there is none
+ * leader is set to 1 if the caller has to fetch the response
+ */
+flight *flight_join(char *uri, char *variant, int *leader){
+    size_t i = hash(uri);
+    flight *f;
+
+    pthread_mutex_lock(&table_lock);
+    for (f = table[i]; f != NULL; f = f->next) {
+        if (!strcmp(f->uri, uri) && !strcmp(f->variant, variant)) {
+            break;
+        }
+    }
+
+    if (f != NULL) {
+        /* someone is fetching it already */
+        pthread_mutex_lock(&f->lock);
+        f->refcnt++;
+        pthread_mutex_unlock(&f->lock);
+        *leader = 0;
+    }
+    else {
+        f = Malloc(sizeof(flight));
+        f->uri = strdup(uri);
+        f->variant = strdup(variant);
+        f->cap = FLIGHT_INIT_CAP;
+        f->buf = Malloc(f->cap);
+        f->size = 0;
+        f->total = 0;
+        f->hdr_off = 0;
+        f->hdr_size = 0;
+        f->content_length = -1;
+        f->status = 0;
+        f->state = FLIGHT_HEADER;
+        f->is_exceed = 0;
+        f->is_shared = 1;
+        f->refcnt = 1;
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->cond, NULL);
+
+        f->next = table[i];
+        table[i] = f;
+        *leader = 1;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    return f;
+}
+
+/* drop a reference to the flight, the last one frees it */
+void flight_release(flight *f){
+    int refcnt;
+
+    pthread_mutex_lock(&f->lock);
+    refcnt = --f->refcnt;
+    pthread_mutex_unlock(&f->lock);
+
+    if (refcnt == 0) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        free(f->buf);
+        free(f->variant);
+        free(f->uri);
+        free(f);
+    }
+}
+
+/*
+ * append part of the response to the flight buffer
+ * header lines go first, then the body after flight_header_done()
+ */
+void flight_append(flight *f, char *buf, size_t n){
+    int exceed = 0;
+
+    pthread_mutex_lock(&f->lock);
+    f->total += n;
+    if (!f->is_exceed && f->size + n > max_object_size) {
+        f->is_exceed = 1;
+        exceed = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    if (exceed) {
+        /* too large to cache, stop new followers */
+        unpublish(f);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FLIGHT_HEADER || !f->is_exceed) {
+        grow(f, n);
+        memcpy(f->buf + f->size, buf, n);
+        f->size += n;
+    }
+    if (f->state == FLIGHT_BODY) {
+        /* more body, or followers waiting to know if it fits */
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* mark the end of header, followers can start sending */
+void flight_header_done(flight *f, int status, long content_length){
+    pthread_mutex_lock(&f->lock);
+    f->hdr_size = f->size;
+    grow(f, FLIGHT_RESERVE);
+    f->size += FLIGHT_RESERVE;
+    f->status = status;
+    f->content_length = content_length;
+    f->state = FLIGHT_BODY;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * turn a complete flight buffer into a cache object
+ * the header is moved next to the body and a Content-Length line fills
+ * the gap, return NULL if the response is too large to cache
+ */
+char *flight_object(flight *f, size_t *object_size){
+    char line[FLIGHT_RESERVE];
+    size_t body_size, len;
+    char *object = NULL;
+
+    pthread_mutex_lock(&f->lock);
+    if (!f->is_exceed && f->state == FLIGHT_BODY) {
+        body_size = f->size - body_off(f);
+        sprintf(line, "Content-Length: %lu\r\n\r\n", (unsigned long)body_size);
+        len = strlen(line);
+
+        f->hdr_off = FLIGHT_RESERVE - len;
+        memmove(f->buf + f->hdr_off, f->buf, f->hdr_size);
+        memcpy(f->buf + f->hdr_off + f->hdr_size, line, len);
+
+        object = f->buf + f->hdr_off;
+        *object_size = f->hdr_size + len + body_size;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return object;
+}
+
+/* leader is done with the flight, ok is 0 if the fetch failed */
+void flight_finish(flight *f, int ok){
+    if (f->is_shared) {
+        unpublish(f);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    f->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * wait until the leader has read the header and copy it to hdr
+ * a body of unknown length is waited for until it turns out to fit
+ * return FLIGHT_ALONE if the response is too large to be buffered,
+ * -1 if the fetch failed or the header is larger than maxlen
+ */
+int flight_wait_header(flight *f, char *hdr, size_t maxlen,
+    size_t *hdr_size, long *content_length){
+
+    int rc = -1;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->state == FLIGHT_HEADER || (f->state == FLIGHT_BODY &&
+        f->content_length < 0 && !f->is_exceed)) {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+
+    if (f->state != FLIGHT_FAILED && (f->is_exceed ||
+        (f->content_length >= 0 &&
+        body_off(f) + (size_t)f->content_length > max_object_size))) {
+        rc = FLIGHT_ALONE;
+    }
+    else if (f->state != FLIGHT_FAILED && f->hdr_size <= maxlen) {
+        memcpy(hdr, f->buf + f->hdr_off, f->hdr_size);
+        *hdr_size = f->hdr_size;
+        *content_length = f->content_length;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return rc;
+}
+
+/*
+ * copy at most n bytes of body starting at offset, waiting if needed
+ * return the number of bytes, 0 at the end of body, -1 if the fetch failed
+ */
+ssize_t flight_read(flight *f, size_t offset, char *buf, size_t n){
+    ssize_t rc;
+
+    pthread_mutex_lock(&f->lock);
+    while (body_off(f) + offset >= f->size && f->state == FLIGHT_BODY) {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+
+    if (body_off(f) + offset < f->size) {
+        rc = f->size - body_off(f) - offset;
+        rc = ((size_t)rc < n) ? rc : (ssize_t)n;
+        memcpy(buf, f->buf + body_off(f) + offset, rc);
+    }
+    else {
+        rc = (f->state == FLIGHT_DONE) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return rc;
+}
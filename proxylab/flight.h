@@ -0,0 +1,67 @@
+/*
+ * flight.h
+ *
+ * Request coalescing for cache misses (single-flight).
+ * The first request missing on a uri becomes the leader and fetches it
+ * from server, later requests for the same uri join the flight and
+ * stream the response out of its buffer as it fills.
+ * Requests for a variant of the response, such as a byte range, only
+ * join flights of the same variant.
+ */
+
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#define FLIGHT_BUCKETS 64       //number of uri hash buckets
+#define FLIGHT_RESERVE 48       //room between header and body in buffer
+
+/* state of a flight */
+#define FLIGHT_HEADER 0         //leader is reading the header
+#define FLIGHT_BODY 1           //header published, body coming
+#define FLIGHT_DONE 2           //response complete
+#define FLIGHT_FAILED 3         //leader gave up
+
+#define FLIGHT_ALONE -2         //too large to share, fetch it alone
+
+/*
+ * response buffer of a flight
+ * [header][FLIGHT_RESERVE][body]
+ * the header has the status line and end-to-end headers without the
+ * empty line, the body is decoded if the server sent it chunked
+ */
+typedef struct flight {
+    char *uri;
+    char *variant;              //of the response of uri, "" for the plain one
+    char *buf;
+    size_t size;                //bytes used in buf
+    size_t cap;                 //bytes allocated for buf
+    size_t total;               //bytes of response appended, kept or not
+    size_t hdr_off;             //offset of header in buf
+    size_t hdr_size;            //size of header
+    long content_length;        //-1 if not known until the end
+    int status;                 //status code of response
+    int state;
+    int is_exceed;              //too large to cache, the rest not buffered
+    int is_shared;              //still in the table, others may join
+    int refcnt;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct flight *next;
+} flight;
+
+void flight_init(size_t max_object);
+flight *flight_join(char *uri, char *variant, int *leader);
+void flight_release(flight *f);
+
+/* leader side */
+void flight_append(flight *f, char *buf, size_t n);
+void flight_header_done(flight *f, int status, long content_length);
+char *flight_object(flight *f, size_t *object_size);
+void flight_finish(flight *f, int ok);
+
+/* follower side */
+int flight_wait_header(flight *f, char *hdr, size_t maxlen,
+    size_t *hdr_size, long *content_length);
+ssize_t flight_read(flight *f, size_t offset, char *buf, size_t n);
+
+#endif
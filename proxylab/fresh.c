@@ -0,0 +1,196 @@
+/*
+ * fresh.c
+ *
+ * fresh_scan() may be called on several headers of the same response,
+ * as when a 304 updates the stored header: fields found later override
+ * the earlier ones. Freshness lifetime follows RFC 9111: s-maxage, then
+ * max-age, then Expires - Date, then 10% of the time since Last-Modified,
+ * then FRESH_DEFAULT_TTL.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "fresh.h"
+
+/* return the time of an HTTP-date, -1 if it cannot be parsed */
+static time_t parse_date(char *s){
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/* copy a header value without the trailing CRLF */
+static void copy_value(char *dst, char *value){
+    size_t n = strcspn(value, "\r\n");
+
+    if (n >= FRESH_TAG_LEN) {
+        /* too long to send back, treat as absent */
+        n = 0;
+    }
+    memcpy(dst, value, n);
+    dst[n] = '\0';
+}
+
+/*
+ * parse the field names of a Vary header, the cache only keeps
+ * variants by Accept-Encoding
+ */
+static void scan_vary(fresh_hdr *h, char *value){
+    char *tok, *save;
+
+    for (tok = strtok_r(value, ", \t\r\n", &save); tok != NULL;
+        tok = strtok_r(NULL, ", \t\r\n", &save)) {
+        if (strcasecmp(tok, "Accept-Encoding")) {
+            h->vary_other = 1;
+        }
+    }
+}
+
+/* parse the directives of a Cache-Control header */
+static void scan_cache_control(fresh_hdr *h, char *value){
+    char *p = value;
+
+    while (*p != '\0' && *p != '\r' && *p != '\n') {
+        p += strspn(p, " \t,");
+
+        if (!strncasecmp(p, "no-store", 8) || !strncasecmp(p, "private", 7)) {
+            h->no_store = 1;
+        }
+        else if (!strncasecmp(p, "no-cache", 8) ||
+            !strncasecmp(p, "must-revalidate", 15) ||
+            !strncasecmp(p, "proxy-revalidate", 16)) {
+            h->no_cache = 1;
+        }
+        else if (!strncasecmp(p, "s-maxage=", 9)) {
+            h->max_age = atol(p + 9);
+            h->is_shared_max_age = 1;
+        }
+        else if (!strncasecmp(p, "max-age=", 8)) {
+            if (!h->is_shared_max_age) {
+                h->max_age = atol(p + 8);
+            }
+        }
+        else if (!strncasecmp(p, "stale-while-revalidate=", 23)) {
+            h->swr = atol(p + 23);
+        }
+
+        p += strcspn(p, ",\r\n");
+    }
+}
+
+/* clear the fields of h */
+void fresh_init(fresh_hdr *h){
+    memset(h, 0, sizeof(fresh_hdr));
+    h->date = -1;
+    h->expires = -1;
+    h->modified = -1;
+    h->max_age = -1;
+}
+
+/*
+ * collect the caching headers of a response header
+ * hdr may end with the empty line or not
+ */
+void fresh_scan(fresh_hdr *h, char *hdr, size_t hdr_size){
+    char *p = hdr, *end = hdr + hdr_size, *eol;
+    char line[MAXLINE];
+    size_t n;
+
+    while (p < end) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL) {
+            eol = end;
+        }
+        n = eol - p;
+        if (n >= MAXLINE) {
+            n = MAXLINE - 1;
+        }
+        memcpy(line, p, n);
+        line[n] = '\0';
+        p = eol + 1;
+
+        if (!strcmp(line, "\r") || n == 0) {
+            break;
+        }
+
+        if (!strncasecmp(line, "Cache-Control:", 14)) {
+            scan_cache_control(h, line + 14);
+        }
+        else if (!strncasecmp(line, "Pragma:", 7)) {
+            if (strcasestr(line, "no-cache") != NULL) {
+                h->no_cache = 1;
+            }
+        }
+        else if (!strncasecmp(line, "Expires:", 8)) {
+            /* an invalid date means already expired */
+            if ((h->expires = parse_date(line + 8 + strspn(line + 8, " "))) < 0) {
+                h->expires = 0;
+            }
+        }
+        else if (!strncasecmp(line, "Date:", 5)) {
+            h->date = parse_date(line + 5 + strspn(line + 5, " "));
+        }
+        else if (!strncasecmp(line, "Age:", 4)) {
+            h->age = atol(line + 4);
+        }
+        else if (!strncasecmp(line, "Last-Modified:", 14)) {
+            copy_value(h->last_modified, line + 14 + strspn(line + 14, " "));
+            h->modified = parse_date(h->last_modified);
+        }
+        else if (!strncasecmp(line, "ETag:", 5)) {
+            copy_value(h->etag, line + 5 + strspn(line + 5, " "));
+        }
+        else if (!strncasecmp(line, "Vary:", 5)) {
+            scan_vary(h, line + 5);
+        }
+    }
+}
+
+/*
+ * compute until when a response received at response_time is fresh,
+ * and until when it may be served stale while it is revalidated
+ * response_time is 0 if unknown, the Date of the response is used then
+ */
+void fresh_lifetime(fresh_hdr *h, time_t response_time,
+    time_t *fresh_until, time_t *stale_until){
+
+    time_t date, age, lifetime;
+
+    if (response_time == 0) {
+        response_time = (h->date >= 0) ? h->date : time(NULL);
+    }
+    date = (h->date >= 0) ? h->date : response_time;
+
+    /* age of the response when it was received */
+    age = response_time - date;
+    if (age < 0) {
+        age = 0;
+    }
+    age += h->age;
+
+    if (h->max_age >= 0) {
+        lifetime = h->max_age;
+    }
+    else if (h->expires >= 0) {
+        lifetime = h->expires - date;
+    }
+    else if (h->modified >= 0 && h->modified <= date) {
+        lifetime = (date - h->modified) / 10;
+        if (lifetime > FRESH_HEURISTIC_MAX) {
+            lifetime = FRESH_HEURISTIC_MAX;
+        }
+    }
+    else {
+        lifetime = FRESH_DEFAULT_TTL;
+    }
+
+    if (h->no_cache) {
+        lifetime = 0;
+    }
+
+    *fresh_until = response_time - age + lifetime;
+    *stale_until = h->no_cache ? *fresh_until : *fresh_until + h->swr;
+}
@@ -0,0 +1,38 @@
+/*
+ * fresh.h
+ *
+ * HTTP caching headers of a response: how long it may be served from
+ * cache (Cache-Control, Expires, Date, Age, Last-Modified) and how to
+ * revalidate it once it is stale (ETag, Last-Modified).
+ */
+
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include <time.h>
+
+#define FRESH_TAG_LEN 128           //max length of a validator
+#define FRESH_DEFAULT_TTL 60        //seconds fresh without any information
+#define FRESH_HEURISTIC_MAX 86400   //cap of Last-Modified heuristic
+
+typedef struct fresh_hdr {
+    time_t date;                    //Date, -1 if none
+    time_t expires;                 //Expires, -1 if none, 0 if invalid
+    time_t modified;                //Last-Modified, -1 if none
+    long age;                       //Age
+    long max_age;                   //s-maxage or max-age, -1 if none
+    long swr;                       //stale-while-revalidate
+    int is_shared_max_age;          //max_age comes from s-maxage
+    int no_store;                   //no-store or private
+    int no_cache;                   //no-cache or must-revalidate
+    int vary_other;                 //Vary on more than Accept-Encoding
+    char etag[FRESH_TAG_LEN];
+    char last_modified[FRESH_TAG_LEN];
+} fresh_hdr;
+
+void fresh_init(fresh_hdr *h);
+void fresh_scan(fresh_hdr *h, char *hdr, size_t hdr_size);
+void fresh_lifetime(fresh_hdr *h, time_t response_time,
+    time_t *fresh_until, time_t *stale_until);
+
+#endif
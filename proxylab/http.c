@@ -0,0 +1,387 @@
+/*
+ * http.c
+ *
+ * The header of a request is found by looking for the empty line in the
+ * bytes read so far, then parsed in one pass over its lines. Bytes read
+ * past it (a pipelined request) stay in the buffer and are moved to the
+ * front only when the next header has to be read further.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <poll.h>
+#include "http.h"
+
+#define HTTP_DEFAULT_PORT 80
+
+static char root_path[] = "/";
+
+/* return 1 if the line contains token, ignoring case */
+static int line_has(char *p, size_t len, char *token){
+    size_t n = strlen(token);
+
+    for (size_t i = 0; i + n <= len; i++) {
+        if (!strncasecmp(p + i, token, n)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * split an absolute uri http://<host>:<port><path>
+ * the host is empty if the uri is not absolute
+ */
+static void parse_uri(http_request *req){
+    char *host, *p;
+    size_t n;
+
+    req->host[0] = '\0';
+    req->port = HTTP_DEFAULT_PORT;
+
+    if (strncasecmp(req->uri, "http://", 7)) {
+        req->path.p = req->uri;
+        req->path.len = strlen(req->uri);
+        return;
+    }
+
+    host = req->uri + 7;
+    n = strcspn(host, ":/");
+    if (n < HTTP_MAX_HOST) {
+        memcpy(req->host, host, n);
+        req->host[n] = '\0';
+    }
+
+    p = host + n;
+    if (*p == ':') {
+        req->port = atoi(p + 1);
+        p += 1 + strspn(p + 1, "0123456789");
+    }
+
+    if (*p == '\0') {
+        req->path.p = root_path;
+        req->path.len = 1;
+    }
+    else {
+        req->path.p = p;
+        req->path.len = strlen(p);
+    }
+}
+
+/*
+ * parse the value of a Range line: bytes=first-last, bytes=first- or
+ * bytes=-suffix
+ * a list of ranges is not taken, the whole object is sent instead
+ */
+static void parse_range(http_request *req, char *p, char *end){
+    char *q;
+
+    req->range_first = req->range_last = -1;
+
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (end - p < 6 || strncasecmp(p, "bytes=", 6) || memchr(p, ',', end - p)) {
+        return;
+    }
+    p += 6;
+
+    if (*p != '-') {
+        if (!isdigit((unsigned char)*p)) {
+            return;
+        }
+        req->range_first = strtol(p, &q, 10);
+        p = q;
+    }
+    if (*p++ != '-') {
+        return;
+    }
+    if (isdigit((unsigned char)*p)) {
+        req->range_last = strtol(p, &q, 10);
+        p = q;
+    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    if (p != end || (req->range_first < 0 && req->range_last <= 0) ||
+        (req->range_last >= 0 && req->range_first > req->range_last)) {
+        return;
+    }
+    req->has_range = 1;
+}
+
+/*
+ * return 1 if the value of an Accept-Encoding line takes gzip, named
+ * or by *, with a quality above 0
+ */
+static int accepts_gzip(char *p, char *end){
+    int gzip = -1, star = 0;
+
+    while (p < end) {
+        char *comma = memchr(p, ',', end - p), *q;
+        size_t n;
+        int ok;
+
+        comma = (comma != NULL) ? comma : end;
+        p += strspn(p, " \t");
+        n = strcspn(p, " \t;,\r\n");
+        q = memchr(p, ';', comma - p);
+        ok = (q == NULL || (q = memmem(q, comma - q, "q=", 2)) == NULL ||
+            strtod(q + 2, NULL) > 0);
+
+        if ((n == 4 && !strncasecmp(p, "gzip", 4)) ||
+            (n == 6 && !strncasecmp(p, "x-gzip", 6))) {
+            gzip = ok;
+        }
+        else if (n == 1 && *p == '*') {
+            star = ok;
+        }
+        p = comma + 1;
+    }
+    return (gzip >= 0) ? gzip : star;
+}
+
+/* parse the header in [p, end), which ends with the empty line */
+static int parse(char *p, char *end, http_request *req){
+    char *eol, *s;
+    size_t len;
+
+    /* request line: <method> <uri> <version> */
+    eol = memchr(p, '\n', end - p);
+    if (eol == p || eol[-1] != '\r') {
+        return HTTP_BAD;
+    }
+    eol[-1] = '\0';
+
+    req->method = p;
+    if ((s = strchr(p, ' ')) == NULL) {
+        return HTTP_BAD;
+    }
+    *s++ = '\0';
+
+    req->uri = s;
+    if ((s = strchr(s, ' ')) == NULL) {
+        return HTTP_BAD;
+    }
+    *s++ = '\0';
+    req->version = s;
+
+    if (*req->method == '\0' || *req->uri == '\0' ||
+        strncmp(req->version, "HTTP/", 5)) {
+        return HTTP_BAD;
+    }
+
+    /* a fragment is not part of the resource, and would name a cache
+     * variant, see encode.h */
+    if ((s = strchr(req->uri, '#')) != NULL) {
+        *s = '\0';
+    }
+
+    /* HTTP/1.1 connections are persistent unless the client says close,
+     * HTTP/1.0 ones only if the client asks for keep-alive */
+    req->http11 = strcmp(req->version, "HTTP/1.0") != 0;
+    req->keep_alive = req->http11;
+    parse_uri(req);
+
+    /* header lines */
+    req->host_hdr.len = 0;
+    req->range_hdr.len = 0;
+    req->if_range_hdr.len = 0;
+    req->has_range = 0;
+    req->accept_gzip = 0;
+    req->nhdrs = 0;
+
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        len = eol + 1 - p;
+
+        if (len == 2 && *p == '\r') {
+            break;
+        }
+
+        if (!strncasecmp(p, "Host:", 5)) {
+            req->host_hdr.p = p;
+            req->host_hdr.len = len;
+        }
+        else if (!strncasecmp(p, "Range:", 6)) {
+            req->range_hdr.p = p;
+            req->range_hdr.len = len;
+            parse_range(req, p + 6, p + len);
+        }
+        else if (!strncasecmp(p, "If-Range:", 9)) {
+            req->if_range_hdr.p = p;
+            req->if_range_hdr.len = len;
+        }
+        else if (!strncasecmp(p, "Connection:", 11) ||
+            !strncasecmp(p, "Proxy-Connection:", 17)) {
+            if (line_has(p, len, "close")) {
+                req->keep_alive = 0;
+            }
+            else if (line_has(p, len, "keep-alive")) {
+                req->keep_alive = 1;
+            }
+        }
+        else {
+            if (!strncasecmp(p, "Accept-Encoding:", 16)) {
+                req->accept_gzip = accepts_gzip(p + 16, p + len);
+            }
+            if (req->nhdrs == HTTP_MAX_HDRS) {
+                return HTTP_BAD;
+            }
+            req->hdrs[req->nhdrs].p = p;
+            req->hdrs[req->nhdrs].len = len;
+            req->nhdrs++;
+        }
+    }
+
+    return HTTP_OK;
+}
+
+/* init a client connection with nothing read */
+void http_conn_init(http_conn *c, int fd){
+    c->fd = fd;
+    c->start = 0;
+    c->end = 0;
+    c->buf = NULL;
+}
+
+/*
+ * wait up to timeout ms (-1 for ever) for the client to send, then
+ * take a buffer for the request
+ * an idle connection holds no buffer while it waits
+ * return 1 if the client sent, 0 on timeout, -1 on error
+ */
+int http_conn_wait(http_conn *c, int timeout){
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int n;
+
+    if (c->buf != NULL) {
+        /* part of the request is read already */
+        return 1;
+    }
+
+    while ((n = poll(&pfd, 1, timeout)) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    c->buf = bufpool_get();
+    return 1;
+}
+
+/*
+ * give the buffer back to the pool after a request is served
+ * return 1 if it is kept for the part of the next request read already
+ */
+int http_conn_idle(http_conn *c){
+    if (c->buf != NULL && c->start == c->end) {
+        bufpool_put(c->buf);
+        c->buf = NULL;
+        c->start = c->end = 0;
+    }
+    return c->buf != NULL;
+}
+
+/*
+ * return 1 if the header of a pipelined request is buffered whole,
+ * http_read_request() then parses it without reading or moving the
+ * buffer, so the requests read before stay valid
+ */
+int http_conn_buffered(http_conn *c){
+    return c->buf != NULL &&
+        memmem(c->buf + c->start, c->end - c->start, "\r\n\r\n", 4) != NULL;
+}
+
+/* give the buffer back to the pool when the connection is closed */
+void http_conn_close(http_conn *c){
+    if (c->buf != NULL) {
+        bufpool_put(c->buf);
+        c->buf = NULL;
+    }
+}
+
+/*
+ * read and parse the next request of a connection
+ * the request is valid until this is called again, or while pipelined
+ * requests are buffered whole, until it has to read
+ */
+int http_read_request(http_conn *c, http_request *req){
+    size_t scanned = c->start;
+    char *hdr_end, *start;
+    ssize_t n;
+
+    if (c->buf == NULL) {
+        c->buf = bufpool_get();
+    }
+
+    while ((hdr_end = memmem(c->buf + scanned, c->end - scanned,
+        "\r\n\r\n", 4)) == NULL) {
+        /* the empty line may start in the last 3 bytes */
+        if (c->end - scanned > 3) {
+            scanned = c->end - 3;
+        }
+
+        if (c->start > 0) {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            scanned -= c->start;
+            c->end -= c->start;
+            c->start = 0;
+        }
+
+        if (c->end == HTTP_BUFSIZE) {
+            return HTTP_TOO_LARGE;
+        }
+
+        if ((n = read(c->fd, c->buf + c->end, HTTP_BUFSIZE - c->end)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return HTTP_EOF;
+        }
+        if (n == 0) {
+            return HTTP_EOF;
+        }
+        c->end += n;
+    }
+
+    start = c->buf + c->start;
+    c->start = hdr_end + 4 - c->buf;
+
+    return parse(start, hdr_end + 4, req);
+}
+
+/* write all of iov, return -1 on error */
+int http_writev(int fd, struct iovec *iov, int iovcnt){
+    struct iovec v[HTTP_MAX_IOV], *p = v;
+    ssize_t n;
+
+    if (iovcnt > HTTP_MAX_IOV) {
+        return -1;
+    }
+    memcpy(v, iov, iovcnt * sizeof(struct iovec));
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, p, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* skip what has been written */
+        while (iovcnt > 0 && (size_t)n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            p->iov_base = (char *)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * http.h
+ *
+ * Reading and parsing of client requests. A request header is read
+ * whole into the buffer of the connection and tokenized in place: the
+ * request keeps views into that buffer instead of copies, so that the
+ * request to the server can be sent with one writev() of pieces of it.
+ *
+ * The buffer comes from the buffer pool when the client starts sending
+ * a request, and goes back to it once the request is served, unless the
+ * client has already sent part of the next one.
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+#include "bufpool.h"
+
+#define HTTP_BUFSIZE BUF_CHUNK  //max size of a request header
+#define HTTP_MAX_HDRS 64        //max header lines of a request
+#define HTTP_MAX_HOST 256       //max length of a host name
+#define HTTP_MAX_IOV (HTTP_MAX_HDRS + 24)
+
+/* return values of http_read_request() */
+#define HTTP_OK 1
+#define HTTP_EOF 0              //client closed the connection
+#define HTTP_BAD -1             //malformed request
+#define HTTP_TOO_LARGE -2       //header larger than HTTP_BUFSIZE
+
+/* a piece of the connection buffer, not NUL-terminated */
+typedef struct strview {
+    char *p;
+    size_t len;
+} strview;
+
+/* a client connection, keeps the bytes read past the current request */
+typedef struct http_conn {
+    int fd;
+    size_t start;               //first byte not parsed yet
+    size_t end;                 //end of bytes read
+    char *buf;                  //NULL if there is nothing buffered
+} http_conn;
+
+/*
+ * a parsed request, valid until the next request is read from the
+ * network, see http_conn_buffered()
+ * method, uri and version are NUL-terminated in place
+ */
+typedef struct http_request {
+    char *method;
+    char *uri;
+    char *version;
+    char host[HTTP_MAX_HOST];   //host of uri, empty if uri is not absolute
+    int port;
+    strview path;               //path of uri, "/" if it has none
+    strview host_hdr;           //Host line with CRLF, len 0 if none
+    strview range_hdr;          //Range line with CRLF, len 0 if none
+    strview if_range_hdr;       //If-Range line with CRLF, len 0 if none
+    strview hdrs[HTTP_MAX_HDRS];//other header lines with CRLF
+    int nhdrs;
+    int http11;                 //HTTP/1.1 or later
+    int keep_alive;             //client wants a persistent connection
+    int accept_gzip;            //Accept-Encoding takes gzip
+    int has_range;              //Range is a single byte range
+    long range_first;           //-1 for the last range_last bytes
+    long range_last;            //-1 up to the end of object
+} http_request;
+
+void http_conn_init(http_conn *c, int fd);
+int http_conn_wait(http_conn *c, int timeout);
+int http_read_request(http_conn *c, http_request *req);
+int http_conn_idle(http_conn *c);
+int http_conn_buffered(http_conn *c);
+void http_conn_close(http_conn *c);
+int http_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * limit.c
+ *
+ * The queue of connections is a ring of accepted fds. The fetch limit
+ * is a double so that it can grow by 1/limit per fetch; fetches are
+ * admitted while fewer than its integer part are in progress.
+ */
+
+#include "csapp.h"
+#include "limit.h"
+
+/* an accepted connection waiting for a thread */
+typedef struct waiting {
+    int fd;
+    uint64_t accepted;
+} waiting;
+
+static struct {
+    int n;                          //connections with a thread
+    int max;
+    waiting *queue;                 //ring of max_queue entries
+    int head;
+    int len;
+    int max_queue;
+    pthread_mutex_t lock;
+} conns = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+    double limit;
+    int n;                          //fetches in progress
+    double avg;                     //ms, 0 before the first sample
+    uint64_t last_cut;              //ns
+    pthread_mutex_t lock;
+} fetches = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* monotonic time in nanoseconds */
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void limit_init(int max_conns, int max_queue){
+    conns.max = max_conns;
+    conns.max_queue = max_queue;
+    conns.queue = Malloc((max_queue > 0 ? max_queue : 1) * sizeof(waiting));
+    fetches.limit = LIMIT_FETCH_INIT;
+}
+
+/*
+ * admit an accepted connection
+ * return LIMIT_RUN if the caller has to start a thread for it,
+ * LIMIT_QUEUED if it is left to a running thread, LIMIT_REJECT if not
+ * admitted
+ */
+int limit_conn_admit(int fd, uint64_t accepted){
+    int rc = LIMIT_REJECT;
+
+    pthread_mutex_lock(&conns.lock);
+    if (conns.n < conns.max) {
+        conns.n++;
+        rc = LIMIT_RUN;
+    }
+    else if (conns.len < conns.max_queue) {
+        waiting *w = &conns.queue[(conns.head + conns.len) % conns.max_queue];
+
+        w->fd = fd;
+        w->accepted = accepted;
+        conns.len++;
+        rc = LIMIT_QUEUED;
+    }
+    pthread_mutex_unlock(&conns.lock);
+    return rc;
+}
+
+/*
+ * called by a thread whose connection has ended
+ * return 1 with the next connection to handle, or 0 if there is none
+ * and the thread has to exit
+ */
+int limit_conn_next(int *fd, uint64_t *accepted){
+    int rc = 0;
+
+    pthread_mutex_lock(&conns.lock);
+    if (conns.len > 0) {
+        waiting *w = &conns.queue[conns.head];
+
+        *fd = w->fd;
+        *accepted = w->accepted;
+        conns.head = (conns.head + 1) % conns.max_queue;
+        conns.len--;
+        rc = 1;
+    }
+    else {
+        conns.n--;
+    }
+    pthread_mutex_unlock(&conns.lock);
+    return rc;
+}
+
+/* the thread of an admitted connection could not be started */
+void limit_conn_cancel(void){
+    pthread_mutex_lock(&conns.lock);
+    conns.n--;
+    pthread_mutex_unlock(&conns.lock);
+}
+
+/* return 1 if connections are waiting for a thread, without locking */
+int limit_conn_waiting(void){
+    return __atomic_load_n(&conns.len, __ATOMIC_RELAXED) > 0;
+}
+
+/* return 1 if a fetch may start, it must be ended by limit_fetch_release() */
+int limit_fetch_acquire(void){
+    int ok;
+
+    pthread_mutex_lock(&fetches.lock);
+    if ((ok = fetches.n < (int)fetches.limit)) {
+        fetches.n++;
+    }
+    pthread_mutex_unlock(&fetches.lock);
+    return ok;
+}
+
+/*
+ * end a fetch, ok if the server answered, after response_ns from
+ * sending the request to reading the status line
+ */
+void limit_fetch_release(int ok, uint64_t response_ns){
+    double ms = response_ns / 1e6;
+    uint64_t now = now_ns();
+    int slow = 0;
+
+    pthread_mutex_lock(&fetches.lock);
+    fetches.n--;
+
+    if (ok) {
+        if (fetches.avg == 0) {
+            fetches.avg = ms;
+        }
+        slow = ms > LIMIT_TOLERANCE * fetches.avg;
+        fetches.avg += LIMIT_SMOOTHING * (ms - fetches.avg);
+    }
+
+    if (!ok || slow) {
+        /* once per gap, all the fetches of a burst see the same queue */
+        if (now - fetches.last_cut > LIMIT_BACKOFF_GAP * 1000000ULL) {
+            fetches.limit *= LIMIT_BACKOFF;
+            if (fetches.limit < LIMIT_FETCH_MIN) {
+                fetches.limit = LIMIT_FETCH_MIN;
+            }
+            fetches.last_cut = now;
+        }
+    }
+    else if (fetches.n + 1 >= fetches.limit / 2) {
+        /* grow only while the limit is used, not when load is light */
+        fetches.limit += 1 / fetches.limit;
+        if (fetches.limit > LIMIT_FETCH_MAX) {
+            fetches.limit = LIMIT_FETCH_MAX;
+        }
+    }
+    pthread_mutex_unlock(&fetches.lock);
+}
+
+/* get a snapshot of the limits */
+void limit_stats(limit_stat *st){
+    pthread_mutex_lock(&conns.lock);
+    st->conns = conns.n;
+    st->max_conns = conns.max;
+    st->queued = conns.len;
+    st->max_queue = conns.max_queue;
+    pthread_mutex_unlock(&conns.lock);
+
+    pthread_mutex_lock(&fetches.lock);
+    st->fetches = fetches.n;
+    st->fetch_limit = fetches.limit;
+    st->avg_response = fetches.avg;
+    pthread_mutex_unlock(&fetches.lock);
+}
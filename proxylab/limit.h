@@ -0,0 +1,59 @@
+/*
+ * limit.h
+ *
+ * Overload control of the proxy. Client connections are admitted up to
+ * a budget, then wait in a bounded queue for a running connection to
+ * end, and are refused beyond it. A thread whose connection ends takes
+ * the next one from the queue instead of exiting, and idle persistent
+ * connections are closed while others wait.
+ *
+ * Fetches from servers are held to a concurrency limit that adapts to
+ * how fast servers answer (AIMD): it grows by one for each limit's
+ * worth of fast fetches, and is cut by a tenth when a fetch fails or
+ * its response time is well above the long-term average, the gradient
+ * being the sign of queueing in front of the servers.
+ */
+
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+
+#include <stdint.h>
+
+#define LIMIT_CONNS 1024            //default connection budget
+#define LIMIT_QUEUE 1024            //default queue of waiting connections
+#define LIMIT_QUEUE_WAIT 1000       //ms a connection may wait in queue
+#define LIMIT_IDLE_CHECK 250        //ms between checks of the queue by idle ones
+
+#define LIMIT_FETCH_INIT 32         //initial concurrency limit of fetches
+#define LIMIT_FETCH_MIN 4
+#define LIMIT_FETCH_MAX 1024
+#define LIMIT_TOLERANCE 2.0         //response time over average that backs off
+#define LIMIT_BACKOFF 0.9           //cut of limit
+#define LIMIT_BACKOFF_GAP 100       //min ms between two cuts
+#define LIMIT_SMOOTHING 0.02        //weight of a sample in average
+
+/* return values of limit_conn_admit() */
+#define LIMIT_RUN 0                 //start a thread for the connection
+#define LIMIT_QUEUED 1              //a running thread will take it
+#define LIMIT_REJECT 2              //over budget and queue is full
+
+typedef struct limit_stat {
+    int conns;                      //connections with a thread
+    int max_conns;
+    int queued;
+    int max_queue;
+    int fetches;                    //fetches in progress
+    double fetch_limit;
+    double avg_response;            //ms
+} limit_stat;
+
+void limit_init(int max_conns, int max_queue);
+int limit_conn_admit(int fd, uint64_t accepted);
+int limit_conn_next(int *fd, uint64_t *accepted);
+void limit_conn_cancel(void);
+int limit_conn_waiting(void);
+int limit_fetch_acquire(void);
+void limit_fetch_release(int ok, uint64_t response_ns);
+void limit_stats(limit_stat *st);
+
+#endif
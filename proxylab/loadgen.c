@@ -0,0 +1,524 @@
+/*
+ * loadgen.c
+ *
+ * Load generator for the proxy. Threads send requests through the proxy
+ * on keep-alive connections, for objects of the origin (see origin.c)
+ * drawn with Zipf popularity, or for the uris of a request log written
+ * by "proxy -l" replayed in order. It reports requests per second,
+ * latency quantiles, and the hit ratio counted by the proxy, read from
+ * its /__stats before and after the run.
+ *
+ * Closed loop (default): a thread sends its next request as soon as it
+ * has read the previous response. Open loop (-r): requests are due at a
+ * total rate with exponential gaps, and latency is counted from the time
+ * a request was due, so that a proxy falling behind is not hidden by the
+ * client waiting for it.
+ *
+ * build: gcc -O2 -o loadgen loadgen.c csapp.c -lpthread -lm
+ * usage: loadgen [-t threads] [-n requests | -d seconds] [-r rate]
+ *                [-z zipf_s] [-u objects] [-f log_file] [-w warmup]
+ *                <proxy_host:port> <origin_host:port>
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include "csapp.h"
+
+/* a request line and Host header, of a uri and origin up to MAXLINE */
+#define REQ_LEN (2 * MAXLINE + 64)
+
+/* the run */
+static char proxy_host[MAXLINE], origin[MAXLINE];
+static int proxy_port;
+static int nthreads = 8;
+static long nrequests = 100000;     //once through the log if -f
+static double duration;             //seconds, 0 to run nrequests
+static double rate;                 //requests/s of open loop, 0 if closed
+static double zipf_s = 0.9;
+static long nobjects = 100000;
+static long warmup;                 //requests before measuring
+
+/* zipf cdf of object ranks, or uris of the log */
+static double *cdf;
+static char **uris;
+static long nuris;
+
+static long issued;                 //requests taken by threads
+static double end_time;
+
+/* results of a thread */
+typedef struct worker {
+    pthread_t tid;
+    uint64_t rand;
+    double *lat;                    //latencies in seconds
+    long nlat, cap;
+    long errors;
+    unsigned long bytes;
+} worker;
+
+/* print usage and exit */
+static void usage(char *name){
+    fprintf(stderr, "usage: %s [-t threads] [-n requests | -d seconds] "
+        "[-r rate] [-z zipf_s] [-u objects] [-f log_file] [-w warmup] "
+        "<proxy_host:port> <origin_host:port>\n", name);
+    exit(1);
+}
+
+/* return the time in seconds */
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+static double uniform(uint64_t *s){
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return ((*s * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/* cdf of the Zipf distribution over nobjects ranks */
+static void zipf_init(void){
+    double sum = 0;
+
+    cdf = Malloc(nobjects * sizeof(double));
+    for (long i = 0; i < nobjects; i++) {
+        sum += 1 / pow(i + 1, zipf_s);
+        cdf[i] = sum;
+    }
+    for (long i = 0; i < nobjects; i++) {
+        cdf[i] /= sum;
+    }
+}
+
+/* draw an object, rank 1 is the most popular */
+static long zipf_draw(uint64_t *s){
+    double u = uniform(s);
+    long lo = 0, hi = nobjects - 1;
+
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo + 1;
+}
+
+/* read the uris of a request log */
+static void load_log(char *name){
+    char line[MAXLINE], uri[MAXLINE];
+    long cap = 1024;
+    FILE *fp;
+
+    if ((fp = fopen(name, "r")) == NULL) {
+        unix_error("cannot open request log");
+    }
+
+    uris = Malloc(cap * sizeof(char *));
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (sscanf(line, "%s", uri) != 1) {
+            continue;
+        }
+        if (nuris == cap) {
+            cap *= 2;
+            if ((uris = realloc(uris, cap * sizeof(char *))) == NULL) {
+                unix_error("realloc error");
+            }
+        }
+        uris[nuris++] = strdup(uri);
+    }
+    fclose(fp);
+
+    if (nuris == 0) {
+        app_error("request log is empty");
+    }
+}
+
+/* split host:port */
+static void parse_addr(char *name, char *arg, char *host, int *port){
+    char *colon = strrchr(arg, ':');
+
+    if (colon == NULL) {
+        usage(name);
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+    *port = atoi(colon + 1);
+}
+
+/*
+ * read a response, framed by Content-Length, chunked or close
+ * return the bytes of body, -1 on error, and set *alive if the
+ * connection can take another request
+ */
+static long read_response(rio_t *rio, int *alive){
+    char buf[MAXLINE];
+    long content_length = -1, body = 0, n;
+    int chunked = 0, minor;
+
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0 ||
+        sscanf(buf, "HTTP/1.%d", &minor) != 1) {
+        return -1;
+    }
+    *alive = (minor >= 1);
+
+    while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
+        if (!strncasecmp(buf, "Content-Length:", 15)) {
+            content_length = atol(buf + 15);
+        }
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+            chunked = strcasestr(buf, "chunked") != NULL;
+        }
+        else if (!strncasecmp(buf, "Connection:", 11)) {
+            *alive = strcasestr(buf, "close") == NULL;
+        }
+    }
+    if (n <= 0) {
+        return -1;
+    }
+
+    if (chunked) {
+        long size;
+
+        do {
+            if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+                return -1;
+            }
+            size = strtol(buf, NULL, 16);
+            for (long left = size; left > 0; left -= n) {
+                n = rio_readnb(rio, buf, left < MAXLINE ? left : MAXLINE);
+                if (n <= 0) {
+                    return -1;
+                }
+            }
+            body += size;
+            /* CRLF after chunk, or the empty line after the last one */
+            if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+                return -1;
+            }
+        } while (size > 0);
+    }
+    else if (content_length >= 0) {
+        for (long left = content_length; left > 0; left -= n) {
+            n = rio_readnb(rio, buf, left < MAXLINE ? left : MAXLINE);
+            if (n <= 0) {
+                return -1;
+            }
+        }
+        body = content_length;
+    }
+    else {
+        while ((n = rio_readnb(rio, buf, MAXLINE)) > 0) {
+            body += n;
+        }
+        *alive = 0;
+    }
+    return body;
+}
+
+/* take the next request, return its number or -1 at the end of the run */
+static long next_request(void){
+    long i = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+
+    if (duration > 0) {
+        return (now() < end_time) ? i : -1;
+    }
+    return (i < nrequests) ? i : -1;
+}
+
+/* write the request for the i-th request */
+static void make_request(worker *w, long i, char *req){
+    if (uris != NULL) {
+        snprintf(req, REQ_LEN, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+            uris[i % nuris], origin);
+    }
+    else {
+        snprintf(req, REQ_LEN,
+            "GET http://%s/obj/%ld HTTP/1.1\r\nHost: %s\r\n\r\n",
+            origin, zipf_draw(&w->rand), origin);
+    }
+}
+
+/* keep a latency */
+static void record(worker *w, double lat){
+    if (w->nlat == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        if ((w->lat = realloc(w->lat, w->cap * sizeof(double))) == NULL) {
+            unix_error("realloc error");
+        }
+    }
+    w->lat[w->nlat++] = lat;
+}
+
+/* send requests until the run ends */
+static void *work(void *arg){
+    worker *w = arg;
+    char req[REQ_LEN];
+    double due = now(), start;
+    int fd = -1, alive = 0;
+    long i, body;
+    rio_t rio;
+
+    while ((i = next_request()) >= 0) {
+        make_request(w, i, req);
+
+        if (rate > 0) {
+            /* exponential gaps for this thread's share of the rate */
+            due += -log(1 - uniform(&w->rand)) / (rate / nthreads);
+            while ((start = now()) < due) {
+                usleep((due - start) * 1e6);
+            }
+            start = due;
+        }
+        else {
+            start = now();
+        }
+
+        if (fd < 0) {
+            if ((fd = open_clientfd_r(proxy_host, proxy_port)) < 0) {
+                w->errors++;
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+        }
+
+        if (rio_writen(fd, req, strlen(req)) < 0 ||
+            (body = read_response(&rio, &alive)) < 0) {
+            w->errors++;
+            Close(fd);
+            fd = -1;
+            continue;
+        }
+
+        w->bytes += body;
+        record(w, now() - start);
+
+        if (!alive) {
+            Close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        Close(fd);
+    }
+    return NULL;
+}
+
+/* run the threads until nrequests are done or duration has passed */
+static double run(worker *ws){
+    double t0 = now();
+
+    issued = 0;
+    end_time = t0 + duration;
+    for (int i = 0; i < nthreads; i++) {
+        Pthread_create(&ws[i].tid, NULL, work, &ws[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(ws[i].tid, NULL);
+    }
+    return now() - t0;
+}
+
+/*
+ * read a counter from /__stats of proxy, summing all its label sets
+ * return -1 if there is none
+ */
+static double proxy_counter(char *text, char *name){
+    size_t len = strlen(name);
+    double sum = -1;
+
+    for (char *p = text; p != NULL && *p != '\0'; p = strchr(p, '\n')) {
+        if (*p == '\n') {
+            p++;
+        }
+        if (!strncmp(p, name, len) && (p[len] == ' ' || p[len] == '{')) {
+            char *v = strchr(p, ' ');
+
+            sum = (sum < 0 ? 0 : sum) + atof(v + 1);
+        }
+    }
+    return sum;
+}
+
+/* get /__stats of proxy, NULL if it has none */
+static char *proxy_stats(void){
+    char *req = "GET /__stats HTTP/1.0\r\n\r\n";
+    char *text = NULL;
+    size_t size = 0;
+    ssize_t n;
+    int fd;
+    FILE *fp;
+    char buf[MAXLINE];
+
+    if ((fd = open_clientfd_r(proxy_host, proxy_port)) < 0) {
+        return NULL;
+    }
+    fp = open_memstream(&text, &size);
+    if (rio_writen(fd, req, strlen(req)) == (ssize_t)strlen(req)) {
+        while ((n = read(fd, buf, MAXLINE)) > 0) {
+            fwrite(buf, 1, n, fp);
+        }
+    }
+    fclose(fp);
+    Close(fd);
+
+    if (strncmp(text, "HTTP/1.1 200", 12)) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static int compare(const void *a, const void *b){
+    double x = *(double *)a, y = *(double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* latency at quantile q of sorted latencies, in ms */
+static double quantile(double *lat, long n, double q){
+    long i = (long)(q * n);
+
+    return lat[i < n ? i : n - 1] * 1000;
+}
+
+int main(int argc, char *argv[]){
+    char *log_file = NULL, *before, *after;
+    long total = 0, errors = 0;
+    unsigned long bytes = 0;
+    double elapsed, *lat;
+    worker *ws;
+    int opt, n_set = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:d:r:z:u:f:w:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atol(optarg);
+            n_set = 1;
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 'u':
+            nobjects = atol(optarg);
+            break;
+        case 'f':
+            log_file = optarg;
+            break;
+        case 'w':
+            warmup = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 2 || nthreads <= 0 || nobjects <= 0) {
+        usage(argv[0]);
+    }
+    parse_addr(argv[0], argv[optind], proxy_host, &proxy_port);
+    strcpy(origin, argv[optind + 1]);
+
+    Signal(SIGPIPE, SIG_IGN);
+    if (log_file != NULL) {
+        load_log(log_file);
+        if (!n_set) {
+            nrequests = nuris;
+        }
+    }
+    else {
+        zipf_init();
+    }
+
+    ws = Calloc(nthreads, sizeof(worker));
+    for (int i = 0; i < nthreads; i++) {
+        ws[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+
+    /* warm the cache up, closed loop, not measured */
+    if (warmup > 0) {
+        long n = nrequests;
+        double d = duration, r = rate;
+
+        nrequests = warmup;
+        duration = 0;
+        rate = 0;
+        run(ws);
+        nrequests = n;
+        duration = d;
+        rate = r;
+
+        for (int i = 0; i < nthreads; i++) {
+            ws[i].nlat = 0;
+            ws[i].errors = 0;
+            ws[i].bytes = 0;
+        }
+    }
+
+    before = proxy_stats();
+    elapsed = run(ws);
+    after = proxy_stats();
+
+    for (int i = 0; i < nthreads; i++) {
+        total += ws[i].nlat;
+        errors += ws[i].errors;
+        bytes += ws[i].bytes;
+    }
+
+    lat = Malloc((total + 1) * sizeof(double));
+    total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(lat + total, ws[i].lat, ws[i].nlat * sizeof(double));
+        total += ws[i].nlat;
+    }
+    qsort(lat, total, sizeof(double), compare);
+
+    printf("%s loop, %d threads", rate > 0 ? "open" : "closed", nthreads);
+    if (rate > 0) {
+        printf(", %.0f requests/s offered", rate);
+    }
+    printf("\nrequests %ld in %.2fs, errors %ld\n", total, elapsed, errors);
+    printf("throughput %.0f requests/s, %.1f MB/s\n", total / elapsed,
+        bytes / elapsed / (1 << 20));
+    if (total > 0) {
+        printf("latency ms p50 %.3f p99 %.3f p999 %.3f max %.3f\n",
+            quantile(lat, total, 0.5), quantile(lat, total, 0.99),
+            quantile(lat, total, 0.999), lat[total - 1] * 1000);
+    }
+
+    if (before != NULL && after != NULL) {
+        /* the second /__stats request is counted in after */
+        double reqs = proxy_counter(after, "proxy_requests_total") -
+            proxy_counter(before, "proxy_requests_total") - 1;
+        double hits = proxy_counter(after, "proxy_cache_hits_total") -
+            proxy_counter(before, "proxy_cache_hits_total");
+
+        if (reqs > 0) {
+            printf("hit ratio %.3f (%.0f of %.0f requests)\n", hits / reqs,
+                hits, reqs);
+        }
+    }
+    else {
+        printf("hit ratio unknown, proxy has no /__stats\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * metrics.c
+ *
+ * A shard is only written by the thread owning it. Its fields are
+ * updated with relaxed atomic stores of the new value, not with atomic
+ * adds, so a reader on another thread sees whole values without
+ * taking the cache line away from the writer more than it has to.
+ * Shards are cache line aligned so that threads do not share lines.
+ *
+ * A thread takes a shard the first time it records something, and
+ * gives it back when it exits; only these two take the lock.
+ */
+
+#include "csapp.h"
+#include "metrics.h"
+
+typedef struct metrics_shard {
+    uint64_t counter[METRIC_COUNTERS];
+    int64_t gauge[METRIC_GAUGES];
+    uint64_t hist[METRIC_HISTS][METRIC_BUCKETS];
+    uint64_t hist_sum[METRIC_HISTS];        //microseconds
+    struct metrics_shard *next;             //list of all shards
+    struct metrics_shard *next_free;        //list of shards of no thread
+} __attribute__((aligned(64))) metrics_shard;
+
+static metrics_shard *shards;
+static metrics_shard *free_shards;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+
+/* shard of this thread, and the request it is serving */
+static __thread metrics_shard *my_shard;
+static __thread uint64_t req_start;         //0 if none
+static __thread int req_first_byte;         //first byte recorded
+
+/* names of counters, a label set shares the name of the previous one */
+static const struct {
+    char *name;
+    char *label;
+    char *help;
+} counters[METRIC_COUNTERS] = {
+    { "proxy_requests_total", "", "Requests from clients." },
+    { "proxy_cache_hits_total", "{tier=\"memory\"}", "Requests served from cache." },
+    { "proxy_cache_hits_total", "{tier=\"disk\"}", NULL },
+    { "proxy_cache_stale_hits_total", "", "Requests served stale while revalidating." },
+    { "proxy_cache_misses_total", "", "Requests fetched from server." },
+    { "proxy_coalesced_total", "", "Misses served by the fetch of another request." },
+    { "proxy_revalidations_total", "", "Conditional requests to server." },
+    { "proxy_not_modified_total", "", "Revalidations answered 304." },
+    { "proxy_client_bytes_total", "", "Response bytes sent to clients." },
+    { "proxy_upstream_bytes_total", "", "Response body bytes read from servers." },
+    { "proxy_upstream_connects_total", "", "New connections to servers." },
+    { "proxy_upstream_reused_total", "", "Pooled connections to servers used." },
+    { "proxy_upstream_errors_total", "", "Failed connections to servers." },
+    { "proxy_errors_total", "", "Error responses to clients." },
+    { "proxy_shed_total", "{reason=\"connections\"}", "Requests refused with 503 under overload." },
+    { "proxy_shed_total", "{reason=\"queue_timeout\"}", NULL },
+    { "proxy_shed_total", "{reason=\"fetch_limit\"}", NULL },
+};
+
+static const struct {
+    char *name;
+    char *help;
+} hists[METRIC_HISTS] = {
+    { "proxy_first_byte_seconds", "Time from request start to first response byte." },
+    { "proxy_request_seconds", "Time from request start to response sent." },
+    { "proxy_upstream_connect_seconds", "Time to connect to server." },
+};
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+/* give the shard of an exiting thread to the next one */
+static void shard_release(void *arg){
+    metrics_shard *s = arg;
+
+    pthread_mutex_lock(&lock);
+    s->next_free = free_shards;
+    free_shards = s;
+    pthread_mutex_unlock(&lock);
+}
+
+/* take a shard for this thread */
+static metrics_shard *shard_acquire(void){
+    metrics_shard *s;
+
+    pthread_mutex_lock(&lock);
+    if ((s = free_shards) != NULL) {
+        free_shards = s->next_free;
+    }
+    else {
+        if (posix_memalign((void **)&s, 64, sizeof(metrics_shard)) != 0) {
+            unix_error("metrics_shard alloc error");
+        }
+        memset(s, 0, sizeof(metrics_shard));
+        /* published under lock, the list is only read under it */
+        s->next = shards;
+        shards = s;
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_setspecific(shard_key, s);
+    my_shard = s;
+    return s;
+}
+
+inline static metrics_shard *shard(void){
+    return (my_shard != NULL) ? my_shard : shard_acquire();
+}
+
+/* add to a value only this thread writes */
+inline static void add_u64(uint64_t *p, uint64_t n){
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+/* bucket of a value in microseconds */
+static int bucket(uint64_t us){
+    int msb, idx;
+
+    if (us < METRIC_SUB) {
+        return us;
+    }
+    msb = 63 - __builtin_clzll(us);
+    idx = (msb - METRIC_SUB_BITS + 1) * METRIC_SUB +
+        ((us >> (msb - METRIC_SUB_BITS)) & (METRIC_SUB - 1));
+    return (idx < METRIC_BUCKETS) ? idx : METRIC_BUCKETS - 1;
+}
+
+/* smallest value in microseconds of the bucket after idx */
+static uint64_t bucket_upper(int idx){
+    int msb, sub;
+
+    idx++;
+    if (idx < METRIC_SUB) {
+        return idx;
+    }
+    msb = idx / METRIC_SUB + METRIC_SUB_BITS - 1;
+    sub = idx % METRIC_SUB;
+    return (uint64_t)(METRIC_SUB + sub) << (msb - METRIC_SUB_BITS);
+}
+
+void metrics_init(void){
+    pthread_key_create(&shard_key, shard_release);
+}
+
+/* monotonic time in nanoseconds */
+uint64_t metrics_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_count(int counter, uint64_t n){
+    add_u64(&shard()->counter[counter], n);
+}
+
+void metrics_gauge(int gauge, int64_t delta){
+    metrics_shard *s = shard();
+
+    __atomic_store_n(&s->gauge[gauge], s->gauge[gauge] + delta,
+        __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int hist, uint64_t ns){
+    metrics_shard *s = shard();
+    uint64_t us = ns / 1000;
+
+    add_u64(&s->hist[hist][bucket(us)], 1);
+    add_u64(&s->hist_sum[hist], us);
+}
+
+/* start timing a request of this thread */
+void metrics_request_begin(uint64_t start){
+    req_start = start;
+    req_first_byte = 0;
+}
+
+/* the first byte of response is about to be sent */
+void metrics_first_byte(void){
+    if (req_start != 0 && !req_first_byte) {
+        metrics_observe(METRIC_FIRST_BYTE, metrics_now() - req_start);
+        req_first_byte = 1;
+    }
+}
+
+/* the response is sent */
+void metrics_request_end(void){
+    if (req_start != 0) {
+        metrics_observe(METRIC_TOTAL, metrics_now() - req_start);
+        req_start = 0;
+    }
+}
+
+/* value of a gauge summed over all shards */
+int64_t metrics_gauge_value(int gauge){
+    int64_t v = 0;
+
+    pthread_mutex_lock(&lock);
+    for (metrics_shard *s = shards; s != NULL; s = s->next) {
+        v += __atomic_load_n(&s->gauge[gauge], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lock);
+    return v;
+}
+
+/* sum of all shards */
+typedef struct metrics_sum {
+    uint64_t counter[METRIC_COUNTERS];
+    int64_t gauge[METRIC_GAUGES];
+    uint64_t hist[METRIC_HISTS][METRIC_BUCKETS];
+    uint64_t hist_sum[METRIC_HISTS];
+} metrics_sum;
+
+static void sum(metrics_sum *m){
+    memset(m, 0, sizeof(metrics_sum));
+
+    pthread_mutex_lock(&lock);
+    for (metrics_shard *s = shards; s != NULL; s = s->next) {
+        for (int i = 0; i < METRIC_COUNTERS; i++) {
+            m->counter[i] += __atomic_load_n(&s->counter[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_GAUGES; i++) {
+            m->gauge[i] += __atomic_load_n(&s->gauge[i], __ATOMIC_RELAXED);
+        }
+        for (int h = 0; h < METRIC_HISTS; h++) {
+            for (int i = 0; i < METRIC_BUCKETS; i++) {
+                m->hist[h][i] += __atomic_load_n(&s->hist[h][i],
+                    __ATOMIC_RELAXED);
+            }
+            m->hist_sum[h] += __atomic_load_n(&s->hist_sum[h],
+                __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * write a histogram in Prometheus text format
+ * buckets are given at powers of two of microseconds up to the largest
+ * value seen, and the quantiles are estimated from all buckets
+ */
+static void write_hist(FILE *fp, char *name, char *help, uint64_t *hist,
+    uint64_t hist_sum){
+
+    uint64_t count = 0, cum = 0;
+    int last = -1;
+
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        count += hist[i];
+        if (hist[i] > 0) {
+            last = i;
+        }
+    }
+
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i <= last; i++) {
+        cum += hist[i];
+        /* a power of two ends this bucket */
+        if (i == last || i % METRIC_SUB == METRIC_SUB - 1) {
+            fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n", name,
+                bucket_upper(i) / 1e6, (unsigned long)cum);
+        }
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)count);
+    fprintf(fp, "%s_sum %g\n", name, hist_sum / 1e6);
+    fprintf(fp, "%s_count %lu\n", name, (unsigned long)count);
+
+    /* quantiles, the upper bound of the bucket reaching them */
+    fprintf(fp, "# TYPE %s_quantile gauge\n", name);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t want = (uint64_t)(quantiles[q] * count + 0.5);
+        int i = 0;
+
+        cum = 0;
+        if (count > 0) {
+            for (i = 0; i < METRIC_BUCKETS - 1; i++) {
+                if ((cum += hist[i]) >= want && cum > 0) {
+                    break;
+                }
+            }
+        }
+        fprintf(fp, "%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[q],
+            count > 0 ? bucket_upper(i) / 1e6 : 0);
+    }
+}
+
+/* write all metrics in Prometheus text format */
+void metrics_write(FILE *fp){
+    metrics_sum *m = Malloc(sizeof(metrics_sum));
+    static char *states[METRIC_GAUGES] = { "idle", "reading", "active" };
+
+    sum(m);
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        if (counters[i].help != NULL) {
+            fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counters[i].name,
+                counters[i].help, counters[i].name);
+        }
+        fprintf(fp, "%s%s %lu\n", counters[i].name, counters[i].label,
+            (unsigned long)m->counter[i]);
+    }
+
+    fprintf(fp, "# HELP proxy_connections Client connections by state.\n"
+        "# TYPE proxy_connections gauge\n");
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        fprintf(fp, "proxy_connections{state=\"%s\"} %ld\n", states[i],
+            (long)m->gauge[i]);
+    }
+
+    for (int h = 0; h < METRIC_HISTS; h++) {
+        write_hist(fp, hists[h].name, hists[h].help, m->hist[h],
+            m->hist_sum[h]);
+    }
+
+    free(m);
+}
@@ -0,0 +1,67 @@
+/*
+ * metrics.h
+ *
+ * Counters, gauges and latency histograms of the proxy. Each thread
+ * updates a shard of its own with plain stores, so recording a request
+ * takes no lock and no atomic read-modify-write; a reader sums the
+ * shards of all threads. The shard of a thread that exits is kept for
+ * the next thread, so totals never go back.
+ *
+ * Histograms are log-linear as in HdrHistogram: 8 buckets for each
+ * power of two of microseconds, about 12% apart, up to 2^41us.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* counters */
+#define METRIC_REQUESTS 0
+#define METRIC_HITS 1               //served from memory tier
+#define METRIC_DISK_HITS 2          //served from disk tier
+#define METRIC_STALE_HITS 3         //served stale while revalidating
+#define METRIC_MISSES 4             //fetched from server
+#define METRIC_COALESCED 5          //misses joining another fetch
+#define METRIC_REVALIDATIONS 6      //conditional requests to server
+#define METRIC_NOT_MODIFIED 7       //304 answers to them
+#define METRIC_CLIENT_BYTES 8       //response bytes sent to clients
+#define METRIC_UPSTREAM_BYTES 9     //response bytes read from servers
+#define METRIC_UPSTREAM_CONNECTS 10 //new server connections
+#define METRIC_UPSTREAM_REUSED 11   //pooled server connections used
+#define METRIC_UPSTREAM_ERRORS 12   //failed connects
+#define METRIC_ERRORS 13            //error responses to clients
+#define METRIC_SHED_CONNS 14        //connections refused, over budget
+#define METRIC_SHED_QUEUE 15        //connections waited too long in queue
+#define METRIC_SHED_FETCH 16        //misses refused, over fetch limit
+#define METRIC_COUNTERS 17
+
+/* gauges */
+#define METRIC_CONN_IDLE 0          //client connections by state
+#define METRIC_CONN_READING 1
+#define METRIC_CONN_ACTIVE 2
+#define METRIC_GAUGES 3
+
+/* histograms */
+#define METRIC_FIRST_BYTE 0         //request start to first response byte
+#define METRIC_TOTAL 1              //request start to response sent
+#define METRIC_CONNECT 2            //connecting to server
+#define METRIC_HISTS 3
+
+#define METRIC_SUB_BITS 3
+#define METRIC_SUB (1 << METRIC_SUB_BITS)
+#define METRIC_BUCKETS ((40 - METRIC_SUB_BITS + 2) * METRIC_SUB)
+
+void metrics_init(void);
+uint64_t metrics_now(void);
+void metrics_count(int counter, uint64_t n);
+void metrics_gauge(int gauge, int64_t delta);
+void metrics_observe(int hist, uint64_t ns);
+void metrics_request_begin(uint64_t start);
+void metrics_first_byte(void);
+void metrics_request_end(void);
+int64_t metrics_gauge_value(int gauge);
+void metrics_write(FILE *fp);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * origin.c
+ *
+ * Stand-in origin server for benchmarks of the proxy. GET /obj/<n>
+ * returns a body whose size is drawn for n from the size distribution,
+ * always the same for the same n and seed, so that runs can be repeated.
+ * Objects are cacheable for an hour, other paths get 404. Connections
+ * are kept alive unless the client asks for close.
+ *
+ * Size distributions, sizes take a k, m or g suffix:
+ *   fixed:SIZE
+ *   uniform:MIN-MAX
+ *   lognormal:MEDIAN,SIGMA     (default lognormal:8k,1.5)
+ *   pareto:MIN,ALPHA
+ *
+ * build: gcc -O2 -o origin origin.c csapp.c -lpthread -lm
+ * usage: origin [-s distribution] [-x max_size] [-l latency_ms]
+ *               [-e seed] <port>
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_LOGNORMAL 2
+#define DIST_PARETO 3
+
+#define PATTERN_SIZE 65536
+
+static int dist = DIST_LOGNORMAL;
+static double param1 = 8192, param2 = 1.5;
+static size_t max_size = 4 << 20;
+static int latency_ms;
+static uint64_t seed = 1;
+static char pattern[PATTERN_SIZE];
+
+/* print usage and exit */
+static void usage(char *name){
+    fprintf(stderr, "usage: %s [-s fixed:SIZE|uniform:MIN-MAX|"
+        "lognormal:MEDIAN,SIGMA|pareto:MIN,ALPHA] [-x max_size] "
+        "[-l latency_ms] [-e seed] <port>\n", name);
+    exit(1);
+}
+
+/* parse a size in bytes with an optional k, m or g suffix */
+static double parse_size(char *name, char *arg, char **end){
+    double size = strtod(arg, end);
+
+    switch (**end) {
+    case 'g': case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'm': case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'k': case 'K':
+        size *= 1024;
+        (*end)++;
+        break;
+    }
+
+    if (*end == arg) {
+        usage(name);
+    }
+    return size;
+}
+
+/* parse the -s argument */
+static void parse_dist(char *name, char *arg){
+    char *p = strchr(arg, ':'), *end;
+
+    if (p == NULL) {
+        usage(name);
+    }
+    p++;
+
+    if (!strncmp(arg, "fixed:", 6)) {
+        dist = DIST_FIXED;
+        param1 = parse_size(name, p, &end);
+    }
+    else if (!strncmp(arg, "uniform:", 8)) {
+        dist = DIST_UNIFORM;
+        param1 = parse_size(name, p, &end);
+        if (*end++ != '-') {
+            usage(name);
+        }
+        param2 = parse_size(name, end, &end);
+    }
+    else if (!strncmp(arg, "lognormal:", 10)) {
+        dist = DIST_LOGNORMAL;
+        param1 = parse_size(name, p, &end);
+        if (*end++ != ',') {
+            usage(name);
+        }
+        param2 = strtod(end, &end);
+    }
+    else if (!strncmp(arg, "pareto:", 7)) {
+        dist = DIST_PARETO;
+        param1 = parse_size(name, p, &end);
+        if (*end++ != ',') {
+            usage(name);
+        }
+        param2 = strtod(end, &end);
+    }
+    else {
+        usage(name);
+    }
+
+    if (*end != '\0') {
+        usage(name);
+    }
+}
+
+/* splitmix64, a good hash of consecutive numbers */
+static uint64_t mix(uint64_t x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* uniform in (0, 1) from a hash */
+static double unit(uint64_t h){
+    return ((h >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* size of object n */
+static size_t object_size(unsigned long n){
+    uint64_t h1 = mix(seed ^ mix(n)), h2 = mix(h1);
+    double size;
+
+    switch (dist) {
+    case DIST_FIXED:
+        size = param1;
+        break;
+    case DIST_UNIFORM:
+        size = param1 + unit(h1) * (param2 - param1 + 1);
+        break;
+    case DIST_LOGNORMAL:
+        /* Box-Muller */
+        size = param1 * exp(param2 * sqrt(-2 * log(unit(h1))) *
+            cos(2 * M_PI * unit(h2)));
+        break;
+    default:
+        size = param1 / pow(unit(h1), 1 / param2);
+        break;
+    }
+
+    if (size < 1) {
+        return 1;
+    }
+    return (size > max_size) ? max_size : (size_t)size;
+}
+
+/* send a response with a body of size bytes, return -1 on error */
+static int respond(int fd, char *status, size_t size, int keep_alive){
+    char hdr[MAXLINE];
+
+    sprintf(hdr, "HTTP/1.1 %s\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Cache-Control: max-age=3600\r\n"
+        "Content-Length: %lu\r\n"
+        "Connection: %s\r\n\r\n",
+        status, (unsigned long)size, keep_alive ? "keep-alive" : "close");
+
+    if (rio_writen(fd, hdr, strlen(hdr)) < 0) {
+        return -1;
+    }
+    while (size > 0) {
+        size_t n = (size < PATTERN_SIZE) ? size : PATTERN_SIZE;
+
+        if (rio_writen(fd, pattern, n) < 0) {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/* serve the requests of a connection */
+static void *serve(void *vargp){
+    int fd = *(int *)vargp, one = 1;
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    unsigned long n;
+    int keep_alive;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    free(vargp);
+    Rio_readinitb(&rio, fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0) {
+        if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+            break;
+        }
+        keep_alive = strcmp(version, "HTTP/1.0") != 0;
+
+        while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+            if (!strncasecmp(buf, "Connection:", 11)) {
+                keep_alive = strcasestr(buf, "close") == NULL;
+            }
+        }
+
+        if (latency_ms > 0) {
+            usleep(latency_ms * 1000);
+        }
+
+        /* the uri is a path, or absolute if sent to origin as a proxy */
+        char *path = strstr(uri, "/obj/");
+
+        if (strcmp(method, "GET") || path == NULL ||
+            sscanf(path, "/obj/%lu", &n) != 1) {
+            if (respond(fd, "404 Not Found", 0, keep_alive) < 0) {
+                break;
+            }
+        }
+        else if (respond(fd, "200 OK", object_size(n), keep_alive) < 0) {
+            break;
+        }
+
+        if (!keep_alive) {
+            break;
+        }
+    }
+
+    Close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    int listenfd, *connfd, opt;
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    pthread_t tid;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "s:x:l:e:")) != -1) {
+        switch (opt) {
+        case 's':
+            parse_dist(argv[0], optarg);
+            break;
+        case 'x':
+            max_size = parse_size(argv[0], optarg, &end);
+            break;
+        case 'l':
+            latency_ms = atoi(optarg);
+            break;
+        case 'e':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = 'a' + i % 26;
+    }
+
+    listenfd = Open_listenfd(atoi(argv[optind]));
+    while (1) {
+        connfd = Malloc(sizeof(int));
+        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        Pthread_create(&tid, NULL, serve, connfd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * parsebench.c
+ *
+ * Requests per second of parsing a client request and rewriting it for
+ * the server, with the old line by line code (sscanf, parse_uri and
+ * requestHdr building strings with strcat and sprintf) and with the
+ * in-place parser of http.c building an iovec. Both read from memory,
+ * the old one copying lines out as rio_readlineb() does.
+ *
+ * build: gcc -O2 -o parsebench parsebench.c http.c bufpool.c csapp.c -lpthread
+ * usage: parsebench [-n requests]
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "http.h"
+
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate";
+static const char *conn_hdr = "Connection: keep-alive";
+
+/* a typical browser request */
+static const char *request =
+    "GET http://www.example.com:8080/images/logo.png?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) Firefox/120.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+/* ----------- old code ------------ */
+
+/* read a line from memory like rio_readlineb */
+static ssize_t readline(const char **p, char *buf, size_t maxlen){
+    size_t n = 0;
+
+    while (**p != '\0' && n < maxlen - 1) {
+        buf[n++] = *(*p)++;
+        if (buf[n - 1] == '\n') {
+            break;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static int old_parse_uri(char *uri, char *host, int *port, char *filename){
+    if (strncasecmp(uri, "http://", 7)) {
+        host[0] = '\0';
+        return -1;
+    }
+
+    char buf[MAXLINE];
+    strcpy(buf, uri);
+    *port = 80;
+
+    char *ptr = buf + 7;
+    while (*ptr != '/' && *ptr != ':') {
+        *host++ = *ptr++;
+    }
+    *host = '\0';
+
+    if (*ptr == ':') {
+        *ptr = '\0';
+        ptr++;
+        sscanf(ptr, "%d%s", port, ptr);
+    }
+
+    strcpy(filename, ptr);
+    return 0;
+}
+
+static size_t old_rewrite(const char *p){
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char host[MAXLINE], filename[MAXLINE];
+    char get_cmd[MAXLINE], host_hdr[MAXLINE], std_hdr[MAXLINE], append_hdr[MAXLINE];
+    char request_buf[MAXLINE];
+    int port, keep_alive, len;
+
+    readline(&p, buf, MAXLINE);
+    sscanf(buf, "%s %s %s", method, uri, version);
+    keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    filename[0] = '\0';
+    old_parse_uri(uri, host, &port, filename);
+
+    snprintf(get_cmd, sizeof(get_cmd), "GET %s %s\r\n", filename,
+        strcmp(version, "HTTP/1.0") ? "HTTP/1.1" : "HTTP/1.0");
+    strcpy(host_hdr, "");
+    strcpy(append_hdr, "");
+
+    while (readline(&p, buf, MAXLINE) > 0) {
+        if (!strcmp(buf, "\r\n")) {
+            break;
+        }
+        else if (!strncmp(buf, "Host:", 5)) {
+            strcpy(host_hdr, buf);
+        }
+        else if (!strncasecmp(buf, "Connection:", 11) ||
+            !strncasecmp(buf, "Proxy-Connection:", 17)) {
+            keep_alive = strcasestr(buf, "close") == NULL;
+        }
+        else if (strncmp(buf, "User-Agent", 10) &&
+            strncmp(buf, "Accept:", 7) &&
+            strncmp(buf, "Accept-Encoding", 15)) {
+            strcat(append_hdr, buf);
+        }
+    }
+
+    if (!strlen(host_hdr)) {
+        snprintf(host_hdr, sizeof(host_hdr), "Host: %s\r\n", host);
+    }
+    snprintf(std_hdr, sizeof(std_hdr), "%s%s%s\r\n%s\r\n", user_agent_hdr, accept_hdr,
+        accept_encoding_hdr, conn_hdr);
+    len = snprintf(request_buf, sizeof(request_buf), "%s%s%s%s\r\n", get_cmd,
+        host_hdr, std_hdr, append_hdr);
+
+    return len + keep_alive;
+}
+
+/* ----------- new code ------------ */
+
+static size_t new_rewrite(http_conn *c){
+    http_request req;
+    struct iovec iov[HTTP_MAX_IOV];
+    size_t len = 0;
+    int n = 0;
+
+    /* the whole request is in the buffer, nothing is read */
+    c->start = 0;
+    c->end = strlen(request);
+    memcpy(c->buf, request, c->end);
+    if (http_read_request(c, &req) != HTTP_OK) {
+        return 0;
+    }
+
+    /* as requestIov() of proxy.c */
+    iov[n].iov_base = "GET ";
+    iov[n++].iov_len = 4;
+    iov[n].iov_base = req.path.p;
+    iov[n++].iov_len = req.path.len;
+    iov[n].iov_base = req.http11 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n";
+    iov[n++].iov_len = 11;
+    iov[n].iov_base = req.host_hdr.p;
+    iov[n++].iov_len = req.host_hdr.len;
+    iov[n].iov_base = (void *)user_agent_hdr;
+    iov[n++].iov_len = strlen(user_agent_hdr);
+    iov[n].iov_base = (void *)accept_hdr;
+    iov[n++].iov_len = strlen(accept_hdr);
+    iov[n].iov_base = (void *)accept_encoding_hdr;
+    iov[n++].iov_len = strlen(accept_encoding_hdr);
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    iov[n].iov_base = (void *)conn_hdr;
+    iov[n++].iov_len = strlen(conn_hdr);
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    for (int i = 0; i < req.nhdrs; i++) {
+        if (strncmp(req.hdrs[i].p, "User-Agent", 10) &&
+            strncmp(req.hdrs[i].p, "Accept:", 7) &&
+            strncmp(req.hdrs[i].p, "Accept-Encoding", 15)) {
+            iov[n].iov_base = req.hdrs[i].p;
+            iov[n++].iov_len = req.hdrs[i].len;
+        }
+    }
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+
+    for (int i = 0; i < n; i++) {
+        len += iov[i].iov_len;
+    }
+    return len + req.keep_alive;
+}
+
+/* return the time in seconds */
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]){
+    long n = 1000000;
+    size_t check_old = 0, check_new = 0;
+    static char conn_buf[HTTP_BUFSIZE];
+    http_conn conn;
+    double t0, t_old, t_new;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            n = atol(optarg);
+        }
+        else {
+            fprintf(stderr, "usage: %s [-n requests]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    t0 = now();
+    for (long i = 0; i < n; i++) {
+        check_old += old_rewrite(request);
+    }
+    t_old = now() - t0;
+
+    http_conn_init(&conn, -1);
+    conn.buf = conn_buf;
+    t0 = now();
+    for (long i = 0; i < n; i++) {
+        check_new += new_rewrite(&conn);
+    }
+    t_new = now() - t0;
+
+    printf("old: %10.0f requests/s (%lu bytes per request)\n",
+        n / t_old, (unsigned long)(check_old / n));
+    printf("new: %10.0f requests/s (%lu bytes per request)\n",
+        n / t_new, (unsigned long)(check_new / n));
+    printf("speedup %.1fx\n", t_old / t_new);
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * policy.c
+ *
+ * All policies account queues in bytes, so that large objects take as
+ * much of a queue's share as they take of the tier. Blocks are handed
+ * to a policy by insert() and taken back by remove(); victim() may move
+ * blocks between the policy's queues before it settles on the block to
+ * evict, but it never evicts by itself.
+ */
+
+#include "csapp.h"
+#include "policy.h"
+
+/* queues of the policies */
+#define LRU_LIST 0
+
+#define S3_SMALL 0
+#define S3_MAIN 1
+#define S3_SMALL_PCT 10         //share of small queue in percent
+#define S3_MAX_FREQ 3
+
+#define W_WINDOW 0
+#define W_PROBATION 1
+#define W_PROTECTED 2
+#define W_WINDOW_PCT 1          //share of window in percent
+#define W_PROTECTED_PCT 80      //share of protected in main area
+
+/* ----------- queue functions ------------ */
+
+/* put a block at the head of queue q */
+static void queue_push(cache_tier *tier, int q, cache_block *block){
+    cache_queue *queue = &tier->queue[q];
+
+    block->queue = q;
+    block->prev = NULL;
+    block->next = queue->head;
+
+    if (queue->head != NULL) {
+        queue->head->prev = block;
+    }
+    else {
+        queue->tail = block;
+    }
+    queue->head = block;
+    queue->size += block->object_size;
+}
+
+/* take a block out of its queue */
+static void queue_remove(cache_tier *tier, cache_block *block){
+    cache_queue *queue = &tier->queue[block->queue];
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    }
+    else {
+        queue->head = block->next;
+    }
+
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    else {
+        queue->tail = block->prev;
+    }
+
+    block->prev = block->next = NULL;
+    queue->size -= block->object_size;
+}
+
+/* move a block to the head of queue q */
+static void queue_move(cache_tier *tier, int q, cache_block *block){
+    queue_remove(tier, block);
+    queue_push(tier, q, block);
+}
+
+/* ----------- count-min sketch ------------ */
+
+/* mix a key into the i-th row index */
+static inline size_t sketch_index(sketch *s, uint64_t key, int i){
+    uint64_t h = key + (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return i * s->width + (h & (s->width - 1));
+}
+
+/* create a sketch sized for a tier */
+static sketch *sketch_new(cache_tier *tier){
+    sketch *s = Malloc(sizeof(sketch));
+    size_t want = tier->max_size / 4096;
+
+    s->width = 1024;
+    while (s->width < want && s->width < (1 << 20)) {
+        s->width <<= 1;
+    }
+
+    s->table = calloc(SKETCH_DEPTH * s->width, 1);
+    if (s->table == NULL) {
+        unix_error("calloc error");
+    }
+    s->additions = 0;
+    s->sample = 10 * s->width;
+    return s;
+}
+
+/* count an access, halve all counters once per sample */
+static void sketch_add(sketch *s, uint64_t key){
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        uint8_t *c = &s->table[sketch_index(s, key, i)];
+        if (*c < SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+
+    if (++s->additions >= s->sample) {
+        for (size_t i = 0; i < SKETCH_DEPTH * s->width; i++) {
+            s->table[i] >>= 1;
+        }
+        s->additions /= 2;
+    }
+}
+
+/* return the estimated access frequency of a key */
+static int sketch_estimate(sketch *s, uint64_t key){
+    int min = SKETCH_MAX;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        int c = s->table[sketch_index(s, key, i)];
+        if (c < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+/* ----------- LRU ------------ */
+
+static void lru_insert(cache_tier *tier, cache_block *block){
+    queue_push(tier, LRU_LIST, block);
+}
+
+static void lru_hit(cache_tier *tier, cache_block *block){
+    queue_move(tier, LRU_LIST, block);
+}
+
+static void lru_remove(cache_tier *tier, cache_block *block){
+    queue_remove(tier, block);
+}
+
+static cache_block *lru_victim(cache_tier *tier){
+    return tier->queue[LRU_LIST].tail;
+}
+
+/* ----------- GDSF ------------ */
+
+/* swap two entries of the heap */
+static inline void heap_swap(cache_tier *tier, size_t i, size_t j){
+    cache_block *tmp = tier->heap[i];
+
+    tier->heap[i] = tier->heap[j];
+    tier->heap[j] = tmp;
+    tier->heap[i]->heap_idx = i;
+    tier->heap[j]->heap_idx = j;
+}
+
+/* restore heap order around entry i */
+static void heap_fix(cache_tier *tier, size_t i){
+    /* sift up */
+    while (i > 0 && tier->heap[(i - 1) / 2]->priority > tier->heap[i]->priority) {
+        heap_swap(tier, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    /* sift down */
+    while (1) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < tier->heap_len && tier->heap[l]->priority < tier->heap[min]->priority) {
+            min = l;
+        }
+        if (r < tier->heap_len && tier->heap[r]->priority < tier->heap[min]->priority) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(tier, i, min);
+        i = min;
+    }
+}
+
+/* priority of a block: clock + frequency / size */
+static inline double gdsf_priority(cache_tier *tier, cache_block *block){
+    return tier->clock + (double)block->freq / (double)block->object_size;
+}
+
+static void gdsf_insert(cache_tier *tier, cache_block *block){
+    if (tier->heap_len == tier->heap_cap) {
+        tier->heap_cap = tier->heap_cap ? 2 * tier->heap_cap : 64;
+        tier->heap = realloc(tier->heap, tier->heap_cap * sizeof(cache_block *));
+        if (tier->heap == NULL) {
+            unix_error("realloc error");
+        }
+    }
+
+    block->freq = 1;
+    block->priority = gdsf_priority(tier, block);
+    block->heap_idx = tier->heap_len;
+    tier->heap[tier->heap_len++] = block;
+    heap_fix(tier, block->heap_idx);
+}
+
+static void gdsf_hit(cache_tier *tier, cache_block *block){
+    block->freq++;
+    block->priority = gdsf_priority(tier, block);
+    heap_fix(tier, block->heap_idx);
+}
+
+static void gdsf_remove(cache_tier *tier, cache_block *block){
+    size_t i = block->heap_idx;
+
+    tier->heap_len--;
+    if (i != tier->heap_len) {
+        heap_swap(tier, i, tier->heap_len);
+        heap_fix(tier, i);
+    }
+}
+
+static cache_block *gdsf_victim(cache_tier *tier){
+    if (tier->heap_len == 0) {
+        return NULL;
+    }
+
+    /* inflate the clock to the priority of the evicted block */
+    tier->clock = tier->heap[0]->priority;
+    return tier->heap[0];
+}
+
+/* ----------- S3-FIFO ------------ */
+
+static void s3fifo_init(cache_tier *tier){
+    tier->ghost = calloc(GHOST_SLOTS, sizeof(uint64_t));
+    if (tier->ghost == NULL) {
+        unix_error("calloc error");
+    }
+}
+
+static void s3fifo_insert(cache_tier *tier, cache_block *block){
+    uint64_t *slot = &tier->ghost[block->key % GHOST_SLOTS];
+
+    block->freq = 0;
+    if (*slot == block->key) {
+        /* evicted from small queue not long ago, go to main directly */
+        *slot = 0;
+        queue_push(tier, S3_MAIN, block);
+    }
+    else {
+        queue_push(tier, S3_SMALL, block);
+    }
+}
+
+static void s3fifo_hit(cache_tier *tier, cache_block *block){
+    (void)tier;
+    if (block->freq < S3_MAX_FREQ) {
+        block->freq++;
+    }
+}
+
+static void s3fifo_remove(cache_tier *tier, cache_block *block){
+    queue_remove(tier, block);
+}
+
+static cache_block *s3fifo_victim(cache_tier *tier){
+    cache_queue *small = &tier->queue[S3_SMALL];
+    cache_queue *main = &tier->queue[S3_MAIN];
+    cache_block *block;
+
+    while (small->tail != NULL || main->tail != NULL) {
+        if (small->tail != NULL &&
+            (small->size * 100 > tier->max_size * S3_SMALL_PCT || main->tail == NULL)) {
+            block = small->tail;
+            if (block->freq > 0) {
+                /* seen again while in small queue */
+                block->freq = 0;
+                queue_move(tier, S3_MAIN, block);
+                continue;
+            }
+
+            tier->ghost[block->key % GHOST_SLOTS] = block->key;
+            return block;
+        }
+
+        block = main->tail;
+        if (block->freq > 0) {
+            /* reinsert with one less frequency */
+            block->freq--;
+            queue_move(tier, S3_MAIN, block);
+            continue;
+        }
+        return block;
+    }
+
+    return NULL;
+}
+
+/* ----------- W-TinyLFU ------------ */
+
+static void wtinylfu_init(cache_tier *tier){
+    if (tier->sketch == NULL) {
+        tier->sketch = sketch_new(tier);
+    }
+}
+
+static void wtinylfu_insert(cache_tier *tier, cache_block *block){
+    queue_push(tier, W_WINDOW, block);
+}
+
+static void wtinylfu_hit(cache_tier *tier, cache_block *block){
+    cache_queue *protected = &tier->queue[W_PROTECTED];
+    size_t main_size = tier->max_size - tier->max_size * W_WINDOW_PCT / 100;
+
+    if (block->queue == W_WINDOW) {
+        queue_move(tier, W_WINDOW, block);
+        return;
+    }
+
+    queue_move(tier, W_PROTECTED, block);
+
+    /* demote the overflow of protected back to probation */
+    while (protected->size * 100 > main_size * W_PROTECTED_PCT &&
+        protected->tail != block) {
+        queue_move(tier, W_PROBATION, protected->tail);
+    }
+}
+
+static void wtinylfu_remove(cache_tier *tier, cache_block *block){
+    queue_remove(tier, block);
+}
+
+static cache_block *wtinylfu_victim(cache_tier *tier){
+    cache_queue *window = &tier->queue[W_WINDOW];
+    size_t main_size = tier->max_size - tier->max_size * W_WINDOW_PCT / 100;
+    cache_block *candidate, *victim;
+
+    while (window->tail != NULL &&
+        window->size * 100 > tier->max_size * W_WINDOW_PCT) {
+        candidate = window->tail;
+
+        if (tier->queue[W_PROBATION].size + tier->queue[W_PROTECTED].size +
+            candidate->object_size <= main_size) {
+            /* main area is not full yet */
+            queue_move(tier, W_PROBATION, candidate);
+            continue;
+        }
+
+        victim = tier->queue[W_PROBATION].tail;
+        if (victim == NULL) {
+            victim = tier->queue[W_PROTECTED].tail;
+        }
+
+        if (victim == NULL ||
+            sketch_estimate(tier->sketch, candidate->key) >
+            sketch_estimate(tier->sketch, victim->key)) {
+            /* window victim wins its place in main area */
+            queue_move(tier, W_PROBATION, candidate);
+            if (victim != NULL) {
+                return victim;
+            }
+            continue;
+        }
+        return candidate;
+    }
+
+    if ((victim = tier->queue[W_PROBATION].tail) == NULL &&
+        (victim = tier->queue[W_PROTECTED].tail) == NULL) {
+        victim = window->tail;
+    }
+    return victim;
+}
+
+/* ----------- policy table ------------ */
+
+static cache_policy policies[] = {
+    {"lru", NULL, lru_insert, lru_hit, lru_remove, lru_victim},
+    {"gdsf", NULL, gdsf_insert, gdsf_hit, gdsf_remove, gdsf_victim},
+    {"s3fifo", s3fifo_init, s3fifo_insert, s3fifo_hit, s3fifo_remove, s3fifo_victim},
+    {"wtinylfu", wtinylfu_init, wtinylfu_insert, wtinylfu_hit, wtinylfu_remove,
+        wtinylfu_victim},
+};
+
+/* return the policy of a name, NULL if there is none */
+cache_policy *policy_find(char *name){
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (!strcmp(policies[i].name, name)) {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
+
+/* set up the policy of an empty tier */
+void policy_init(cache_tier *tier, cache_policy *policy, int admit){
+    tier->policy = policy;
+    tier->admit = admit;
+
+    if (admit) {
+        tier->sketch = sketch_new(tier);
+    }
+    if (policy->init != NULL) {
+        policy->init(tier);
+    }
+}
+
+/* count an access to key, hit or miss */
+void policy_access(cache_tier *tier, uint64_t key){
+    if (tier->sketch != NULL) {
+        sketch_add(tier->sketch, key);
+    }
+}
+
+/*
+ * TinyLFU admission
+ * return 1 if an object of key and size should enter the tier, which is
+ * when it fits without eviction or it is more popular than the victim
+ */
+int policy_admit(cache_tier *tier, uint64_t key, size_t size){
+    cache_block *victim;
+
+    if (!tier->admit || tier->size + size <= tier->max_size) {
+        return 1;
+    }
+
+    if ((victim = tier->policy->victim(tier)) == NULL) {
+        return 1;
+    }
+
+    return sketch_estimate(tier->sketch, key) >
+        sketch_estimate(tier->sketch, victim->key);
+}
@@ -0,0 +1,52 @@
+/*
+ * policy.h
+ *
+ * Eviction and admission policies of a cache tier.
+ * A policy keeps the blocks of a tier in its own queues (and heap) and
+ * picks the victim when the tier is full:
+ *
+ * lru       least recently used
+ * gdsf      GreedyDual-Size-Frequency, evicts the lowest
+ *           clock + frequency / size first
+ * s3fifo    small FIFO for new blocks, main FIFO for those seen again,
+ *           ghost table of recently evicted blocks
+ * wtinylfu  LRU window in front of a segmented LRU main area, window
+ *           victims enter main only if they are more popular than the
+ *           main victim according to the frequency sketch
+ *
+ * Any policy can be combined with the TinyLFU admission filter, which
+ * turns away a new object that is not more popular than the victim.
+ */
+
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+#define SKETCH_DEPTH 4          //rows of count-min sketch
+#define SKETCH_MAX 15           //counters saturate here
+#define GHOST_SLOTS 4096        //slots of S3-FIFO ghost table
+
+/* count-min sketch of access frequencies, aged by halving */
+typedef struct sketch {
+    uint8_t *table;
+    size_t width;               //counters per row, a power of 2
+    size_t additions;
+    size_t sample;              //additions between two agings
+} sketch;
+
+typedef struct cache_policy {
+    char *name;
+    void (*init)(cache_tier *tier);
+    void (*insert)(cache_tier *tier, cache_block *block);
+    void (*hit)(cache_tier *tier, cache_block *block);
+    void (*remove)(cache_tier *tier, cache_block *block);
+    cache_block *(*victim)(cache_tier *tier);
+} cache_policy;
+
+cache_policy *policy_find(char *name);
+void policy_init(cache_tier *tier, cache_policy *policy, int admit);
+void policy_access(cache_tier *tier, uint64_t key);
+int policy_admit(cache_tier *tier, uint64_t key, size_t size);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * policysim.c
+ *
+ * Replay a request log written by "proxy -l" through the memory tier of
+ * the cache with each eviction policy, and report its object and byte
+ * hit ratios. A miss inserts an object of the logged size, as the proxy
+ * would after fetching it.
+ *
+ * build: gcc -O2 -o policysim policysim.c cache.c policy.c disk.c fresh.c \
+ *        snap.c csapp.c -lpthread
+ * usage: policysim [-m mem_size] [-o mem_object_size]
+ *                  [-p policy,policy,...] [-a] <log_file>
+ */
+
+#include "csapp.h"
+#include "cache.h"
+
+#define DEFAULT_POLICIES "lru,gdsf,s3fifo,wtinylfu"
+
+/* a request of the log */
+typedef struct request {
+    char *uri;
+    size_t size;
+} request;
+
+static request *reqs;
+static size_t nreqs;
+
+/* print usage and exit */
+static void usage(char *name){
+    fprintf(stderr, "usage: %s [-m mem_size] [-o mem_object_size] "
+        "[-p policy,policy,...] [-a] <log_file>\n", name);
+    exit(1);
+}
+
+/* read the whole log into reqs */
+static void load_log(char *name){
+    char line[MAXLINE], uri[MAXLINE];
+    unsigned long size;
+    size_t cap = 1024;
+    FILE *fp;
+
+    if ((fp = fopen(name, "r")) == NULL) {
+        unix_error("cannot open log");
+    }
+
+    reqs = Malloc(cap * sizeof(request));
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (sscanf(line, "%s %lu", uri, &size) != 2) {
+            continue;
+        }
+
+        if (nreqs == cap) {
+            cap *= 2;
+            if ((reqs = realloc(reqs, cap * sizeof(request))) == NULL) {
+                unix_error("realloc error");
+            }
+        }
+        reqs[nreqs].uri = strdup(uri);
+        reqs[nreqs].size = size;
+        nreqs++;
+    }
+    fclose(fp);
+}
+
+/* replay the log with one policy and print its hit ratios */
+static void replay(char *policy, int admit, size_t mem_size, size_t mem_object,
+    char *object){
+
+    cache *cache_ptr = cache_init(mem_size, mem_object, NULL, 0, 0, policy, admit);
+    size_t hits = 0, bytes = 0, hit_bytes = 0;
+    cache_block *block;
+
+    for (size_t i = 0; i < nreqs; i++) {
+        bytes += reqs[i].size;
+
+        if ((block = cache_match(cache_ptr, reqs[i].uri)) != NULL) {
+            hits++;
+            hit_bytes += reqs[i].size;
+            cache_release(cache_ptr, block);
+        }
+        else {
+            cache_insert(cache_ptr, reqs[i].uri, object, reqs[i].size);
+        }
+    }
+
+    printf("%-10s %-6s %10lu %9.2f%% %9.2f%%\n", policy, admit ? "yes" : "no",
+        (unsigned long)nreqs,
+        nreqs ? 100.0 * hits / nreqs : 0.0,
+        bytes ? 100.0 * hit_bytes / bytes : 0.0);
+}
+
+int main(int argc, char *argv[]){
+    size_t mem_size = 1 << 20, mem_object = 102400;
+    char *policies = DEFAULT_POLICIES, *policy, *object;
+    int admit = 0, opt;
+
+    while ((opt = getopt(argc, argv, "m:o:p:a")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            mem_object = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            policies = optarg;
+            break;
+        case 'a':
+            admit = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    load_log(argv[optind]);
+    object = Calloc(1, mem_object);
+
+    printf("%-10s %-6s %10s %10s %10s\n", "policy", "admit", "requests",
+        "obj hit", "byte hit");
+    policies = strdup(policies);
+    for (policy = strtok(policies, ","); policy != NULL;
+        policy = strtok(NULL, ",")) {
+        replay(policy, admit, mem_size, mem_object, object);
+    }
+
+    return 0;
+}
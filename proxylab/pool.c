@@ -0,0 +1,158 @@
+/*
+ * pool.c
+ *
+ * Idle origin connections live in a hash table of buckets keyed by
+ * (host, port). Each bucket is a linked list with the most recently
+ * released connection at the head, so checkout is LIFO and the oldest
+ * connections are the ones that time out.
+ *
+ * A connection is dropped when it has been idle for POOL_IDLE_TIMEOUT
+ * seconds, or when the health check on checkout finds that the server
+ * has closed it (or sent unsolicited data).
+ */
+
+#include <poll.h>
+#include "csapp.h"
+#include "pool.h"
+
+typedef struct pool_conn {
+    char *host;
+    int port;
+    int fd;
+    time_t last_used;           //time the connection went idle
+    struct pool_conn *next;
+} pool_conn;
+
+static pool_conn *buckets[POOL_BUCKETS];
+static pthread_mutex_t bucket_lock[POOL_BUCKETS];
+
+/* return the bucket index of an origin */
+static inline size_t hash(char *host, int port){
+    size_t h = 5381;
+
+    while (*host) {
+        h = h * 33 + (unsigned char)*host++;
+    }
+    return (h ^ (size_t)port) % POOL_BUCKETS;
+}
+
+/* return 1 if the idle connection is still usable */
+static inline int is_alive(int fd){
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    /* an idle connection must have nothing to read:
+     * readable means EOF, an error or garbage from the server */
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/* unlink and release a pooled entry, closing its socket */
+static inline void drop(pool_conn **pp){
+    pool_conn *conn = *pp;
+
+    *pp = conn->next;
+    close(conn->fd);
+    free(conn->host);
+    free(conn);
+}
+
+/* init the bucket locks */
+void pool_init(void){
+    for (size_t i = 0; i < POOL_BUCKETS; i++) {
+        buckets[i] = NULL;
+        pthread_mutex_init(&bucket_lock[i], NULL);
+    }
+}
+
+/*
+ * check out an idle connection to <host, port>
+ * return the connected fd, or -1 if there is no usable one
+ */
+int pool_get(char *host, int port){
+    size_t i = hash(host, port);
+    pool_conn **pp, *conn;
+    int fd;
+
+    while (1) {
+        time_t now = time(NULL);
+        conn = NULL;
+
+        pthread_mutex_lock(&bucket_lock[i]);
+        for (pp = &buckets[i]; *pp != NULL; ) {
+            if (now - (*pp)->last_used >= POOL_IDLE_TIMEOUT) {
+                /* idle for too long, drop it */
+                drop(pp);
+            }
+            else if ((*pp)->port == port && !strcasecmp((*pp)->host, host)) {
+                conn = *pp;
+                *pp = conn->next;
+                break;
+            }
+            else {
+                pp = &(*pp)->next;
+            }
+        }
+        pthread_mutex_unlock(&bucket_lock[i]);
+
+        if (conn == NULL) {
+            return -1;
+        }
+
+        fd = conn->fd;
+        free(conn->host);
+        free(conn);
+
+        if (is_alive(fd)) {
+            return fd;
+        }
+
+        /* the server has closed it, try the next one */
+        close(fd);
+    }
+}
+
+/*
+ * return a connection to <host, port> to the pool
+ * the connection is closed if the origin already has enough idle ones
+ */
+void pool_put(char *host, int port, int fd){
+    size_t i = hash(host, port);
+    pool_conn **pp, *conn;
+    time_t now = time(NULL);
+    int idle = 0;
+
+    conn = Malloc(sizeof(pool_conn));
+    conn->host = strdup(host);
+    conn->port = port;
+    conn->fd = fd;
+    conn->last_used = now;
+
+    pthread_mutex_lock(&bucket_lock[i]);
+    for (pp = &buckets[i]; *pp != NULL; ) {
+        if (now - (*pp)->last_used >= POOL_IDLE_TIMEOUT) {
+            drop(pp);
+            continue;
+        }
+        if ((*pp)->port == port && !strcasecmp((*pp)->host, host)) {
+            idle++;
+        }
+        pp = &(*pp)->next;
+    }
+
+    if (idle < POOL_MAX_IDLE) {
+        conn->next = buckets[i];
+        buckets[i] = conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&bucket_lock[i]);
+
+    if (conn != NULL) {
+        /* too many idle connections to this origin */
+        close(fd);
+        free(conn->host);
+        free(conn);
+    }
+}
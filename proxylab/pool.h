@@ -0,0 +1,20 @@
+/*
+ * pool.h
+ *
+ * Pool of idle persistent connections to origin servers.
+ * Connections are grouped by (host, port) so that a later miss on the
+ * same origin can skip the DNS lookup and the TCP handshake.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define POOL_BUCKETS 64         //number of (host, port) hash buckets
+#define POOL_MAX_IDLE 8         //max idle connections kept per origin
+#define POOL_IDLE_TIMEOUT 30    //seconds before an idle connection is dropped
+
+void pool_init(void);
+int pool_get(char *host, int port);
+void pool_put(char *host, int port, int fd);
+
+#endif
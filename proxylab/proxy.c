@@ -4,25 +4,73 @@
  * 1. Implementing a simple sequential web proxy
  * 2. Dealing with multiple concurrent requests
  * 3. Implementing a cache with LRU eviction policy using linked list
+ * 4. Keeping client and server connections alive (HTTP/1.1)
+ * 5. Coalescing concurrent misses on the same uri into one fetch
+ * 6. Keeping large objects in a disk cache tier
+ * 7. Choosing the eviction policy (LRU, GDSF, S3-FIFO, W-TinyLFU)
+ *    and TinyLFU admission, logging requests to replay them
+ * 8. Serving cached objects while fresh and revalidating stale ones
+ * 9. Caching DNS answers and racing the addresses of a server
+ * 10. Parsing requests in place and sending them with writev
+ * 11. Pooling I/O buffers under a memory budget
+ * 12. Counting requests and timing them, metrics at /__stats
+ * 13. Shedding load with 503 past a connection budget and a queue,
+ *     and limiting concurrent fetches to what servers can take
+ * 14. Fetching pipelined requests ahead, timing out idle connections
+ * 15. Serving byte ranges from cache, keeping ranges that miss
+ * 16. Caching gzip variants, compressing text in background
+ * 17. Snapshotting the memory cache to warm it up after a restart
  *
  */ 
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "cache.h"
+#include "pool.h"
+#include "flight.h"
+#include "dns.h"
+#include "http.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "limit.h"
+#include "range.h"
+#include "encode.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE (1 << 20)
 #define MAX_OBJECT_SIZE 102400
 
-#define DEFAULT_PORT 80
+/* default size of the disk tier and of objects in it */
+#define MAX_DISK_SIZE (1L << 30)
+#define MAX_DISK_OBJECT_SIZE (64L << 20)
+
+/* stack of connection threads, which keep their buffers in the pool */
+#define PROXY_STACK_SIZE (256 << 10)
+
+/* persistent client connections */
+#define PROXY_PIPELINE 8            //max requests read ahead
+#define PROXY_IDLE_TIMEOUT 60       //seconds
+#define PROXY_MAX_REQUESTS 1000     //requests before the proxy closes
+
+/* fetches in threads of their own at once, prefetches and revalidations */
+#define PROXY_BACKGROUND 16
+
+/* pause of the accept loop when out of file descriptors */
+#define PROXY_ACCEPT_BACKOFF 10     //ms
+
+/* return values of relay() */
+#define RELAY_OK 0          //response relayed
+#define RELAY_RETRY 1       //server closed before responding, nothing sent
+#define RELAY_ERR -1        //relay broken in the middle
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate";
-static const char *conn_hdr = "Connection: close";
-static const char *proxy_conn_hdr = "Proxy-Connection: close";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip";
+static const char *identity_hdr = "Accept-Encoding: identity";
+static const char *conn_hdr = "Connection: keep-alive";
 
 /* inline helper functions */
 
@@ -35,253 +83,1790 @@ inline static int isUnknownHdr(char *buf){
         strncmp(buf, "Accept:", 7) &&
         strncmp(buf, "Accept-Encoding", 15) &&
         strncmp(buf, "Connection", 10) &&
-        strncmp(buf, "Proxy-Connection", 16));
+        strncmp(buf, "Proxy-Connection", 16) &&
+        strncasecmp(buf, "Keep-Alive:", 11));
 }
 
-/* construct a header for the request to sever with client header info */
-inline static void requestHdr(rio_t *rio_ptr, 
-    char *request_buf, char *host, char *filename){
-
-    char get_cmd[MAXLINE], host_hdr[MAXLINE], std_hdr[MAXLINE], append_hdr[MAXLINE];
-    char buf[MAXLINE];
+/* 
+ * return 1 if the response header is hop-by-hop or framing,
+ * which is not kept in the cache
+ */
+inline static int isHopHdr(char *buf){
+    return (!strncasecmp(buf, "Connection:", 11) ||
+        !strncasecmp(buf, "Proxy-Connection:", 17) ||
+        !strncasecmp(buf, "Keep-Alive:", 11) ||
+        !strncasecmp(buf, "Transfer-Encoding:", 18) ||
+        !strncasecmp(buf, "Content-Length:", 15));
+}
 
-    /* construct get request header */
-    sprintf(get_cmd, "GET %s HTTP/1.0\r\n", filename);
+/* return 1 if the header is a condition on the validators of object */
+inline static int isCondHdr(char *buf){
+    return (!strncasecmp(buf, "If-None-Match:", 14) ||
+        !strncasecmp(buf, "If-Modified-Since:", 18));
+}
 
-    /* construct headers for the host and suffix part */
-    strcpy(host_hdr, "");
+/* return 1 if the header is a precondition left to server to evaluate */
+inline static int isPreHdr(char *buf){
+    return (!strncasecmp(buf, "If-Match:", 9) ||
+        !strncasecmp(buf, "If-Unmodified-Since:", 20));
+}
 
-    while (Rio_readlineb(rio_ptr, buf, MAXLINE) > 0) {
-        if (!strcmp(buf, "\r\n")) {
-            break;
-        }
-        else if (!strncmp(buf, "Host:", 5)) {
-            strcpy(host_hdr, buf);
-        }
-        else if (isUnknownHdr(buf)) {
-            strcat(append_hdr, buf);
+/*
+ * return 1 if the response of server depends on conditions of the
+ * client passed on to it, so that it answers nobody else
+ */
+inline static int hasPreHdr(http_request *req){
+    if (req->has_range && req->if_range_hdr.len > 0) {
+        return 1;
+    }
+    for (int i = 0; i < req->nhdrs; i++) {
+        if (isPreHdr(req->hdrs[i].p)) {
+            return 1;
         }
     }
+    return 0;
+}
+
+/* return 1 if a Connection header asks for keep-alive */
+inline static int isKeepAlive(char *buf){
+    return strcasestr(buf, "keep-alive") != NULL;
+}
+
+/* return 1 if a Connection header asks for close */
+inline static int isClose(char *buf){
+    return strcasestr(buf, "close") != NULL;
+}
+
+/* return 1 if the header line at p of len bytes has the value of v */
+inline static int hdrValueIs(char *p, size_t len, char *v){
+    char *colon = memchr(p, ':', len), *end = p + len;
+
+    if (v == NULL || colon == NULL) {
+        return 0;
+    }
+    for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++) {
+        ;
+    }
+    while (end > p && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    return (size_t)(end - p) == strlen(v) && !memcmp(p, v, end - p);
+}
+
+/*
+ * return 1 if a range may be sent from block: the request has no
+ * If-Range, or it names the strong ETag or the Last-Modified of block
+ */
+inline static int ifRangeOk(http_request *req, cache_block *block){
+    strview *h = &req->if_range_hdr;
+
+    return h->len == 0 ||
+        (block->etag != NULL && block->etag[0] == '"' &&
+        hdrValueIs(h->p, h->len, block->etag)) ||
+        hdrValueIs(h->p, h->len, block->last_modified);
+}
+
+/* point an iovec entry to len bytes at base */
+inline static void setIov(struct iovec *iov, const char *base, size_t len){
+    iov->iov_base = (void *)base;
+    iov->iov_len = len;
+}
+
+/*
+ * construct the request to server from the parsed client request,
+ * as pieces of the client header and constant strings
+ * the server is asked to keep the connection alive
+ * the range of the client is asked for only if with_range is set,
+ * otherwise the whole object
+ * gzip is asked for if the client takes it, and for a whole object,
+ * so that the response can be cached as the variant of the client
+ * conditions of the client on validators are left out, so that the
+ * response can be shared: the client gets the object as on a hit
+ * return the number of iovec entries, at most HTTP_MAX_IOV - 6 so that
+ * validators can be added before the empty line
+ */
+inline static int requestIov(http_request *req, struct iovec *iov,
+    int with_range){
+    int n = 0;
+
+    /* an HTTP/1.0 client gets no chunked response from server */
+    setIov(&iov[n++], "GET ", 4);
+    setIov(&iov[n++], req->path.p, req->path.len);
+    setIov(&iov[n++], req->http11 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n", 11);
 
     /* if no host info in client header */
-    if (!strlen(host_hdr)) {
-        sprintf(host_hdr, "Host: %s\r\n", host);
+    if (req->host_hdr.len > 0) {
+        setIov(&iov[n++], req->host_hdr.p, req->host_hdr.len);
+    }
+    else {
+        setIov(&iov[n++], "Host: ", 6);
+        setIov(&iov[n++], req->host, strlen(req->host));
+        setIov(&iov[n++], "\r\n", 2);
     }
 
-    /* construct standard headers */
-    sprintf(std_hdr, "%s%s%s\r\n%s\r\n%s\r\n\r\n",
-        user_agent_hdr,
-        accept_hdr,
-        accept_encoding_hdr,
-        conn_hdr,
-        proxy_conn_hdr);
+    /* standard headers */
+    setIov(&iov[n++], user_agent_hdr, strlen(user_agent_hdr));
+    setIov(&iov[n++], accept_hdr, strlen(accept_hdr));
+    if (req->accept_gzip && !with_range) {
+        setIov(&iov[n++], accept_encoding_hdr, strlen(accept_encoding_hdr));
+    }
+    else {
+        setIov(&iov[n++], identity_hdr, strlen(identity_hdr));
+    }
+    setIov(&iov[n++], "\r\n", 2);
+    setIov(&iov[n++], conn_hdr, strlen(conn_hdr));
+    setIov(&iov[n++], "\r\n", 2);
 
-    /* construct header for server */
-    sprintf(request_buf, "%s%s%s%s",
-        get_cmd,
-        host_hdr,
-        std_hdr,
-        append_hdr);
+    if (with_range) {
+        setIov(&iov[n++], req->range_hdr.p, req->range_hdr.len);
+        if (req->if_range_hdr.len > 0) {
+            setIov(&iov[n++], req->if_range_hdr.p, req->if_range_hdr.len);
+        }
+    }
+
+    /* the other headers of client */
+    for (int i = 0; i < req->nhdrs; i++) {
+        if (isUnknownHdr(req->hdrs[i].p) && !isCondHdr(req->hdrs[i].p)) {
+            setIov(&iov[n++], req->hdrs[i].p, req->hdrs[i].len);
+        }
+    }
 
-    return;
+    setIov(&iov[n++], "\r\n", 2);
+    return n;
 }
 
 /* Global pointer to cache base */
 cache *cache_ptr;
 
+/* request log, one "<uri> <size>" line per request, NULL if off */
+FILE *log_fp;
+
+/* client of background revalidations, the response is only cached */
+int null_fd;
+
+/* fetches of requests with preconditions or too large, never shared */
+unsigned long alone_fetches;
+
+/* fetches running in background, see fetch_later() */
+int background;
+
+/* attributes of the threads created by proxy */
+pthread_attr_t thread_attr;
+
+/* limits of a client connection */
+int idle_timeout = PROXY_IDLE_TIMEOUT;
+int max_requests = PROXY_MAX_REQUESTS;
+int snap_interval = SNAP_INTERVAL;
+
+/* states of a client connection, counted by metrics gauges */
+#define CONN_IDLE METRIC_CONN_IDLE          //waiting for a request, holds no buffer
+#define CONN_READING METRIC_CONN_READING    //reading a request, holds a buffer
+#define CONN_ACTIVE METRIC_CONN_ACTIVE      //serving a request
+
+/* an accepted client connection */
+typedef struct client {
+    int fd;
+    uint64_t accepted;      //time of accept, see metrics_now()
+} client;
+
 /* helper function delaration */
-int parse_uri(char *uri, char *host, int *port, char *suffix);
 void *doit(void *vargp);
-void printerror(int fd, char *cause, char *errnum,
+void handle(int fd, uint64_t accepted);
+int serve(http_conn *conn, http_request *req, flight *pre);
+flight *prefetch(http_request *req);
+int fetch(int fd, flight *f, char *host, int port,
+    struct iovec *iov, int iovcnt, int keep_alive, cache_block *stale);
+int relay(int fd, int fd_server, flight *f, disk_writer **w, char *io,
+    cache_block *stale, int *keep_alive, int *server_alive,
+    uint64_t *answered);
+void revalidate_later(char *uri, char *variant, char *host, int port,
+    struct iovec *iov, int iovcnt, cache_block *block);
+int follow(int fd, flight *f, int keep_alive, int http11);
+int send_object(int fd, char *object, size_t object_size, int keep_alive);
+int send_range(int fd, char *object, size_t object_size, http_request *req,
+    int keep_alive);
+int send_slice(int fd, char *hdr, size_t hdr_size, char *data,
+    size_t first, size_t last, size_t total, int keep_alive);
+int send_unsatisfiable(int fd, size_t total, int keep_alive);
+int send_stats(int fd, int keep_alive);
+int send_busy(int fd, int keep_alive);
+int printerror(int fd, char *cause, char *errnum,
     char *shortmsg, char *longmsg);
 
+/* cache a gzip variant made by the encode pool */
+static void cache_encoded(char *key, char *object, size_t object_size){
+    cache_insert(cache_ptr, key, object, object_size);
+}
+
+/* snapshot the memory tier every snap_interval seconds */
+static void *snapshot(void *vargp){
+    (void)vargp;
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        sleep(snap_interval);
+        if (cache_snapshot(cache_ptr) < 0) {
+            fprintf(stderr, "cache snapshot: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/* print usage and exit */
+static void usage(char *name){
+    fprintf(stderr, "usage: %s [-m mem_size] [-o mem_object_size] "
+        "[-d disk_dir] [-D disk_size] [-O disk_object_size] "
+        "[-p lru|gdsf|s3fifo|wtinylfu] [-a] [-l log_file] [-H hosts_file] "
+        "[-M buffer_budget] [-C max_conns] [-Q max_queue] [-I idle_timeout] "
+        "[-R max_requests] [-r range_size] [-z encode_threads] "
+        "[-s snapshot_file] [-S snapshot_interval] <port>\n", name);
+    exit(1);
+}
+
+/* parse a size in bytes with an optional k, m or g suffix */
+static size_t parse_size(char *name, char *arg){
+    char *end;
+    size_t size = strtoul(arg, &end, 10);
+
+    switch (*end) {
+    case 'g': case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'm': case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'k': case 'K':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    if (end == arg || *end != '\0') {
+        usage(name);
+    }
+    return size;
+}
+
+/*
+ * refuse a connection under overload with a 503, counted by reason
+ * the accept loop must not block, so nothing waits for the client:
+ * what it has sent already is read so that closing does not reset the
+ * connection ahead of the response
+ */
+static void refuse(int fd, int reason){
+    char buf[1024];
+
+    metrics_count(reason, 1);
+    send_busy(fd, 0);
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        ;
+    }
+    Close(fd);
+}
 
 /* ----------------- main routine of web proxy ----------------- */
 int main(int argc, char *argv[]) {
-    int listenfd, *connfd, port, clientlen;
+    int listenfd, port, clientlen, fd;
+    uint64_t accepted;
+    client *c;
     struct sockaddr_in clientaddr;
     pthread_t pid;
+    int opt;
+
+    /* cache configuration */
+    size_t mem_size = MAX_CACHE_SIZE;
+    size_t mem_object = MAX_OBJECT_SIZE;
+    size_t disk_size = MAX_DISK_SIZE;
+    size_t disk_object = MAX_DISK_OBJECT_SIZE;
+    char *disk_dir = NULL;
+    char *policy = "lru";
+    int admit = 0;
+    char *hosts_file = NULL;
+    size_t buf_budget = BUF_BUDGET;
+    int max_conns = LIMIT_CONNS;
+    int max_queue = LIMIT_QUEUE;
+    size_t range_size = RANGE_CACHE_SIZE;
+    int encode_threads = ENCODE_THREADS;
+    char *snap_path = NULL;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "m:o:d:D:O:p:al:H:M:C:Q:I:R:r:z:s:S:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_size = parse_size(argv[0], optarg);
+            break;
+        case 'o':
+            mem_object = parse_size(argv[0], optarg);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'D':
+            disk_size = parse_size(argv[0], optarg);
+            break;
+        case 'O':
+            disk_object = parse_size(argv[0], optarg);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'a':
+            admit = 1;
+            break;
+        case 'l':
+            if ((log_fp = fopen(optarg, "a")) == NULL) {
+                unix_error("cannot open request log");
+            }
+            setvbuf(log_fp, NULL, _IOLBF, 0);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'M':
+            buf_budget = parse_size(argv[0], optarg);
+            break;
+        case 'C':
+            if ((max_conns = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'Q':
+            if ((max_queue = atoi(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'I':
+            if ((idle_timeout = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'R':
+            if ((max_requests = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            range_size = parse_size(argv[0], optarg);
+            break;
+        case 'z':
+            if ((encode_threads = atoi(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            snap_path = optarg;
+            break;
+        case 'S':
+            if ((snap_interval = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
     }
 
-    /* init cache */
-    cache_ptr = cache_init();
+    /* a peer closing a persistent connection must not kill the proxy */
+    Signal(SIGPIPE, SIG_IGN);
+    null_fd = Open("/dev/null", O_WRONLY, 0);
+
+    /* small stacks, the buffers of a connection come from the pool */
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstacksize(&thread_attr, PROXY_STACK_SIZE);
+    bufpool_init(buf_budget);
+    metrics_init();
+    limit_init(max_conns, max_queue);
+
+    /* init cache, server connection pool, flight table and name cache */
+    cache_ptr = cache_init(mem_size, mem_object, disk_dir, disk_size, disk_object,
+        policy, admit);
+    if (snap_path != NULL) {
+        /* warm start from the last snapshot of the memory tier */
+        if (cache_load_snapshot(cache_ptr, snap_path) < 0) {
+            fprintf(stderr, "cannot open cache snapshot %s: %s\n",
+                snap_path, strerror(errno));
+            exit(1);
+        }
+        Pthread_create(&pid, NULL, snapshot, NULL);
+    }
+    range_init(range_size);
+    encode_init(encode_threads, cache_encoded);
+    pool_init();
+    flight_init(mem_object);
+    dns_init(hosts_file);
 
     /* listen to port */
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
     listenfd = Open_listenfd(port);
     clientlen = sizeof(clientaddr);
 
     while (1) {
-        connfd = malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        /* create and start a new thread */
-        Pthread_create(&pid, NULL, doit, (void*)connfd);
+        /* no new connection while the buffers are over budget */
+        bufpool_wait();
+
+        /* a connection reset before accept, a signal or a lack of
+         * descriptors must not bring the proxy down */
+        if ((fd = accept(listenfd, (SA *)&clientaddr,
+            (socklen_t *)&clientlen)) < 0) {
+            if (errno == EMFILE || errno == ENFILE ||
+                errno == ENOBUFS || errno == ENOMEM) {
+                /* wait for connections to end */
+                usleep(PROXY_ACCEPT_BACKOFF * 1000);
+            }
+            else if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+                unix_error("Accept error");
+            }
+            continue;
+        }
+        accepted = metrics_now();
+
+        /* past the connection budget the connection waits for a thread
+         * to be done with its own, and is refused if the queue is full */
+        switch (limit_conn_admit(fd, accepted)) {
+        case LIMIT_RUN:
+            /* create and start a new thread */
+            c = Malloc(sizeof(client));
+            c->fd = fd;
+            c->accepted = accepted;
+            if (pthread_create(&pid, &thread_attr, doit, (void*)c) != 0) {
+                free(c);
+                limit_conn_cancel();
+                refuse(fd, METRIC_SHED_CONNS);
+            }
+            break;
+        case LIMIT_REJECT:
+            refuse(fd, METRIC_SHED_CONNS);
+            break;
+        }
     }
 
     return 0;
 }
 
+/* move a connection to another state, -1 is not counted */
+static void conn_move(int *state, int to){
+    if (*state >= 0) {
+        metrics_gauge(*state, -1);
+    }
+    if (to >= 0) {
+        metrics_gauge(to, 1);
+    }
+    *state = to;
+}
+
 /*
- * handle HTTP request/response transaction of a thread
- * clinet-----(request)----->server
- *       <------(data)-------
+ * thread of a client connection, then of the connections queued
+ * while it was served
+ * a connection that waited too long is refused, its client has
+ * likely given up or will be better served retrying
  */
-void *doit(void *connfd) {
-    int fd = *(int *)connfd;
-    int fd_server;
+void *doit(void *vargp) {
+    client *c = vargp;
+    int fd = c->fd;
+    uint64_t accepted = c->accepted;
     /* detach thread */
     Pthread_detach(pthread_self());
+    free(c);
 
-    rio_t rio;
-    char buf[MAXLINE], object_buf[MAX_OBJECT_SIZE];
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    do {
+        if (metrics_now() - accepted > LIMIT_QUEUE_WAIT * 1000000ULL) {
+            refuse(fd, METRIC_SHED_QUEUE);
+        }
+        else {
+            handle(fd, accepted);
+        }
+    } while (limit_conn_next(&fd, &accepted));
 
-    /* uri info */
-    char host[MAXLINE];
-    int port;
-    char filename[MAXLINE];
+    return NULL;
+}
+
+/*
+ * handle the requests of a client connection until the client or the
+ * proxy closes it, after max_requests or idle_timeout seconds idle
+ * pipelined requests are read together, PROXY_PIPELINE at most
+ * the buffer of the connection goes back to the pool between requests
+ * an idle connection is closed when others wait in queue
+ * a request is timed from accept for the first one of the connection,
+ * from the client starting to send for the others
+ */
+void handle(int fd, uint64_t accepted) {
+    int rc = HTTP_EOF, keep, ready, state = -1, one = 1;
+    int n, served = 0;
+    uint64_t start = accepted;      //0 until the client sends again
+    uint64_t idle = accepted;       //time the last response was sent
+    struct timeval tv = { idle_timeout, 0 };
+
+    http_conn conn;
+    http_request req[PROXY_PIPELINE];
+    flight *pre[PROXY_PIPELINE];
+    http_conn_init(&conn, fd);
+
+    /* a response is written in a few pieces, the last one must not
+     * wait for the client to acknowledge the others */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* a client stalling in the middle of a request is timed out too */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    conn_move(&state, CONN_IDLE);
+
+    while ((ready = http_conn_wait(&conn, LIMIT_IDLE_CHECK)) >= 0) {
+        if (ready == 0) {
+            /* idle too long, or the thread is better used by a
+             * waiting connection */
+            if (limit_conn_waiting() ||
+                metrics_now() - idle >= idle_timeout * 1000000000ULL) {
+                break;
+            }
+            continue;
+        }
+        if (start == 0) {
+            start = metrics_now();
+        }
+        conn_move(&state, CONN_READING);
+        if ((rc = http_read_request(&conn, &req[0])) != HTTP_OK) {
+            break;
+        }
+
+        /* the requests pipelined behind it */
+        n = 1;
+        while (n < PROXY_PIPELINE && served + n < max_requests &&
+            req[n - 1].keep_alive && http_conn_buffered(&conn)) {
+            if ((rc = http_read_request(&conn, &req[n])) != HTTP_OK) {
+                break;
+            }
+            n++;
+        }
+
+        /* their misses are fetched while the ones before are served,
+         * the responses are sent in order */
+        pre[0] = NULL;
+        for (int i = 1; i < n; i++) {
+            pre[i] = prefetch(&req[i]);
+        }
+
+        conn_move(&state, CONN_ACTIVE);
+        keep = 1;
+        for (int i = 0; i < n; i++) {
+            if (!keep) {
+                /* closed before their turn */
+                if (pre[i] != NULL) {
+                    flight_release(pre[i]);
+                }
+                continue;
+            }
+            if (++served == max_requests) {
+                req[i].keep_alive = 0;
+            }
+            metrics_request_begin(start);
+            metrics_count(METRIC_REQUESTS, 1);
+            keep = serve(&conn, &req[i], pre[i]);
+            metrics_request_end();
+        }
+        start = 0;
+        idle = metrics_now();
+
+        if (!keep) {
+            rc = HTTP_EOF;
+            break;
+        }
+        if (rc != HTTP_OK) {
+            /* a malformed request in the pipeline */
+            break;
+        }
+        conn_move(&state, http_conn_idle(&conn) ? CONN_READING : CONN_IDLE);
+    }
+
+    if (rc == HTTP_BAD || rc == HTTP_TOO_LARGE) {
+        metrics_request_begin(start);
+        metrics_count(METRIC_REQUESTS, 1);
+        if (rc == HTTP_BAD) {
+            printerror(fd, "request header", "400", "Bad Request",
+                "tianqiw's proxy cannot parse the request");
+        }
+        else {
+            printerror(fd, "request header", "431",
+                "Request Header Fields Too Large",
+                "tianqiw's proxy cannot take a request this large");
+        }
+        metrics_request_end();
+    }
+    /* or client closed the connection */
+
+    conn_move(&state, -1);
+    http_conn_close(&conn);
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    Close(fd);
+}
+
+/*
+ * handle one HTTP request/response transaction of a client connection
+ * clinet-----(request)----->server
+ *       <------(data)-------
+ * pre is the flight of a pipelined miss fetched ahead, or NULL
+ * return 1 if the connection is kept alive for the next request
+ */
+int serve(http_conn *conn, http_request *req, flight *pre) {
+    int fd = conn->fd;
+    int keep_alive, leader, rc;
+    struct iovec iov[HTTP_MAX_IOV];
+    int iovcnt;
 
     /* request method is not GET */
-    if (strcmp(method, "GET")) {
-        printerror(fd, method, "501", "Not Implemented",
+    if (strcmp(req->method, "GET")) {
+        return printerror(fd, req->method, "501", "Not Implemented",
             "tianqiw's proxy does not implement this method");
-        Close(fd);
-        return NULL;
     }
 
+    keep_alive = req->keep_alive;
+    char *uri = req->uri, *host = req->host;
+    int port = req->port;
+
+    /* request to proxy itself */
+    if (!strcmp(uri, "/__stats")) {
+        return send_stats(fd, keep_alive);
+    }
+
+    /* construct the request to server */
+    iovcnt = requestIov(req, iov, 0);
+
     /* request method is GET
-     * look for the object in cache */
-    cache_block *block = cache_match(cache_ptr, uri);
+     * look for the object in cache, the gzip variant first if the
+     * client takes it */
+    int gzip = req->accept_gzip && !req->has_range;
+    char key[MAXLINE + sizeof(ENCODE_GZIP_SUFFIX)];
+    cache_block *block = NULL;
+    int fresh;
 
-    if (block != NULL) {
+    if (gzip) {
+        encode_key(key, uri);
+        block = cache_match(cache_ptr, key);
+    }
+    if (block == NULL) {
+        block = cache_match(cache_ptr, uri);
+    }
+
+    if (block != NULL &&
+        (fresh = cache_freshness(cache_ptr, block, time(NULL))) != CACHE_STALE) {
         /* cache hit */
-        Rio_writen(fd, block->object, block->object_size);
+        metrics_count(block->tier == CACHE_MEM ? METRIC_HITS : METRIC_DISK_HITS, 1);
+        if (fresh == CACHE_STALE_OK) {
+            metrics_count(METRIC_STALE_HITS, 1);
+        }
+        if (req->has_range && ifRangeOk(req, block)) {
+            rc = send_range(fd, block->object, block->object_size, req,
+                keep_alive);
+        }
+        else {
+            rc = send_object(fd, block->object, block->object_size, keep_alive);
+            metrics_count(METRIC_CLIENT_BYTES, block->object_size);
+        }
+        if (log_fp != NULL) {
+            fprintf(log_fp, "%s %lu\n", uri, (unsigned long)block->object_size);
+        }
+
+        if (fresh == CACHE_STALE_OK && cache_revalidate_begin(cache_ptr, block)) {
+            /* served stale, the reference goes to the revalidation */
+            revalidate_later(uri, gzip ? "gzip" : "", host, port, iov, iovcnt,
+                block);
+        }
+        else {
+            cache_release(cache_ptr, block);
+        }
+        if (pre != NULL) {
+            /* fetched ahead and cached already */
+            flight_release(pre);
+        }
+        return rc;
+    }
+
+    /* a range of an object not cached whole, or stale */
+    char variant[64];
+
+    strcpy(variant, gzip ? "gzip" : "");
+    if (req->has_range) {
+        char hdr[MAXBUF];
+        size_t hdr_size;
+        range_hit hit;
+
+        if (block != NULL) {
+            cache_release(cache_ptr, block);
+            block = NULL;
+        }
+
+        /* the server decides on If-Range, validators of ranges are
+         * not kept */
+        if (req->if_range_hdr.len == 0) {
+            switch (range_find(uri, req->range_first, req->range_last, &hit,
+                hdr, MAXBUF, &hdr_size)) {
+            case RANGE_HIT:
+                metrics_count(METRIC_HITS, 1);
+                rc = send_slice(fd, hdr, hdr_size,
+                    hit.seg->data + (hit.first - hit.seg->first),
+                    hit.first, hit.last, hit.total, keep_alive);
+                range_put(hit.seg);
+                return rc;
+            case RANGE_UNSATISFIABLE:
+                return send_unsatisfiable(fd, hit.total, keep_alive);
+            }
+        }
+
+        /* fetch the range only, with those asking for the same one */
+        sprintf(variant, "bytes=%ld-%ld", req->range_first, req->range_last);
+        iovcnt = requestIov(req, iov, 1);
+    }
+
+    /* preconditions passed on to server make the response of this
+     * request alone, nobody joins a variant of its own */
+    if (hasPreHdr(req)) {
+        sprintf(variant, "alone %lu",
+            __atomic_add_fetch(&alone_fetches, 1, __ATOMIC_RELAXED));
+    }
+
+    /* cache miss, or stale block to revalidate
+     * fetch it unless another request is already doing so, or it was
+     * fetched ahead */
+    flight *f = pre;
+
+    leader = 0;
+    if (f == NULL) {
+        f = flight_join(uri, variant, &leader);
+    }
+
+    metrics_count(METRIC_MISSES, 1);
+    if (leader) {
+        rc = fetch(fd, f, host, port, iov, iovcnt, keep_alive, block);
     }
     else {
-        /* cache miss */
-        parse_uri(uri, host, &port, filename);
+        if (pre == NULL) {
+            metrics_count(METRIC_COALESCED, 1);
+        }
+        rc = follow(fd, f, keep_alive, req->http11);
 
-        /* construct the request header */
-        char request_buf[MAXLINE];
-        requestHdr(&rio, request_buf, host, filename);
+        if (rc == FLIGHT_ALONE) {
+            /* too large to share, fetched under a variant of its own */
+            flight_release(f);
+            sprintf(variant, "alone %lu",
+                __atomic_add_fetch(&alone_fetches, 1, __ATOMIC_RELAXED));
+            f = flight_join(uri, variant, &leader);
+            rc = fetch(fd, f, host, port, iov, iovcnt, keep_alive, block);
+        }
+    }
 
-        /* send request to server */
-        if ((fd_server = open_clientfd_r(host, port)) < 0) {
-            /* server connection error */
-            char longmsg[MAXBUF];
-            sprintf(longmsg, "Cannot open connection to server at <%s, %d>", host, port);
-            printerror(fd, "Connection Failed", "404", "Not Found", longmsg);
-            Close(fd);
+    if (f->state == FLIGHT_DONE) {
+        metrics_count(METRIC_CLIENT_BYTES, f->total);
+        if (log_fp != NULL) {
+            fprintf(log_fp, "%s %lu\n", uri, (unsigned long)f->total);
+        }
+    }
+    flight_release(f);
+
+    if (block != NULL) {
+        cache_release(cache_ptr, block);
+    }
+    return rc;
+}
+
+/* a fetch in background, of a stale block or of a pipelined request */
+typedef struct revalidation {
+    char uri[MAXLINE];
+    char host[HTTP_MAX_HOST];
+    int port;
+    struct iovec request;       //copy of the request to server
+    cache_block *block;         //stale block, NULL for a miss
+    flight *f;                  //flight to lead, NULL to join one
+    char variant[16];           //of the flight to join
+} revalidation;
+
+/* fetch in a thread, the response goes to cache and flight only */
+static void *revalidate(void *arg){
+    revalidation *r = arg;
+    flight *f = r->f;
+    int leader = 1;
+
+    Pthread_detach(pthread_self());
+
+    if (f == NULL) {
+        f = flight_join(r->uri, r->variant, &leader);
+    }
+    if (leader) {
+        fetch(null_fd, f, r->host, r->port, &r->request, 1, 0, r->block);
+    }
+    flight_release(f);
+
+    if (r->block != NULL) {
+        cache_revalidate_end(cache_ptr, r->block);
+    }
+    free(r->request.iov_base);
+    free(r);
+    __atomic_sub_fetch(&background, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * copy a request to server and start fetching it in a thread
+ * return -1 if PROXY_BACKGROUND fetches are running or the thread
+ * cannot be created, nothing is fetched then
+ */
+static int fetch_later(char *uri, char *variant, char *host, int port,
+    struct iovec *iov, int iovcnt, cache_block *block, flight *f){
+
+    revalidation *r;
+    pthread_t tid;
+    size_t len = 0;
+    char *p;
+
+    if (__atomic_add_fetch(&background, 1, __ATOMIC_RELAXED) > PROXY_BACKGROUND) {
+        __atomic_sub_fetch(&background, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    r = Malloc(sizeof(revalidation));
+    strcpy(r->uri, uri);
+    strcpy(r->variant, variant);
+    strcpy(r->host, host);
+    r->port = port;
+    r->block = block;
+    r->f = f;
+
+    /* the request points into the client buffer, which is reused */
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    p = Malloc(len);
+    r->request.iov_base = p;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    r->request.iov_len = len;
+
+    if (pthread_create(&tid, &thread_attr, revalidate, r) != 0) {
+        free(r->request.iov_base);
+        free(r);
+        __atomic_sub_fetch(&background, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * start revalidating a block served stale
+ * takes over the reference to block held by the caller
+ * if no fetch can start the block is left stale, a later hit retries
+ */
+void revalidate_later(char *uri, char *variant, char *host, int port,
+    struct iovec *iov, int iovcnt, cache_block *block){
+
+    if (fetch_later(uri, variant, host, port, iov, iovcnt, block, NULL) < 0) {
+        cache_revalidate_end(cache_ptr, block);
+    }
+}
+
+/*
+ * start fetching a pipelined request that misses, ahead of its turn
+ * the client joins the flight, which buffers the response until the
+ * earlier responses are sent
+ * return the flight to follow, or NULL if the request is left to serve()
+ */
+flight *prefetch(http_request *req){
+    struct iovec iov[HTTP_MAX_IOV];
+    char key[MAXLINE + sizeof(ENCODE_GZIP_SUFFIX)];
+    char *variant = req->accept_gzip ? "gzip" : "";
+    flight *f;
+    int leader;
+
+    /* a hit, or stale block which serve() revalidates */
+    if (strcmp(req->method, "GET") || req->host[0] == '\0' || req->has_range ||
+        hasPreHdr(req) || cache_contains(cache_ptr, req->uri)) {
+        return NULL;
+    }
+    if (req->accept_gzip) {
+        encode_key(key, req->uri);
+        if (cache_contains(cache_ptr, key)) {
+            return NULL;
+        }
+    }
+
+    f = flight_join(req->uri, variant, &leader);
+    if (leader) {
+        /* the first reference goes to the fetch, the client joins again
+         * as a follower before the fetch can take the flight down */
+        flight_join(req->uri, variant, &leader);
+        if (fetch_later(req->uri, variant, req->host, req->port, iov,
+            requestIov(req, iov, 0), NULL, f) < 0) {
+            /* too busy to fetch ahead, serve() fetches it in turn */
+            flight_finish(f, 0);
+            flight_release(f);
+            flight_release(f);
             return NULL;
         }
+    }
+    return f;
+}
+
+/*
+ * make the request conditional on the validators of a stale block
+ * the client gets the whole object whatever the server answers, its
+ * own conditions were left out by requestIov()
+ * a request copied by revalidate_later() is a single entry
+ * return the number of entries of dst
+ */
+static int conditional(struct iovec *dst, struct iovec *iov, int iovcnt,
+    cache_block *stale){
+
+    int n = 0;
+
+    /* the last entry is the empty line */
+    for (int i = 0; i < iovcnt - 1; i++) {
+        dst[n++] = iov[i];
+    }
+
+    if (iovcnt == 1) {
+        /* one copied request, cut off its empty line */
+        dst[0] = iov[0];
+        dst[0].iov_len -= 2;
+        n = 1;
+    }
+
+    if (stale->etag != NULL) {
+        setIov(&dst[n++], "If-None-Match: ", 15);
+        setIov(&dst[n++], stale->etag, strlen(stale->etag));
+        setIov(&dst[n++], "\r\n", 2);
+    }
+    if (stale->last_modified != NULL) {
+        setIov(&dst[n++], "If-Modified-Since: ", 19);
+        setIov(&dst[n++], stale->last_modified, strlen(stale->last_modified));
+        setIov(&dst[n++], "\r\n", 2);
+    }
+    setIov(&dst[n++], "\r\n", 2);
+
+    return n;
+}
+
+/*
+ * forward the request to server and relay the response to client
+ * and to the followers of flight
+ * an idle pooled connection is tried first, if the server has closed it
+ * before responding the request is sent again on another connection
+ * if stale is not NULL the request is made conditional on it
+ * past the limit of concurrent fetches the request is not sent, the
+ * client gets stale if there is one, or 503
+ * return 1 if the client connection is kept alive
+ */
+int fetch(int fd, flight *f, char *host, int port,
+    struct iovec *iov, int iovcnt, int keep_alive, cache_block *stale) {
+
+    int fd_server, reused, server_alive = 0, rc;
+    struct iovec cond_iov[HTTP_MAX_IOV];
+    disk_writer *w = NULL;
+    uint64_t sent, answered;
+    char *io;
+
+    if (!limit_fetch_acquire()) {
+        metrics_count(METRIC_SHED_FETCH, 1);
+        flight_finish(f, 0);
+        if (stale != NULL) {
+            return send_object(fd, stale->object, stale->object_size,
+                keep_alive);
+        }
+        return send_busy(fd, keep_alive);
+    }
+
+    if (stale != NULL) {
+        metrics_count(METRIC_REVALIDATIONS, 1);
+        iovcnt = conditional(cond_iov, iov, iovcnt, stale);
+        iov = cond_iov;
+    }
+
+    while (1) {
+        reused = 1;
+
+        if ((fd_server = pool_get(host, port)) >= 0) {
+            metrics_count(METRIC_UPSTREAM_REUSED, 1);
+        }
+        else {
+            uint64_t t0 = metrics_now();
+
+            reused = 0;
+            fd_server = dns_connect(host, port);
+            metrics_observe(METRIC_CONNECT, metrics_now() - t0);
+            metrics_count(fd_server < 0 ? METRIC_UPSTREAM_ERRORS :
+                METRIC_UPSTREAM_CONNECTS, 1);
+
+            if (fd_server < 0) {
+                /* server connection error */
+                limit_fetch_release(0, 0);
+                char longmsg[MAXBUF];
+                sprintf(longmsg, "Cannot open connection to server at <%s, %d>", host, port);
+                printerror(fd, "Connection Failed", "404", "Not Found", longmsg);
+                flight_finish(f, 0);
+                return 0;
+            }
+        }
+
+        /* send request to server */
+        sent = metrics_now();
+        answered = 0;
+        if (http_writev(fd_server, iov, iovcnt) < 0) {
+            rc = RELAY_RETRY;
+        }
+        else {
+            io = bufpool_get();
+            rc = relay(fd, fd_server, f, &w, io, stale, &keep_alive,
+                &server_alive, &answered);
+            bufpool_put(io);
+        }
+
+        if (w != NULL) {
+            /* relay failed while writing to disk store */
+            disk_abort(w);
+            w = NULL;
+        }
+
+        /* return the connection to pool if the response is complete */
+        if (rc == RELAY_OK && server_alive) {
+            pool_put(host, port, fd_server);
+        }
+        else {
+            Close(fd_server);
+        }
+
+        if (rc == RELAY_RETRY && reused) {
+            /* stale pooled connection, try again */
+            continue;
+        }
+
+        flight_finish(f, rc == RELAY_OK);
+        /* timed to the status line, the body is up to the client too */
+        limit_fetch_release(answered != 0, answered - sent);
+
+        if (rc == RELAY_RETRY) {
+            return printerror(fd, host, "502", "Bad Gateway",
+                "Server closed the connection without response");
+        }
+
+        return (rc == RELAY_OK) ? keep_alive : 0;
+    }
+}
+
+/*
+ * keep a piece of body in flight buffer, and in disk store under key
+ * once the response has grown too large for the memory tier
+ * key is NULL for a response not to be cached
+ */
+static void keep_body(flight *f, disk_writer **w, char *key, char *buf,
+    size_t n){
+
+    cache_tier *disk = &cache_ptr->tier[CACHE_DISK];
+
+    if (*w == NULL && !f->is_exceed && f->status == 200 && key != NULL &&
+        cache_ptr->dir != NULL &&
+        f->size + n > cache_ptr->tier[CACHE_MEM].max_object &&
+        (f->content_length < 0 ||
+        (size_t)f->content_length <= disk->max_object)) {
+        /* start the file with what has been buffered so far */
+        size_t body = f->hdr_size + FLIGHT_RESERVE;
+
+        *w = disk_begin(cache_ptr->dir, key, f->buf, f->hdr_size,
+            disk->max_object);
+        if (*w != NULL && disk_write(*w, f->buf + body, f->size - body) < 0) {
+            disk_abort(*w);
+            *w = NULL;
+        }
+    }
+
+    if (*w != NULL && disk_write(*w, buf, n) < 0) {
+        /* too large for disk tier as well */
+        disk_abort(*w);
+        *w = NULL;
+    }
+
+    flight_append(f, buf, n);
+    metrics_count(METRIC_UPSTREAM_BYTES, n);
+}
+
+/*
+ * keep the body of a complete 206 response in the range cache, and
+ * cache the object as a whole once its ranges add up to it
+ */
+static void keep_range(flight *f, size_t first, size_t last, size_t total){
+    char hdr[MAXBUF], *object, *p;
+    size_t hdr_size, body = f->hdr_off + f->hdr_size + FLIGHT_RESERVE;
+    range_seg *whole;
+
+    if (last < first || f->size - body != last - first + 1) {
+        return;
+    }
+    whole = range_store(f->uri, f->buf + f->hdr_off, f->hdr_size, first,
+        f->buf + body, f->size - body, total, hdr, MAXBUF, &hdr_size);
+    if (whole == NULL) {
+        return;
+    }
+
+    p = object = Malloc(hdr_size + total + 64);
+    p += sprintf(p, "HTTP/1.1 200 OK\r\n");
+    memcpy(p, hdr, hdr_size);
+    p += hdr_size;
+    p += sprintf(p, "Content-Length: %lu\r\n\r\n", (unsigned long)total);
+    memcpy(p, whole->data, total);
+    p += total;
+
+    cache_insert(cache_ptr, f->uri, object, p - object);
+    free(object);
+    range_put(whole);
+}
+
+/* publish a cached object to the followers of flight as if it was relayed */
+static void fill_flight(flight *f, char *object, size_t object_size){
+    char *p = object, *end = object + object_size, *eol;
+
+    while ((eol = memchr(p, '\n', end - p)) != NULL) {
+        eol++;
+        if (eol - p == 2 && p[0] == '\r') {
+            /* end of header */
+            p = eol;
+            break;
+        }
+        if (!isHopHdr(p)) {
+            flight_append(f, p, eol - p);
+        }
+        p = eol;
+    }
+
+    flight_header_done(f, 200, end - p);
+    flight_append(f, p, end - p);
+}
 
-        /* reset rio for server use */
-        memset(&rio, 0, sizeof(rio_t));
-        Rio_readinitb(&rio, fd_server);
-        Rio_writen(fd_server, request_buf, strlen(request_buf));
+/*
+ * get data from server and send to client
+ * the body is framed by Content-Length, chunked encoding or server close
+ * the response is kept in flight buffer for followers, then a complete
+ * 200 response small enough is inserted to cache, always with a
+ * Content-Length header so that it can be served on persistent connections
+ * larger responses are written to disk store by w as they are relayed
+ * a 304 to the conditional request for stale refreshes it, and stale is
+ * sent instead
+ * a gzip response is cached as the gzip variant, one in another coding
+ * is not cached, and an uncompressed text one is queued to be gzipped
+ * the body is relayed through io, a pool buffer of BUF_CHUNK bytes
+ * answered is set to the time the status line is read
+ */
+int relay(int fd, int fd_server, flight *f, disk_writer **w, char *io,
+    cache_block *stale, int *keep_alive, int *server_alive,
+    uint64_t *answered) {
+
+    rio_t rio;
+    char buf[MAXLINE], hdr[MAXBUF];
+    size_t hdr_len = 0;
+    int minor, status, revalidated;
+    int chunked = 0;
+    long content_length = -1;
+    unsigned long range_first = 0, range_last = 0, range_total = 0;
+    char gzip_key[MAXLINE + sizeof(ENCODE_GZIP_SUFFIX)], *key = f->uri;
+    ssize_t buflen;
+    char *object;
+    size_t object_size;
+
+    Rio_readinitb(&rio, fd_server);
+
+    /* status line */
+    if ((buflen = rio_readlineb(&rio, buf, MAXLINE)) <= 0) {
+        return RELAY_RETRY;
+    }
+    *answered = metrics_now();
+
+    if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2) {
+        return RELAY_ERR;
+    }
+
+    *server_alive = (minor >= 1);
 
-        /* get data from server and send to client */
-        size_t object_size = 0;
-        size_t buflen;
-        int is_exceed = 0;
+    /* the stale copy is still good, the 304 header only refreshes it */
+    revalidated = (status == 304 && stale != NULL);
+    if (!revalidated) {
+        flight_append(f, buf, buflen);
+    }
 
-        while ((buflen = Rio_readlineb(&rio, buf, MAXLINE))) {
-            Rio_writen(fd, buf, buflen);
+    /* headers of the response */
+    while ((buflen = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+        if (!strcmp(buf, "\r\n")) {
+            break;
+        }
 
-            /* size of the buffer exceeds the max object size
-             * discard the buffer */
-            if ((object_size + buflen) > MAX_OBJECT_SIZE) {
-                is_exceed = 1;
+        if (!strncasecmp(buf, "Content-Length:", 15)) {
+            content_length = atol(buf + 15);
+        }
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+            chunked = strcasestr(buf, "chunked") != NULL;
+        }
+        else if (!strncasecmp(buf, "Content-Encoding:", 17)) {
+            if (strcasestr(buf + 17, "gzip") != NULL && !strchr(buf, ',')) {
+                encode_key(gzip_key, f->uri);
+                key = gzip_key;
             }
-            else {
-                memcpy(object_buf + object_size, buf, buflen);
-                object_size += buflen;
+            else if (strcasestr(buf + 17, "identity") == NULL) {
+                key = NULL;
+            }
+        }
+        else if (!strncasecmp(buf, "Content-Range:", 14) &&
+            sscanf(buf + 14, " bytes %lu-%lu/%lu", &range_first, &range_last,
+            &range_total) != 3) {
+            /* size of object unknown */
+            range_total = 0;
+        }
+        else if (!strncasecmp(buf, "Connection:", 11)) {
+            if (isClose(buf)) {
+                *server_alive = 0;
+            }
+            else if (isKeepAlive(buf)) {
+                *server_alive = 1;
             }
         }
 
-        /* if not exceed the max object size, insert to cache */
-        if (!is_exceed) {
-            cache_insert(cache_ptr, uri, object_buf, object_size);
+        if (revalidated) {
+            if (hdr_len + buflen <= MAXBUF) {
+                memcpy(hdr + hdr_len, buf, buflen);
+                hdr_len += buflen;
+            }
+        }
+        else if (!isHopHdr(buf)) {
+            flight_append(f, buf, buflen);
         }
+    }
 
-        /* clear the buffer */
-        Close(fd_server);
+    if (buflen <= 0) {
+        return RELAY_ERR;
     }
 
-    Close(fd);
-    return NULL;
+    if (revalidated) {
+        metrics_count(METRIC_NOT_MODIFIED, 1);
+        cache_refresh(cache_ptr, stale, hdr, hdr_len);
+        fill_flight(f, stale->object, stale->object_size);
+        *keep_alive = send_object(fd, stale->object, stale->object_size,
+            *keep_alive);
+        return RELAY_OK;
+    }
+
+    /* responses without body */
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        chunked = 0;
+        content_length = 0;
+    }
+
+    if (chunked) {
+        content_length = -1;
+    }
+    else if (content_length < 0) {
+        /* body ends when server closes, so does the client connection */
+        *server_alive = 0;
+        *keep_alive = 0;
+    }
+
+    flight_header_done(f, status, content_length);
+
+    /* send header to client */
+    if (chunked) {
+        sprintf(buf, "Transfer-Encoding: chunked\r\n");
+    }
+    else if (content_length >= 0) {
+        sprintf(buf, "Content-Length: %ld\r\n", content_length);
+    }
+    else {
+        buf[0] = '\0';
+    }
+    strcat(buf, *keep_alive ? "Connection: keep-alive\r\n\r\n" :
+        "Connection: close\r\n\r\n");
+
+    metrics_first_byte();
+    if (rio_writen(fd, f->buf, f->hdr_size) < 0 ||
+        rio_writen(fd, buf, strlen(buf)) < 0) {
+        return RELAY_ERR;
+    }
+
+    if (content_length >= 0) {
+        /* body of known length */
+        long remaining = content_length;
+
+        while (remaining > 0) {
+            size_t want = (remaining < BUF_CHUNK) ? remaining : BUF_CHUNK;
+
+            if ((buflen = rio_readnb(&rio, io, want)) <= 0 ||
+                rio_writen(fd, io, buflen) < 0) {
+                return RELAY_ERR;
+            }
+            keep_body(f, w, key, io, buflen);
+            remaining -= buflen;
+        }
+    }
+    else if (chunked) {
+        /* relay chunks as they are, keep the decoded body */
+        while (1) {
+            long chunk_size;
+
+            if ((buflen = rio_readlineb(&rio, buf, MAXLINE)) <= 0 ||
+                rio_writen(fd, buf, buflen) < 0) {
+                return RELAY_ERR;
+            }
+
+            if ((chunk_size = strtol(buf, NULL, 16)) <= 0) {
+                break;
+            }
+
+            while (chunk_size > 0) {
+                size_t want = (chunk_size < BUF_CHUNK) ? chunk_size : BUF_CHUNK;
+
+                if ((buflen = rio_readnb(&rio, io, want)) <= 0 ||
+                    rio_writen(fd, io, buflen) < 0) {
+                    return RELAY_ERR;
+                }
+                keep_body(f, w, key, io, buflen);
+                chunk_size -= buflen;
+            }
+
+            /* CRLF after chunk data */
+            if ((buflen = rio_readlineb(&rio, buf, MAXLINE)) <= 0 ||
+                rio_writen(fd, buf, buflen) < 0) {
+                return RELAY_ERR;
+            }
+        }
+
+        /* trailer ends with an empty line */
+        do {
+            if ((buflen = rio_readlineb(&rio, buf, MAXLINE)) <= 0 ||
+                rio_writen(fd, buf, buflen) < 0) {
+                return RELAY_ERR;
+            }
+        } while (strcmp(buf, "\r\n"));
+    }
+    else {
+        /* body ends when server closes */
+        while ((buflen = rio_readnb(&rio, io, BUF_CHUNK)) > 0) {
+            if (rio_writen(fd, io, buflen) < 0) {
+                return RELAY_ERR;
+            }
+            keep_body(f, w, key, io, buflen);
+        }
+
+        if (buflen < 0) {
+            return RELAY_ERR;
+        }
+    }
+
+    /* if not exceed the max object size, insert to cache */
+    if (*w != NULL) {
+        cache_insert_disk(cache_ptr, *w);
+        *w = NULL;
+    }
+    else if (status == 200 && key != NULL &&
+        (object = flight_object(f, &object_size)) != NULL) {
+        cache_insert(cache_ptr, key, object, object_size);
+
+        if (key == f->uri && encode_compressible(object, object_size)) {
+            encode_key(gzip_key, f->uri);
+            if (!cache_contains(cache_ptr, gzip_key)) {
+                encode_later(f->uri, object, object_size);
+            }
+        }
+    }
+    else if (status == 206 && key == f->uri && range_total > 0 &&
+        !f->is_exceed) {
+        keep_range(f, range_first, range_last, range_total);
+    }
+
+    return RELAY_OK;
 }
 
-/* 
- * get host, port, filename from the uri
- * http://<host>:<port><filename>
- * if port is not provided in the uri, use DEFAULT_PORT instead
+/*
+ * send the response of a flight led by another request to client
+ * the body is framed by Content-Length when the server gave one,
+ * otherwise chunked for HTTP/1.1 clients or ended by close
+ * return 1 if the client connection is kept alive, FLIGHT_ALONE with
+ * nothing sent if the response is too large to share
  */
-int parse_uri(char *uri, char *host, int *port, char *filename){
+int follow(int fd, flight *f, int keep_alive, int http11) {
+    char hdr[MAXBUF], buf[MAXLINE], *io;
+    size_t hdr_size, offset = 0;
+    long content_length;
+    int chunked = 0, rc;
+    ssize_t n;
 
-    if (strncasecmp(uri, "http://", 7)) {
-        /* wrong uri format */
-        host[0] = '\0';
-        return -1;
+    rc = flight_wait_header(f, hdr, MAXBUF, &hdr_size, &content_length);
+    if (rc == FLIGHT_ALONE) {
+        return rc;
+    }
+    if (rc < 0) {
+        return printerror(fd, f->uri, "502", "Bad Gateway",
+            "Fetching the object from server failed");
+    }
+
+    if (content_length >= 0) {
+        sprintf(buf, "Content-Length: %ld\r\n", content_length);
+    }
+    else if (http11) {
+        sprintf(buf, "Transfer-Encoding: chunked\r\n");
+        chunked = 1;
+    }
+    else {
+        buf[0] = '\0';
+        keep_alive = 0;
+    }
+    strcat(buf, keep_alive ? "Connection: keep-alive\r\n\r\n" :
+        "Connection: close\r\n\r\n");
+
+    metrics_first_byte();
+    if (rio_writen(fd, hdr, hdr_size) < 0 ||
+        rio_writen(fd, buf, strlen(buf)) < 0) {
+        return 0;
+    }
+
+    /* stream the body as it arrives */
+    io = bufpool_get();
+    while ((n = flight_read(f, offset, io, BUF_CHUNK)) > 0) {
+        char chunk_hdr[32];
+
+        if (chunked) {
+            sprintf(chunk_hdr, "%lx\r\n", (unsigned long)n);
+            if (rio_writen(fd, chunk_hdr, strlen(chunk_hdr)) < 0) {
+                break;
+            }
+        }
+
+        if (rio_writen(fd, io, n) < 0 ||
+            (chunked && rio_writen(fd, "\r\n", 2) < 0)) {
+            break;
+        }
+        offset += n;
+    }
+    bufpool_put(io);
+
+    if (n > 0) {
+        /* client went away */
+        return 0;
     }
+    if (n < 0) {
+        /* leader failed in the middle, the response is cut */
+        return 0;
+    }
+
+    if (chunked && rio_writen(fd, "0\r\n\r\n", 5) < 0) {
+        return 0;
+    }
+
+    return keep_alive;
+}
+
+/*
+ * write a cached response to client
+ * cached objects always carry a Content-Length header,
+ * the Connection header is added at the end of the header
+ * return 1 if the client connection is kept alive
+ */
+int send_object(int fd, char *object, size_t object_size, int keep_alive) {
+    char *conn = keep_alive ? "Connection: keep-alive\r\n\r\n" :
+        "Connection: close\r\n\r\n";
+    char *end = memmem(object, object_size, "\r\n\r\n", 4);
+
+    metrics_first_byte();
+    if (end == NULL) {
+        /* no header end, send as it is */
+        rio_writen(fd, object, object_size);
+        return 0;
+    }
+
+    /* header up to the last header line, Connection, then body */
+    end += 2;
+    if (rio_writen(fd, object, end - object) < 0 ||
+        rio_writen(fd, conn, strlen(conn)) < 0 ||
+        rio_writen(fd, end + 2, object_size - (end + 2 - object)) < 0) {
+        return 0;
+    }
+
+    return keep_alive;
+}
+
+/*
+ * write a range of a cached object to client as a 206, or the whole
+ * object if its header does not fit the buffer
+ * return 1 if the client connection is kept alive
+ */
+int send_range(int fd, char *object, size_t object_size, http_request *req,
+    int keep_alive) {
+
+    char hdr[MAXBUF], *p, *eol, *body;
+    size_t hdr_size = 0, total, first, last;
+
+    if ((body = memmem(object, object_size, "\r\n\r\n", 4)) == NULL) {
+        return send_object(fd, object, object_size, keep_alive);
+    }
+    body += 4;
+    total = object + object_size - body;
+
+    if (!range_resolve(req->range_first, req->range_last, total,
+        &first, &last)) {
+        return send_unsatisfiable(fd, total, keep_alive);
+    }
+
+    /* header lines but the status line and Content-Length */
+    p = memchr(object, '\n', body - object) + 1;
+    for (; p < body - 2; p = eol) {
+        eol = memchr(p, '\n', body - p) + 1;
+        if (!strncasecmp(p, "Content-Length:", 15)) {
+            continue;
+        }
+        if (hdr_size + (eol - p) > MAXBUF) {
+            metrics_count(METRIC_CLIENT_BYTES, object_size);
+            return send_object(fd, object, object_size, keep_alive);
+        }
+        memcpy(hdr + hdr_size, p, eol - p);
+        hdr_size += eol - p;
+    }
+
+    return send_slice(fd, hdr, hdr_size, body + first, first, last, total,
+        keep_alive);
+}
+
+/*
+ * write bytes first to last of an object of total bytes as a 206,
+ * with hdr, the end-to-end header lines of object
+ * return 1 if the client connection is kept alive
+ */
+int send_slice(int fd, char *hdr, size_t hdr_size, char *data,
+    size_t first, size_t last, size_t total, int keep_alive) {
 
+    char status[] = "HTTP/1.1 206 Partial Content\r\n", tail[MAXLINE];
+    size_t len = last - first + 1;
+    struct iovec iov[4];
+
+    sprintf(tail, "Content-Range: bytes %lu-%lu/%lu\r\n"
+        "Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+        (unsigned long)first, (unsigned long)last, (unsigned long)total,
+        (unsigned long)len, keep_alive ? "keep-alive" : "close");
+
+    setIov(&iov[0], status, strlen(status));
+    setIov(&iov[1], hdr, hdr_size);
+    setIov(&iov[2], tail, strlen(tail));
+    setIov(&iov[3], data, len);
+
+    metrics_first_byte();
+    metrics_count(METRIC_CLIENT_BYTES, len);
+    if (http_writev(fd, iov, 4) < 0) {
+        return 0;
+    }
+    return keep_alive;
+}
+
+/* write a 416 for a range past the end of an object of total bytes */
+int send_unsatisfiable(int fd, size_t total, int keep_alive) {
     char buf[MAXLINE];
-    strcpy(buf, uri);
-    *port = DEFAULT_PORT;
 
-    /* ptr point to the location after http:// */
-    char *ptr = buf + 7;
+    sprintf(buf, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n"
+        "Connection: %s\r\n\r\n",
+        (unsigned long)total, keep_alive ? "keep-alive" : "close");
 
-    /* retrieve hostname */
-    while (*ptr != '/' && *ptr != ':') {
-        *host = *ptr;
-        ptr++;
-        host++;
+    metrics_first_byte();
+    if (rio_writen(fd, buf, strlen(buf)) < 0) {
+        return 0;
     }
-    *host = '\0';
+    return keep_alive;
+}
+
+/*
+ * write a 503 to a client refused under overload, it may retry in a
+ * second
+ * the response is tiny and the socket buffer empty, so it is written
+ * without blocking
+ * return 1 if the client connection is kept alive
+ */
+int send_busy(int fd, int keep_alive) {
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\nContent-Length: 0\r\n";
+    char *conn = keep_alive ? "Connection: keep-alive\r\n\r\n" :
+        "Connection: close\r\n\r\n";
+    struct iovec iov[2];
 
-    /* retrieve port number */
-    if (*ptr == ':') {
-        *ptr = '\0';
-        ptr++;
-        sscanf(ptr, "%d%s", port, ptr);
+    setIov(&iov[0], busy, sizeof(busy) - 1);
+    setIov(&iov[1], conn, strlen(conn));
+
+    metrics_first_byte();
+    if (writev(fd, iov, 2) != (ssize_t)(sizeof(busy) - 1 + strlen(conn))) {
+        return 0;
     }
+    return keep_alive;
+}
 
-    /* retrieve filename */
-    strcpy(filename, ptr);
+/*
+ * write the metrics of proxy in Prometheus text format
+ * a reading connection holds one buffer, idle ones none, the other
+ * buffers in use are shared by the active ones
+ * return 1 if the client connection is kept alive
+ */
+int send_stats(int fd, int keep_alive) {
+    char hdr[MAXLINE], *body;
+    size_t n, shared;
+    int64_t reading, active;
+    bufpool_stat st;
+    limit_stat lim;
+    size_t range_size, range_used, range_objects;
+    encode_stat enc;
+    snap_stat snap;
+    FILE *fp;
 
-    return 0;
+    if ((fp = open_memstream(&body, &n)) == NULL) {
+        return 0;
+    }
+    metrics_write(fp);
+
+    reading = metrics_gauge_value(CONN_READING);
+    active = metrics_gauge_value(CONN_ACTIVE);
+    bufpool_stats(&st);
+    /* the snapshots may disagree by a few buffers, or a gauge be
+     * caught below zero */
+    if (reading < 0) {
+        reading = 0;
+    }
+    shared = (st.in_use > (size_t)reading * BUF_CHUNK) ?
+        st.in_use - (size_t)reading * BUF_CHUNK : 0;
+
+    fprintf(fp, "# HELP proxy_buffer_bytes Bytes of pooled I/O buffers.\n"
+        "# TYPE proxy_buffer_bytes gauge\n"
+        "proxy_buffer_bytes{state=\"in_use\"} %lu\n"
+        "proxy_buffer_bytes{state=\"free\"} %lu\n"
+        "proxy_buffer_bytes{state=\"peak\"} %lu\n"
+        "proxy_buffer_bytes{state=\"budget\"} %lu\n",
+        (unsigned long)st.in_use, (unsigned long)st.free,
+        (unsigned long)st.peak, (unsigned long)st.budget);
+    fprintf(fp, "# HELP proxy_accept_waits_total Accepts delayed by the "
+        "buffer budget.\n# TYPE proxy_accept_waits_total counter\n"
+        "proxy_accept_waits_total %lu\n", st.accept_waits);
+    fprintf(fp, "# HELP proxy_connection_buffer_bytes Buffer bytes per "
+        "client connection by state.\n"
+        "# TYPE proxy_connection_buffer_bytes gauge\n"
+        "proxy_connection_buffer_bytes{state=\"idle\"} 0\n"
+        "proxy_connection_buffer_bytes{state=\"reading\"} %d\n"
+        "proxy_connection_buffer_bytes{state=\"active\"} %lu\n",
+        BUF_CHUNK, active > 0 ? (unsigned long)(shared / active) : 0);
+    fprintf(fp, "# HELP proxy_thread_stack_bytes Stack size of threads.\n"
+        "# TYPE proxy_thread_stack_bytes gauge\n"
+        "proxy_thread_stack_bytes %d\n", PROXY_STACK_SIZE);
+
+    limit_stats(&lim);
+    fprintf(fp, "# HELP proxy_connection_limit Client connections served "
+        "and waiting, and their limits.\n"
+        "# TYPE proxy_connection_limit gauge\n"
+        "proxy_connection_limit{state=\"served\"} %d\n"
+        "proxy_connection_limit{state=\"max_served\"} %d\n"
+        "proxy_connection_limit{state=\"queued\"} %d\n"
+        "proxy_connection_limit{state=\"max_queued\"} %d\n",
+        lim.conns, lim.max_conns, lim.queued, lim.max_queue);
+    fprintf(fp, "# HELP proxy_fetch_limit Fetches from servers in progress "
+        "and their adaptive limit.\n"
+        "# TYPE proxy_fetch_limit gauge\n"
+        "proxy_fetch_limit{state=\"in_flight\"} %d\n"
+        "proxy_fetch_limit{state=\"limit\"} %g\n",
+        lim.fetches, lim.fetch_limit);
+    fprintf(fp, "# HELP proxy_upstream_response_seconds Average time from "
+        "request to status line of servers.\n"
+        "# TYPE proxy_upstream_response_seconds gauge\n"
+        "proxy_upstream_response_seconds %g\n", lim.avg_response / 1e3);
+
+    range_stats(&range_size, &range_used, &range_objects);
+    fprintf(fp, "# HELP proxy_range_cache_bytes Bytes of cached ranges of "
+        "objects.\n# TYPE proxy_range_cache_bytes gauge\n"
+        "proxy_range_cache_bytes{state=\"used\"} %lu\n"
+        "proxy_range_cache_bytes{state=\"size\"} %lu\n"
+        "# HELP proxy_range_cache_objects Objects with cached ranges.\n"
+        "# TYPE proxy_range_cache_objects gauge\n"
+        "proxy_range_cache_objects %lu\n", (unsigned long)range_used,
+        (unsigned long)range_size, (unsigned long)range_objects);
+
+    encode_stats(&enc);
+    fprintf(fp, "# HELP proxy_encode_jobs_total Responses handed to be "
+        "gzipped, by result.\n# TYPE proxy_encode_jobs_total counter\n"
+        "proxy_encode_jobs_total{result=\"queued\"} %lu\n"
+        "proxy_encode_jobs_total{result=\"dropped\"} %lu\n"
+        "proxy_encode_jobs_total{result=\"encoded\"} %lu\n"
+        "proxy_encode_jobs_total{result=\"not_worth\"} %lu\n"
+        "# HELP proxy_encode_bytes_total Bytes of bodies gzipped, before "
+        "and after.\n# TYPE proxy_encode_bytes_total counter\n"
+        "proxy_encode_bytes_total{side=\"in\"} %lu\n"
+        "proxy_encode_bytes_total{side=\"out\"} %lu\n",
+        enc.queued, enc.dropped, enc.encoded, enc.not_worth,
+        enc.bytes_in, enc.bytes_out);
+
+    if (cache_snapshot_stats(cache_ptr, &snap)) {
+        fprintf(fp, "# HELP proxy_snapshots_total Snapshots of the memory "
+            "cache written, and rewrites of the file.\n"
+            "# TYPE proxy_snapshots_total counter\n"
+            "proxy_snapshots_total{kind=\"append\"} %lu\n"
+            "proxy_snapshots_total{kind=\"rewrite\"} %lu\n"
+            "# HELP proxy_snapshot_bytes Bytes of the snapshot file, and of "
+            "the objects of its last snapshot.\n"
+            "# TYPE proxy_snapshot_bytes gauge\n"
+            "proxy_snapshot_bytes{state=\"file\"} %lu\n"
+            "proxy_snapshot_bytes{state=\"live\"} %lu\n"
+            "# HELP proxy_snapshot_objects Objects of the last snapshot.\n"
+            "# TYPE proxy_snapshot_objects gauge\n"
+            "proxy_snapshot_objects %lu\n",
+            snap.snapshots, snap.compactions, (unsigned long)snap.file_size,
+            (unsigned long)snap.live, (unsigned long)snap.objects);
+    }
+    fclose(fp);
+
+    sprintf(hdr, "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+        (unsigned long)n, keep_alive ? "keep-alive" : "close");
+
+    metrics_first_byte();
+    if (rio_writen(fd, hdr, strlen(hdr)) < 0 ||
+        rio_writen(fd, body, n) < 0) {
+        keep_alive = 0;
+    }
+    free(body);
+    return keep_alive;
 }
 
-/* print error message using HTTP response */
-void printerror(int fd, char *cause, char *errnum,
+/*
+ * print error message using HTTP response
+ * return 0, the connection is closed after an error, or when the client
+ * is gone before it is written
+ */
+int printerror(int fd, char *cause, char *errnum,
     char *shortmsg, char *longmsg){
 
-    char buf[MAXLINE], body[MAXBUF];
+    char hdr[MAXLINE];
+    struct iovec iov[10];
+    size_t len = 0;
+    int n = 1;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy Web server</em>\r\n", body);
+    setIov(&iov[n++], "<html><title>Proxy Error</title>"
+        "<body bgcolor=ffffff>\r\n", 55);
+    setIov(&iov[n++], errnum, strlen(errnum));
+    setIov(&iov[n++], ": ", 2);
+    setIov(&iov[n++], shortmsg, strlen(shortmsg));
+    setIov(&iov[n++], "\r\n<p>", 5);
+    setIov(&iov[n++], longmsg, strlen(longmsg));
+    setIov(&iov[n++], ": ", 2);
+    setIov(&iov[n++], cause, strlen(cause));
+    setIov(&iov[n++], "\r\n<hr><em>The Proxy Web server</em>\r\n", 37);
+    for (int i = 1; i < n; i++) {
+        len += iov[i].iov_len;
+    }
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    metrics_count(METRIC_ERRORS, 1);
+    metrics_first_byte();
+    sprintf(hdr, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+        "Content-length: %lu\r\nConnection: close\r\n\r\n",
+        errnum, shortmsg, (unsigned long)len);
+    setIov(&iov[0], hdr, strlen(hdr));
+    http_writev(fd, iov, n);
+    return 0;
 }
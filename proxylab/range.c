@@ -0,0 +1,339 @@
+/*
+ * range.c
+ *
+ * Objects are in a hash table keyed by uri and on an LRU list, both
+ * under one lock. A segment is never changed once made: merging makes
+ * a new segment with the bytes of the old ones and unlinks them, so a
+ * request still sending an old one keeps it alive by its reference.
+ *
+ * The header kept for an object has its end-to-end lines only, without
+ * status line, Content-Range and Content-Length, which depend on the
+ * range sent.
+ */
+
+#include "csapp.h"
+#include "fresh.h"
+#include "range.h"
+
+typedef struct range_obj {
+    char *uri;
+    size_t total;               //size of object
+    char *hdr;
+    size_t hdr_size;
+    char etag[FRESH_TAG_LEN];   //validators of the version kept
+    char last_modified[FRESH_TAG_LEN];
+    time_t fresh_until;
+    range_seg *segs;
+    size_t bytes;               //bytes of segs
+    struct range_obj *hnext;    //hash chain
+    struct range_obj *prev;     //LRU list, most recent first
+    struct range_obj *next;
+} range_obj;
+
+static struct {
+    range_obj *table[RANGE_BUCKETS];
+    range_obj *head;
+    range_obj *tail;
+    size_t size;
+    size_t used;                //bytes of all segments
+    size_t objects;
+    pthread_mutex_t lock;
+} rc = { .lock = PTHREAD_MUTEX_INITIALIZER, .size = RANGE_CACHE_SIZE };
+
+/* return the bucket index of a uri */
+static inline size_t hash(char *uri){
+    size_t h = 5381;
+
+    while (*uri) {
+        h = h * 33 + (unsigned char)*uri++;
+    }
+    return h % RANGE_BUCKETS;
+}
+
+static range_obj *lookup(char *uri){
+    range_obj *obj;
+
+    for (obj = rc.table[hash(uri)]; obj != NULL; obj = obj->hnext) {
+        if (!strcmp(obj->uri, uri)) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(range_obj *obj){
+    if (obj->prev != NULL) {
+        obj->prev->next = obj->next;
+    }
+    else {
+        rc.head = obj->next;
+    }
+    if (obj->next != NULL) {
+        obj->next->prev = obj->prev;
+    }
+    else {
+        rc.tail = obj->prev;
+    }
+}
+
+static void lru_push(range_obj *obj){
+    obj->prev = NULL;
+    obj->next = rc.head;
+    if (rc.head != NULL) {
+        rc.head->prev = obj;
+    }
+    else {
+        rc.tail = obj;
+    }
+    rc.head = obj;
+}
+
+/* drop a reference to a segment, called with the lock held */
+static void seg_release(range_seg *seg){
+    if (--seg->refcnt == 0) {
+        free(seg);
+    }
+}
+
+/* remove an object and its segments */
+static void drop(range_obj *obj){
+    range_obj **pp;
+    range_seg *seg, *next;
+
+    for (pp = &rc.table[hash(obj->uri)]; *pp != obj; pp = &(*pp)->hnext) {
+        ;
+    }
+    *pp = obj->hnext;
+    lru_unlink(obj);
+
+    for (seg = obj->segs; seg != NULL; seg = next) {
+        next = seg->next;
+        seg_release(seg);
+    }
+    rc.used -= obj->bytes;
+    rc.objects--;
+
+    free(obj->hdr);
+    free(obj->uri);
+    free(obj);
+}
+
+/* keep the end-to-end lines of a response header */
+static void set_hdr(range_obj *obj, char *hdr, size_t hdr_size){
+    char *p = hdr, *end = hdr + hdr_size, *eol, *q;
+
+    free(obj->hdr);
+    obj->hdr = q = Malloc(hdr_size);
+
+    /* skip the status line */
+    if ((eol = memchr(p, '\n', end - p)) != NULL) {
+        p = eol + 1;
+    }
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        eol++;
+        if (strncasecmp(p, "Content-Range:", 14) &&
+            strncasecmp(p, "Content-Length:", 15)) {
+            memcpy(q, p, eol - p);
+            q += eol - p;
+        }
+        p = eol;
+    }
+    obj->hdr_size = q - obj->hdr;
+}
+
+void range_init(size_t size){
+    rc.size = size;
+}
+
+/*
+ * resolve a range of a request against the size of object
+ * first is -1 for the last `last` bytes, last is -1 up to the end
+ * return 0 if no byte of it is in the object
+ */
+int range_resolve(long first, long last, size_t total,
+    size_t *from, size_t *to){
+
+    if (total == 0) {
+        return 0;
+    }
+    if (first < 0) {
+        if (last <= 0) {
+            return 0;
+        }
+        *from = ((size_t)last >= total) ? 0 : total - last;
+    }
+    else {
+        if ((size_t)first >= total) {
+            return 0;
+        }
+        *from = first;
+    }
+    *to = (first < 0 || last < 0 || (size_t)last >= total) ? total - 1 : (size_t)last;
+    return 1;
+}
+
+/*
+ * look for a segment holding the whole of a range
+ * on a hit the segment is held and the header of object copied to hdr
+ */
+int range_find(char *uri, long first, long last, range_hit *hit,
+    char *hdr, size_t maxlen, size_t *hdr_size){
+
+    range_obj *obj;
+    range_seg *seg;
+    int found = RANGE_MISS;
+
+    pthread_mutex_lock(&rc.lock);
+    if ((obj = lookup(uri)) != NULL && time(NULL) >= obj->fresh_until) {
+        drop(obj);
+        obj = NULL;
+    }
+
+    if (obj != NULL) {
+        if (!range_resolve(first, last, obj->total, &hit->first, &hit->last)) {
+            found = RANGE_UNSATISFIABLE;
+            hit->total = obj->total;
+        }
+        else if (obj->hdr_size <= maxlen) {
+            for (seg = obj->segs; seg != NULL && seg->first <= hit->first;
+                seg = seg->next) {
+                if (seg->first + seg->len > hit->last) {
+                    seg->refcnt++;
+                    hit->seg = seg;
+                    hit->total = obj->total;
+                    memcpy(hdr, obj->hdr, obj->hdr_size);
+                    *hdr_size = obj->hdr_size;
+                    lru_unlink(obj);
+                    lru_push(obj);
+                    found = RANGE_HIT;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&rc.lock);
+
+    return found;
+}
+
+/* give back a segment found by range_find() or range_store() */
+void range_put(range_seg *seg){
+    pthread_mutex_lock(&rc.lock);
+    seg_release(seg);
+    pthread_mutex_unlock(&rc.lock);
+}
+
+/*
+ * keep the body of a 206 response, len bytes at offset first of an
+ * object of total bytes, hdr is the header of response
+ * return the segment of the whole object, held, if this completes it;
+ * the object then leaves the range cache and whole_hdr gets its header
+ */
+range_seg *range_store(char *uri, char *hdr, size_t hdr_size,
+    size_t first, char *data, size_t len, size_t total,
+    char *whole_hdr, size_t maxlen, size_t *whole_hdr_size){
+
+    range_obj *obj;
+    range_seg *seg, **pp, *next, *whole = NULL;
+    size_t lo = first, hi = first + len;
+    time_t stale_until;
+    fresh_hdr h;
+
+    if (len == 0 || len > rc.size || hi > total) {
+        return NULL;
+    }
+
+    fresh_init(&h);
+    fresh_scan(&h, hdr, hdr_size);
+    if (h.no_store || h.vary_other) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rc.lock);
+
+    /* another version of the object, its segments cannot be merged */
+    if ((obj = lookup(uri)) != NULL && (obj->total != total ||
+        strcmp(obj->etag, h.etag) ||
+        strcmp(obj->last_modified, h.last_modified))) {
+        drop(obj);
+        obj = NULL;
+    }
+
+    if (obj == NULL) {
+        obj = Calloc(1, sizeof(range_obj));
+        obj->uri = strdup(uri);
+        obj->total = total;
+        strcpy(obj->etag, h.etag);
+        strcpy(obj->last_modified, h.last_modified);
+        obj->hnext = rc.table[hash(uri)];
+        rc.table[hash(uri)] = obj;
+        lru_push(obj);
+        rc.objects++;
+    }
+    else {
+        lru_unlink(obj);
+        lru_push(obj);
+    }
+    set_hdr(obj, hdr, hdr_size);
+    fresh_lifetime(&h, time(NULL), &obj->fresh_until, &stale_until);
+
+    /* the segments the new one overlaps or touches */
+    for (pp = &obj->segs; *pp != NULL && (*pp)->first + (*pp)->len < first;
+        pp = &(*pp)->next) {
+        ;
+    }
+    for (seg = *pp; seg != NULL && seg->first <= first + len; seg = seg->next) {
+        lo = (seg->first < lo) ? seg->first : lo;
+        hi = (seg->first + seg->len > hi) ? seg->first + seg->len : hi;
+    }
+
+    if (*pp == NULL || (*pp)->first > lo || (*pp)->first + (*pp)->len < hi) {
+        /* a segment of the union, replacing the ones it covers */
+        range_seg *merged = Malloc(sizeof(range_seg) + (hi - lo));
+
+        merged->first = lo;
+        merged->len = hi - lo;
+        merged->refcnt = 1;
+
+        for (seg = *pp; seg != NULL && seg->first <= first + len; seg = next) {
+            next = seg->next;
+            memcpy(merged->data + (seg->first - lo), seg->data, seg->len);
+            obj->bytes -= seg->len;
+            rc.used -= seg->len;
+            seg_release(seg);
+        }
+        memcpy(merged->data + (first - lo), data, len);
+
+        merged->next = seg;
+        *pp = merged;
+        obj->bytes += merged->len;
+        rc.used += merged->len;
+    }
+
+    if (obj->segs->first == 0 && obj->segs->len == total &&
+        obj->hdr_size <= maxlen) {
+        /* whole, to be cached as a full object */
+        whole = obj->segs;
+        whole->refcnt++;
+        memcpy(whole_hdr, obj->hdr, obj->hdr_size);
+        *whole_hdr_size = obj->hdr_size;
+        drop(obj);
+    }
+
+    /* evict least recently used objects, this one the last */
+    while (rc.used > rc.size) {
+        drop(rc.tail);
+    }
+    pthread_mutex_unlock(&rc.lock);
+
+    return whole;
+}
+
+/* get the size of the range cache, bytes used and number of objects */
+void range_stats(size_t *size, size_t *used, size_t *objects){
+    pthread_mutex_lock(&rc.lock);
+    *size = rc.size;
+    *used = rc.used;
+    *objects = rc.objects;
+    pthread_mutex_unlock(&rc.lock);
+}
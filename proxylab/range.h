@@ -0,0 +1,59 @@
+/*
+ * range.h
+ *
+ * Sparse cache of partial objects. The 206 responses to range requests
+ * that miss are kept as segments of their object: byte ranges sorted
+ * by offset, apart from each other, so that a new range overlapping
+ * or touching others is merged with them into one segment. A request
+ * for a range inside a segment is served from it. Once the segments
+ * of an object merge into the whole of it, it is handed back to be
+ * cached as a full object.
+ *
+ * Segments of an object must come from the same version of it: a
+ * response with another size or validators replaces all of them.
+ * Objects are evicted whole in LRU order past the size of the cache.
+ */
+
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define RANGE_BUCKETS 256
+#define RANGE_CACHE_SIZE (16L << 20)    //default bytes of segments
+
+/* return values of range_find() */
+#define RANGE_MISS 0
+#define RANGE_HIT 1
+#define RANGE_UNSATISFIABLE 2       //starts past the end of object
+
+/* a range of bytes of an object, shared by the requests sending it */
+typedef struct range_seg {
+    size_t first;               //offset of data in object
+    size_t len;
+    int refcnt;                 //1 while in its object, 1 per request
+    struct range_seg *next;     //next segment of object by offset
+    char data[];
+} range_seg;
+
+/* a range to send, found by range_find() */
+typedef struct range_hit {
+    range_seg *seg;             //held, give back with range_put()
+    size_t first;               //range in object, last inclusive
+    size_t last;
+    size_t total;               //size of object
+} range_hit;
+
+void range_init(size_t size);
+int range_resolve(long first, long last, size_t total,
+    size_t *from, size_t *to);
+int range_find(char *uri, long first, long last, range_hit *hit,
+    char *hdr, size_t maxlen, size_t *hdr_size);
+void range_put(range_seg *seg);
+range_seg *range_store(char *uri, char *hdr, size_t hdr_size,
+    size_t first, char *data, size_t len, size_t total,
+    char *whole_hdr, size_t maxlen, size_t *whole_hdr_size);
+void range_stats(size_t *size, size_t *used, size_t *objects);
+
+#endif
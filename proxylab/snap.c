@@ -0,0 +1,350 @@
+/*
+ * snap.c
+ *
+ * The file starts with a snap_record of type 0, so that no object is at
+ * offset 0. A SNAP_OBJECT record holds
+ * [uri length][object size][uri NUL-terminated, 8-aligned][object]
+ * and a SNAP_COMMIT record
+ * [number of entries][FNV-1a hash of entries][snap_entry...]
+ * The hash tells a whole commit from one cut short at the end of file.
+ *
+ * Objects are written first and synced, then the commit, so a whole
+ * commit never lists an object that did not reach the disk. Records past
+ * the last whole commit are cut off on startup.
+ *
+ * A rewrite goes to path.tmp and is renamed over the file once it has
+ * its commit. The objects still mapped from the old file keep it alive.
+ */
+
+#include "csapp.h"
+#include "snap.h"
+
+/* round up to a multiple of 8 */
+static inline uint64_t align8(uint64_t n){
+    return (n + 7) & ~(uint64_t)7;
+}
+
+/* hash the entries of a commit (FNV-1a) */
+static uint64_t entries_hash(snap_entry *entries, size_t n){
+    unsigned char *p = (unsigned char *)entries;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < n * sizeof(snap_entry); i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* write the whole buffer at offset, return -1 on error */
+static int pwriten(int fd, void *buf, size_t n, off_t off){
+    char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = pwrite(fd, p, n, off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += rc;
+        off += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+/* write the record that starts a file, return -1 on error */
+static int write_start(int fd){
+    snap_record rec = { SNAP_MAGIC, 0, 0 };
+
+    if (ftruncate(fd, 0) < 0) {
+        return -1;
+    }
+    return pwriten(fd, &rec, sizeof(rec), 0);
+}
+
+/* return the record at off of a mapping of size bytes, NULL if invalid */
+static snap_record *record_at(char *map, size_t size, uint64_t off){
+    snap_record *rec;
+
+    if (off % 8 != 0 || off + sizeof(snap_record) > size) {
+        return NULL;
+    }
+    rec = (snap_record *)(map + off);
+    if (rec->magic != SNAP_MAGIC ||
+        rec->size > size - off - sizeof(snap_record)) {
+        return NULL;
+    }
+    return rec;
+}
+
+/* return 1 if a SNAP_COMMIT record is whole */
+static int commit_ok(snap_record *rec){
+    uint64_t *p = (uint64_t *)(rec + 1);
+
+    return rec->size >= 2 * sizeof(uint64_t) &&
+        p[0] <= (rec->size - 2 * sizeof(uint64_t)) / sizeof(snap_entry) &&
+        rec->size == 2 * sizeof(uint64_t) + p[0] * sizeof(snap_entry) &&
+        p[1] == entries_hash((snap_entry *)(p + 2), p[0]);
+}
+
+/*
+ * find the object of a SNAP_OBJECT record at off
+ * return 0 if the record is not a valid one
+ */
+static int object_at(char *map, size_t size, uint64_t off,
+    char **uri, char **object, size_t *object_size){
+
+    snap_record *rec = record_at(map, size, off);
+    uint64_t *p, uri_off;
+
+    if (rec == NULL || rec->type != SNAP_OBJECT ||
+        rec->size < 2 * sizeof(uint64_t)) {
+        return 0;
+    }
+    p = (uint64_t *)(rec + 1);
+    uri_off = 2 * sizeof(uint64_t);
+    if (p[0] >= rec->size || p[1] > rec->size ||
+        uri_off + align8(p[0] + 1) + p[1] > rec->size) {
+        return 0;
+    }
+
+    *uri = (char *)p + uri_off;
+    if ((*uri)[p[0]] != '\0') {
+        return 0;
+    }
+    *object = *uri + align8(p[0] + 1);
+    *object_size = p[1];
+    return 1;
+}
+
+/*
+ * open the snapshot file at path, creating it if needed
+ * the objects of the last whole commit are passed to fn, pointing into
+ * a mapping of the file
+ * return NULL on error
+ */
+snap_file *snap_open(char *path, snap_load_fn *fn, void *arg){
+    snap_file *s;
+    snap_record *rec, *commit = NULL;
+    struct stat st;
+    uint64_t off, end;
+    char *map = NULL;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    end = sizeof(snap_record);
+    if ((size_t)st.st_size >= sizeof(snap_record)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        }
+    }
+
+    if (map != NULL && (rec = record_at(map, st.st_size, 0)) != NULL &&
+        rec->type == 0) {
+        /* find the last whole commit */
+        off = sizeof(snap_record);
+        while ((rec = record_at(map, st.st_size, off)) != NULL) {
+            if (rec->type == SNAP_COMMIT) {
+                if (!commit_ok(rec)) {
+                    break;
+                }
+                commit = rec;
+                end = off + sizeof(snap_record) + rec->size;
+            }
+            off += sizeof(snap_record) + align8(rec->size);
+        }
+    }
+
+    s = Malloc(sizeof(snap_file));
+    memset(s, 0, sizeof(snap_file));
+    s->path = strdup(path);
+    s->fd = fd;
+    s->tmp_fd = -1;
+
+    if (commit != NULL) {
+        snap_map *m = Malloc(sizeof(snap_map));
+        uint64_t *p = (uint64_t *)(commit + 1);
+        snap_entry *e = (snap_entry *)(p + 2);
+        char *uri, *object;
+        size_t object_size;
+
+        m->base = map;
+        m->size = st.st_size;
+        m->refcnt = 1;
+
+        for (uint64_t i = 0; i < p[0]; i++) {
+            if (e[i].off < end &&
+                object_at(map, end, e[i].off, &uri, &object, &object_size)) {
+                fn(arg, m, e[i].off, uri, object, object_size,
+                    e[i].fresh_until, e[i].stale_until);
+                s->st.live += object_size;
+                s->st.objects++;
+            }
+        }
+        snap_map_put(m);
+
+        /* objects after the last commit were never listed */
+        if (ftruncate(fd, end) < 0) {
+            end = st.st_size;
+        }
+    }
+    else {
+        if (map != NULL) {
+            munmap(map, st.st_size);
+        }
+        if (write_start(fd) < 0) {
+            close(fd);
+            free(s->path);
+            free(s);
+            return NULL;
+        }
+    }
+
+    s->size = end;
+    s->st.file_size = end;
+    return s;
+}
+
+/* drop a reference to a mapping, called with the lock of its users held */
+void snap_map_put(snap_map *map){
+    if (--map->refcnt == 0) {
+        munmap(map->base, map->size);
+        free(map);
+    }
+}
+
+/*
+ * start a snapshot of objects of live bytes
+ * return 1 if the file is rewritten, then every object is to be appended
+ * again, 0 if only the new ones are
+ */
+int snap_begin(snap_file *s, size_t live){
+    char tmp[MAXLINE];
+
+    if (s->size < SNAP_COMPACT_MIN || s->size <= live * SNAP_COMPACT_RATIO) {
+        return 0;
+    }
+
+    snprintf(tmp, MAXLINE, "%s.tmp", s->path);
+    if ((s->tmp_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return 0;
+    }
+    if (write_start(s->tmp_fd) < 0) {
+        close(s->tmp_fd);
+        unlink(tmp);
+        s->tmp_fd = -1;
+        return 0;
+    }
+
+    s->compacting = 1;
+    s->tmp_size = sizeof(snap_record);
+    return 1;
+}
+
+/*
+ * append an object to the file
+ * return the offset of its record, 0 on error
+ */
+uint64_t snap_append(snap_file *s, char *uri, char *object, size_t object_size){
+    int fd = s->compacting ? s->tmp_fd : s->fd;
+    size_t *size = s->compacting ? &s->tmp_size : &s->size;
+    size_t uri_len = strlen(uri), head_len;
+    char head[sizeof(snap_record) + 2 * sizeof(uint64_t) + MAXLINE + 8];
+    snap_record *rec = (snap_record *)head;
+    uint64_t *p = (uint64_t *)(rec + 1), off = *size;
+    static const char pad[8];
+
+    if (uri_len >= MAXLINE) {
+        return 0;
+    }
+
+    head_len = sizeof(snap_record) + 2 * sizeof(uint64_t) + align8(uri_len + 1);
+    memset(head, 0, head_len);
+    rec->magic = SNAP_MAGIC;
+    rec->type = SNAP_OBJECT;
+    rec->size = head_len - sizeof(snap_record) + object_size;
+    p[0] = uri_len;
+    p[1] = object_size;
+    memcpy(p + 2, uri, uri_len);
+
+    if (pwriten(fd, head, head_len, off) < 0 ||
+        pwriten(fd, object, object_size, off + head_len) < 0 ||
+        pwriten(fd, (char *)pad, align8(object_size) - object_size,
+        off + head_len + object_size) < 0) {
+        return 0;
+    }
+
+    *size = off + sizeof(snap_record) + align8(rec->size);
+    s->st.written += object_size;
+    return off;
+}
+
+/*
+ * end a snapshot with the commit of its objects, of live bytes
+ * a rewritten file replaces the old one
+ * return -1 on error, the offsets of a rewrite are then not valid
+ */
+int snap_commit(snap_file *s, snap_entry *entries, size_t n, size_t live){
+    int fd = s->compacting ? s->tmp_fd : s->fd;
+    size_t *size = s->compacting ? &s->tmp_size : &s->size;
+    size_t len = sizeof(snap_record) + 2 * sizeof(uint64_t) +
+        n * sizeof(snap_entry);
+    char *buf = Malloc(len), tmp[MAXLINE];
+    snap_record *rec = (snap_record *)buf;
+    uint64_t *p = (uint64_t *)(rec + 1);
+    int rc = 0;
+
+    rec->magic = SNAP_MAGIC;
+    rec->type = SNAP_COMMIT;
+    rec->size = len - sizeof(snap_record);
+    p[0] = n;
+    p[1] = entries_hash(entries, n);
+    memcpy(p + 2, entries, n * sizeof(snap_entry));
+
+    /* the objects reach the disk before the commit listing them */
+    if (fdatasync(fd) < 0 || pwriten(fd, buf, len, *size) < 0) {
+        rc = -1;
+    }
+    else {
+        *size += align8(len);
+    }
+    free(buf);
+
+    if (s->compacting) {
+        snprintf(tmp, MAXLINE, "%s.tmp", s->path);
+        if (rc == 0 && (fdatasync(fd) < 0 || rename(tmp, s->path) < 0)) {
+            rc = -1;
+        }
+
+        if (rc == 0) {
+            close(s->fd);
+            s->fd = s->tmp_fd;
+            s->size = s->tmp_size;
+            s->st.compactions++;
+        }
+        else {
+            close(s->tmp_fd);
+            unlink(tmp);
+        }
+        s->tmp_fd = -1;
+        s->compacting = 0;
+    }
+
+    if (rc == 0) {
+        s->st.snapshots++;
+        s->st.live = live;
+        s->st.objects = n;
+    }
+    s->st.file_size = s->size;
+    return rc;
+}
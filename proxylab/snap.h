@@ -0,0 +1,85 @@
+/*
+ * snap.h
+ *
+ * Snapshots of the memory cache tier, so that it is warm seconds after
+ * a restart. The snapshot file is append-only: a snapshot appends the
+ * objects cached since the last one, then a commit record listing every
+ * live object of the file with its freshness. A restart takes the last
+ * whole commit, so a snapshot cut short by a crash leaves the previous
+ * one in place.
+ *
+ * On startup the file is mapped and the objects of the commit are
+ * handed out as pointers into the mapping, bodies are not copied. The
+ * mapping is shared by those objects and unmapped with the last of them.
+ * Once most of the file is dead, a snapshot rewrites it with the live
+ * objects only.
+ */
+
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define SNAP_MAGIC 0x4e53504bU      //"KPSN"
+#define SNAP_INTERVAL 60            //default seconds between snapshots
+#define SNAP_COMPACT_MIN (1L << 20) //smaller files are not rewritten
+#define SNAP_COMPACT_RATIO 2        //rewrite past this file size over live
+
+/* types of snap_record */
+#define SNAP_OBJECT 1
+#define SNAP_COMMIT 2
+
+/* head of a record, size bytes follow, the next record is 8-aligned */
+typedef struct snap_record {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t size;
+} snap_record;
+
+/* an object of a commit, off is that of its SNAP_OBJECT record */
+typedef struct snap_entry {
+    uint64_t off;
+    int64_t fresh_until;
+    int64_t stale_until;
+} snap_entry;
+
+/* a mapping of the file, shared by the objects loaded from it */
+typedef struct snap_map {
+    char *base;
+    size_t size;
+    int refcnt;
+} snap_map;
+
+/* counts of snapshots, and the bytes of the file */
+typedef struct snap_stat {
+    unsigned long snapshots;
+    unsigned long compactions;
+    unsigned long written;          //bytes of objects appended
+    size_t file_size;
+    size_t live;                    //bytes of objects of the last commit
+    size_t objects;
+} snap_stat;
+
+/* the snapshot file, used by one thread at a time */
+typedef struct snap_file {
+    char *path;
+    int fd;
+    size_t size;
+    int compacting;                 //objects go to path.tmp
+    int tmp_fd;
+    size_t tmp_size;
+    snap_stat st;
+} snap_file;
+
+/* called for every object of the last commit on startup */
+typedef void snap_load_fn(void *arg, snap_map *map, uint64_t off, char *uri,
+    char *object, size_t object_size, time_t fresh_until, time_t stale_until);
+
+snap_file *snap_open(char *path, snap_load_fn *fn, void *arg);
+void snap_map_put(snap_map *map);
+int snap_begin(snap_file *s, size_t live);
+uint64_t snap_append(snap_file *s, char *uri, char *object, size_t object_size);
+int snap_commit(snap_file *s, snap_entry *entries, size_t n, size_t live);
+
+#endif